@@ -0,0 +1,275 @@
+// Kernel benchmarks, reported one per line as key=value pairs
+// for scripts to compare from run to run:
+//   bench [-p workers] [-n scale] [test...]
+// Each test runs in workers processes at once; the time is
+// from starting the first to the last one finishing.
+// scale multiplies every test's iteration count.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define FILESZ (256*1024)  // bytes for the seqrw test
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+int scale = 1;
+char buf[8192];
+
+void
+fail(char *what)
+{
+  printf(2, "bench: %s failed\n", what);
+  exit();
+}
+
+// Each test does its work w times over from worker w's point of
+// view and returns the number of operations it did, setting
+// *bytes to the bytes moved per operation if that is the measure.
+
+int
+forkexec(int w, int *bytes)
+{
+  char *argv[] = { "bench", "-x", 0 };
+  int i, n, pid;
+
+  n = 20*scale;
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      exec("bench", argv);
+      fail("exec");
+    }
+    wait();
+  }
+  return n;
+}
+
+int
+spawnwait(int w, int *bytes)
+{
+  char *argv[] = { "bench", "-x", 0 };
+  int i, n;
+
+  n = 20*scale;
+  for(i = 0; i < n; i++){
+    if(spawn("bench", argv, 0) < 0)
+      fail("spawn");
+    wait();
+  }
+  return n;
+}
+
+int
+pipebw(int w, int *bytes)
+{
+  int p[2], i, n, m, pid;
+
+  n = 256*scale;
+  if(pipe(p) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(p[0]);
+    for(i = 0; i < n; i++)
+      if(write(p[1], buf, 4096) != 4096)
+        fail("write");
+    exit();
+  }
+  close(p[1]);
+  for(m = 0; (i = read(p[0], buf, sizeof(buf))) > 0; m += i)
+    ;
+  close(p[0]);
+  wait();
+  if(m != n*4096)
+    fail("pipe read");
+  *bytes = 4096;
+  return n;
+}
+
+void
+fname(char *s, char *pre, int w, int i)
+{
+  strcpy(s, pre);
+  s += strlen(s);
+  *s++ = 'a' + w % 26;
+  *s++ = '0' + i / 100 % 10;
+  *s++ = '0' + i / 10 % 10;
+  *s++ = '0' + i % 10;
+  *s = 0;
+}
+
+int
+createunlink(int w, int *bytes)
+{
+  char name[16];
+  int i, n, fd;
+
+  n = 50*scale;
+  for(i = 0; i < n; i++){
+    fname(name, "bc", w, i % 1000);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+      fail("create");
+    close(fd);
+    if(unlink(name) < 0)
+      fail("unlink");
+  }
+  return n;
+}
+
+int
+seqrw(int w, int *bytes)
+{
+  char name[16];
+  int i, r, fd;
+
+  fname(name, "bs", w, 0);
+  for(r = 0; r < scale; r++){
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+      fail("create");
+    for(i = 0; i < FILESZ; i += sizeof(buf))
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+        fail("write");
+    close(fd);
+    if((fd = open(name, O_RDONLY)) < 0)
+      fail("open");
+    for(i = 0; i < FILESZ; i += sizeof(buf))
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf))
+        fail("read");
+    close(fd);
+    unlink(name);
+  }
+  *bytes = sizeof(buf);
+  return 2*scale*FILESZ/sizeof(buf);
+}
+
+int
+sbrkfault(int w, int *bytes)
+{
+  char *p;
+  int r, i, n;
+
+  n = 256;
+  for(r = 0; r < scale*4; r++){
+    if((p = sbrk(n*4096)) == (char*)-1)
+      fail("sbrk");
+    for(i = 0; i < n; i++)
+      p[i*4096] = i;
+    sbrk(-n*4096);
+  }
+  return scale*4*n;
+}
+
+int
+ctxswitch(int w, int *bytes)
+{
+  int a[2], b[2], i, n, pid;
+  char c;
+
+  n = 500*scale;
+  if(pipe(a) < 0 || pipe(b) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    for(i = 0; i < n; i++)
+      if(read(a[0], &c, 1) != 1 || write(b[1], &c, 1) != 1)
+        fail("pong");
+    exit();
+  }
+  for(i = 0; i < n; i++)
+    if(write(a[1], &c, 1) != 1 || read(b[0], &c, 1) != 1)
+      fail("ping");
+  wait();
+  close(a[0]); close(a[1]);
+  close(b[0]); close(b[1]);
+  return n;
+}
+
+struct test {
+  char *name;
+  int (*fn)(int, int*);
+} tests[] = {
+  { "forkexec", forkexec },
+  { "spawn", spawnwait },
+  { "pipe", pipebw },
+  { "create", createunlink },
+  { "seqrw", seqrw },
+  { "sbrk", sbrkfault },
+  { "ctxsw", ctxswitch },
+};
+
+// Run t in nw workers, each reporting its operation count
+// and size through a pipe, and print the results.
+void
+run(struct test *t, int nw)
+{
+  uint64 t0, t1, ns;
+  int p[2], w, r[2], ops, bytes;
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  uptimens(&t0);
+  for(w = 0; w < nw; w++){
+    if(fork() == 0){
+      close(p[0]);
+      r[1] = 0;
+      r[0] = t->fn(w, &r[1]);
+      write(p[1], r, sizeof(r));
+      exit();
+    }
+  }
+  close(p[1]);
+  ops = bytes = 0;
+  while(read(p[0], r, sizeof(r)) == sizeof(r)){
+    ops += r[0];
+    bytes = r[1];
+  }
+  close(p[0]);
+  for(w = 0; w < nw; w++)
+    wait();
+  uptimens(&t1);
+  ns = t1 - t0;
+  if(ns == 0)
+    ns = 1;
+  printf(1, "test=%s workers=%d ops=%d us=%d ns_per_op=%d ops_per_sec=%d",
+         t->name, nw, ops, (uint)udiv64(ns, 1000), (uint)udiv64(ns, ops),
+         (uint)udiv64((uint64)ops * 1000000000, ns));
+  if(bytes)
+    printf(1, " kb_per_sec=%d",
+           (uint)udiv64(((uint64)ops * bytes * 1000000000) >> 10, ns));
+  printf(1, "\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, k, nw, any;
+
+  if(argc == 2 && strcmp(argv[1], "-x") == 0)
+    exit();  // the program forkexec and spawn start
+  nw = 1;
+  for(i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2){
+    if(strcmp(argv[i], "-p") == 0)
+      nw = atoi(argv[i+1]);
+    else if(strcmp(argv[i], "-n") == 0)
+      scale = atoi(argv[i+1]);
+    else
+      break;
+  }
+  if(nw < 1 || scale < 1 || (i < argc && argv[i][0] == '-')){
+    printf(2, "usage: bench [-p workers] [-n scale] [test...]\n");
+    exit();
+  }
+  for(j = 0; j < NELEM(tests); j++){
+    any = i == argc;
+    for(k = i; k < argc; k++)
+      if(strcmp(argv[k], tests[j].name) == 0)
+        any = 1;
+    if(any)
+      run(&tests[j], nw);
+  }
+  exit();
+}
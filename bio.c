@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,6 +17,13 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own lock and its own LRU list, so lookups of
+// different blocks do not contend.  The cache starts with NBUF
+// static buffers and grows a page of buffers at a time, up to
+// NBUFMAX, when no unused buffer is at hand.  Once it is full,
+// a miss recycles the least recently used buffer of some bucket.
 
 #include "types.h"
 #include "defs.h"
@@ -25,34 +32,147 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "mmu.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+struct bdevsw bdevsw[NBDEV];
 
-  // Linked list of all buffers, through prev/next.
+#define NBUCKET 61
+#define BHASH(dev, blockno) (((dev)*31 + (blockno)) % NBUCKET)
+
+struct bucket {
+  struct spinlock lock;
+  // Linked list of the bucket's buffers, through prev/next.
   // head.next is most recently used.
   struct buf head;
+};
+
+struct {
+  // Serializes recycling and growth, which are the only
+  // places that hold two bucket locks at once.
+  struct spinlock lock;
+  int nbuf;
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+// Insert b at the MRU end of bucket bk.  Caller holds bk->lock.
+static void
+bpush(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+binitbuf(struct buf *b)
+{
+  b->dev = -1;
+  b->blockno = 0;
+  b->flags = 0;
+  b->refcnt = 0;
+  initsleeplock(&b->lock, "buffer");
+}
+
 void
 binit(void)
 {
+  struct bucket *bk;
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  // Deal the static buffers out among the buckets.
+  for(i = 0, b = bcache.buf; b < bcache.buf+NBUF; b++, i++){
+    binitbuf(b);
+    bpush(&bcache.bucket[i % NBUCKET], b);
+  }
+  bcache.nbuf = NBUF;
+}
+
+// Look for blockno in bucket bk.  Caller holds bk->lock.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Find the least recently used unused buffer in bk.
+// Caller holds bk->lock.
+// Even if refcnt==0, B_DIRTY indicates a buffer is in use
+// because log.c has modified it but not yet committed it.
+static struct buf*
+bvictim(struct bucket *bk)
+{
+  struct buf *b;
+
+  for(b = bk->head.prev; b != &bk->head; b = b->prev)
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      return b;
+  return 0;
+}
+
+// Add a page worth of new buffers to bucket bk.
+// Caller holds bcache.lock and bk->lock.
+static int
+bgrow(struct bucket *bk)
+{
+  struct buf *b;
+  char *mem;
+  int i, n;
+
+  n = PGSIZE / sizeof(struct buf);
+  if(bcache.nbuf + n > NBUFMAX || (mem = kalloc()) == 0)
+    return -1;
+  b = (struct buf*)mem;
+  for(i = 0; i < n; i++, b++){
+    binitbuf(b);
+    bpush(bk, b);
   }
+  bcache.nbuf += n;
+  return 0;
+}
+
+// The driver for device dev.
+static struct bdevsw*
+bdev(uint dev)
+{
+  if(dev >= NBDEV || bdevsw[dev].submit == 0)
+    panic("bdev: no such device");
+  return &bdevsw[dev];
+}
+
+// Sync b with its device.
+// If B_ASYNC is set, return at once; the driver releases b.
+static void
+brw(struct buf *b)
+{
+  int async;
+
+  async = b->flags & B_ASYNC;  // b is not ours once submitted
+  bdev(b->dev)->submit(&b, 1);
+  if(!async)
+    bdev(b->dev)->wait(b);
 }
 
 // Look through buffer cache for block on device dev.
@@ -61,35 +181,52 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk, *o;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(dev, blockno)];
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = blookup(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Not cached.  Take the eviction lock, and check again
+  // in case another process cached the block meanwhile.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) == 0){
+    // Recycle an unused buffer from this bucket, or grow
+    // the cache, or steal an unused buffer from another bucket.
+    if((b = bvictim(bk)) == 0 && bgrow(bk) == 0)
+      b = bvictim(bk);
+    for(o = bcache.bucket; b == 0 && o < bcache.bucket+NBUCKET; o++){
+      if(o == bk)
+        continue;
+      acquire(&o->lock);
+      if((b = bvictim(o)) != 0){
+        bunlink(b);
+        bpush(bk, b);
+      }
+      release(&o->lock);
     }
+    if(b == 0)
+      panic("bget: no buffers");
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->refcnt = 0;
   }
-  panic("bget: no buffers");
+  b->refcnt++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -100,11 +237,61 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if((b->flags & B_VALID) == 0) {
-    iderw(b);
+    brw(b);
   }
   return b;
 }
 
+// Return the cached buf for the indicated block, locked, if it
+// is in the cache and no one holds it.  Otherwise return 0
+// without waiting.
+struct buf*
+btryget(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = &bcache.bucket[BHASH(dev, blockno)];
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(tryacquiresleep(&b->lock))
+      b->refcnt++;
+    else
+      b = 0;
+  }
+  release(&bk->lock);
+  return b;
+}
+
+// Return a locked buf for the indicated block without reading
+// it from the disk.  The caller must overwrite all of b->data.
+struct buf*
+bgetblk(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Start reading the indicated block into the cache, if it
+// is not there already, without waiting for the disk.
+// The buf stays locked until the read completes.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->flags |= B_ASYNC;
+  brw(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,33 +299,108 @@ bwrite(struct buf *b)
   if(!holdingsleep(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  brw(b);
 }
 
-// Release a locked buffer.
-// Move to the head of the MRU list.
+// Asynchronous interface.  bread_async(), bwrite_async() and
+// bsubmit() start disk requests and return at once, leaving the
+// bufs locked; the caller must bwait() for each before touching
+// its data or calling brelse().  A process can so keep many
+// requests in flight, and bsubmit() hands a whole batch to the
+// driver together, so that it can merge consecutive blocks.
+
+// Return a locked buf for the indicated block, and start
+// reading it from disk if it is not cached.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if((b->flags & B_VALID) == 0)
+    bdev(b->dev)->submit(&b, 1);
+  return b;
+}
+
+// Start writing b's contents to disk.  Must be locked.
 void
-brelse(struct buf *b)
+bwrite_async(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
-    panic("brelse");
+    panic("bwrite_async");
+  b->flags |= B_DIRTY;
+  bdev(b->dev)->submit(&b, 1);
+}
+
+// Start the disk requests for the n locked bufs in bs: a
+// write for those with B_DIRTY set, a read for those without
+// B_VALID.  Bufs that need neither are left alone.
+void
+bsubmit(struct buf **bs, int n)
+{
+  struct buf *q[NBATCH];
+  int k;
+
+  while(n > 0){
+    // One device at a time.
+    for(k = 0; n > 0 && k < NBATCH; n--, bs++){
+      if(k > 0 && (*bs)->dev != q[0]->dev)
+        break;
+      if(((*bs)->flags & (B_VALID|B_DIRTY)) != B_VALID)
+        q[k++] = *bs;
+    }
+    if(k > 0)
+      bdev(q[0]->dev)->submit(q, k);
+  }
+}
+
+// Wait for the disk request started for b, if any.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  if((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    bdev(b->dev)->wait(b);
+}
+
+// Unlock b and drop a reference to it.
+// Move to the head of its bucket's MRU list.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bunlink(b);
+    bpush(bk, b);
   }
   
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+
+// Release a locked buffer.
+void
+brelse(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("brelse");
+  bput(b);
+}
+
+// Called by the disk driver when a B_ASYNC request finishes,
+// possibly from an interrupt, to release b for its issuer.
+void
+biodone(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  bput(b);
 }
 //PAGEBREAK!
 // Blank page.
-
@@ -55,13 +55,14 @@ waitdisk(void)
     ;
 }
 
-// Read a single sector at offset into dst.
+// Read n sectors (at most 255) starting at offset into dst,
+// with one command: the disk raises DRQ again for each sector.
 void
-readsect(void *dst, uint offset)
+readsect(void *dst, uint offset, uint n)
 {
   // Issue command.
   waitdisk();
-  outb(0x1F2, 1);   // count = 1
+  outb(0x1F2, n);
   outb(0x1F3, offset);
   outb(0x1F4, offset >> 8);
   outb(0x1F5, offset >> 16);
@@ -69,8 +70,10 @@ readsect(void *dst, uint offset)
   outb(0x1F7, 0x20);  // cmd 0x20 - read sectors
 
   // Read data.
-  waitdisk();
-  insl(0x1F0, dst, SECTSIZE/4);
+  for(; n > 0; n--, dst = (uchar*)dst + SECTSIZE){
+    waitdisk();
+    insl(0x1F0, dst, SECTSIZE/4);
+  }
 }
 
 // Read 'count' bytes at 'offset' from kernel into physical address 'pa'.
@@ -79,6 +82,7 @@ void
 readseg(uchar* pa, uint count, uint offset)
 {
   uchar* epa;
+  uint n;
 
   epa = pa + count;
 
@@ -88,9 +92,13 @@ readseg(uchar* pa, uint count, uint offset)
   // Translate from bytes to sectors; kernel starts at sector 1.
   offset = (offset / SECTSIZE) + 1;
 
-  // If this is too slow, we could read lots of sectors at a time.
-  // We'd write more to memory than asked, but it doesn't matter --
-  // we load in increasing order.
-  for(; pa < epa; pa += SECTSIZE, offset++)
-    readsect(pa, offset);
+  // Read up to 255 sectors per command.  We write more to
+  // memory than asked, but it doesn't matter -- we load in
+  // increasing order.
+  for(; pa < epa; pa += n*SECTSIZE, offset += n){
+    n = (epa - pa + SECTSIZE - 1) / SECTSIZE;
+    if(n > 255)
+      n = 255;
+    readsect(pa, offset, n);
+  }
 }
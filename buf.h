@@ -4,11 +4,25 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // LRU list of hash bucket
   struct buf *next;
   struct buf *qnext; // disk queue
+  uint64 qtime;      // when queued, in nsec()
+  int qcpu;          // CPU that queued it
   uchar data[BSIZE];
 };
+
+// table mapping block device numbers to their drivers.
+// submit() starts the requests for n locked bufs of the device,
+// as idesubmit() in ide.c describes; wait() waits for one of them to finish.
+struct bdevsw {
+  void (*submit)(struct buf**, int);
+  void (*wait)(struct buf*);
+};
+
+extern struct bdevsw bdevsw[];
+
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // disk driver releases buffer when request is done
 
@@ -14,8 +14,10 @@
 #include "mmu.h"
 #include "proc.h"
 #include "x86.h"
+#include "poll.h"
 
 static void consputc(int);
+static void cgacursor(void);
 
 static int panicked = 0;
 
@@ -98,6 +100,7 @@ cprintf(char *fmt, ...)
       break;
     }
   }
+  cgacursor();
 
   if(locking)
     release(&cons.lock);
@@ -128,17 +131,17 @@ panic(char *s)
 #define CRTPORT 0x3d4
 static ushort *crt = (ushort*)P2V(0xb8000);  // CGA memory
 
+// Cursor position: col + 80*row.  cgaputc() only updates
+// memory; cgacursor() moves the hardware cursor once the
+// caller is done printing.
+static int cgapos;
+
 static void
 cgaputc(int c)
 {
   int pos;
 
-  // Cursor position: col + 80*row.
-  outb(CRTPORT, 14);
-  pos = inb(CRTPORT+1) << 8;
-  outb(CRTPORT, 15);
-  pos |= inb(CRTPORT+1);
-
+  pos = cgapos;
   if(c == '\n')
     pos += 80 - pos%80;
   else if(c == BACKSPACE){
@@ -155,11 +158,17 @@ cgaputc(int c)
     memset(crt+pos, 0, sizeof(crt[0])*(24*80 - pos));
   }
 
+  crt[pos] = ' ' | 0x0700;
+  cgapos = pos;
+}
+
+static void
+cgacursor(void)
+{
   outb(CRTPORT, 14);
-  outb(CRTPORT+1, pos>>8);
+  outb(CRTPORT+1, cgapos>>8);
   outb(CRTPORT, 15);
-  outb(CRTPORT+1, pos);
-  crt[pos] = ' ' | 0x0700;
+  outb(CRTPORT+1, cgapos);
 }
 
 void
@@ -171,10 +180,17 @@ consputc(int c)
       ;
   }
 
+  // panic() clears cons.locking; write straight to the line then.
   if(c == BACKSPACE){
-    uartputc('\b'); uartputc(' '); uartputc('\b');
-  } else
+    if(cons.locking){
+      uartputc('\b'); uartputc(' '); uartputc('\b');
+    } else {
+      uartputcsync('\b'); uartputcsync(' '); uartputcsync('\b');
+    }
+  } else if(cons.locking)
     uartputc(c);
+  else
+    uartputcsync(c);
   cgaputc(c);
 }
 
@@ -221,11 +237,13 @@ consoleintr(int (*getc)(void))
         if(c == '\n' || c == C('D') || input.e == input.r+INPUT_BUF){
           input.w = input.e;
           wakeup(&input.r);
+          pollwake();
         }
       }
       break;
     }
   }
+  cgacursor();
   release(&cons.lock);
   if(doprocdump) {
     procdump();  // now call procdump() wo. cons.lock held
@@ -236,40 +254,69 @@ int
 consoleread(struct inode *ip, char *dst, int n)
 {
   uint target;
-  int c;
+  int c, m, done;
+  char buf[128];
 
   iunlock(ip);
   target = n;
-  acquire(&cons.lock);
-  while(n > 0){
-    while(input.r == input.w){
-      if(myproc()->killed){
-        release(&cons.lock);
-        ilock(ip);
-        return -1;
+  done = 0;
+  while(n > 0 && !done){
+    // Take the input into buf under cons.lock, then copy it
+    // out to dst after releasing the lock, so that a fault on a
+    // paged-out dst can be taken.
+    m = 0;
+    acquire(&cons.lock);
+    while(m < n && m < sizeof(buf)){
+      while(input.r == input.w){
+        if(myproc()->killed){
+          release(&cons.lock);
+          ilock(ip);
+          return -1;
+        }
+        sleep(&input.r, &cons.lock);
       }
-      sleep(&input.r, &cons.lock);
-    }
-    c = input.buf[input.r++ % INPUT_BUF];
-    if(c == C('D')){  // EOF
-      if(n < target){
-        // Save ^D for next time, to make sure
-        // caller gets a 0-byte result.
-        input.r--;
+      c = input.buf[input.r++ % INPUT_BUF];
+      if(c == C('D')){  // EOF
+        if(n - m < target){
+          // Save ^D for next time, to make sure
+          // caller gets a 0-byte result.
+          input.r--;
+        }
+        done = 1;
+        break;
+      }
+      buf[m++] = c;
+      if(c == '\n'){
+        done = 1;
+        break;
       }
-      break;
     }
-    *dst++ = c;
-    --n;
-    if(c == '\n')
-      break;
+    release(&cons.lock);
+    if(umove(dst, buf, m) < 0){
+      ilock(ip);
+      return -1;
+    }
+    dst += m;
+    n -= m;
   }
-  release(&cons.lock);
   ilock(ip);
 
   return target - n;
 }
 
+int
+consolepoll(struct inode *ip)
+{
+  int r;
+
+  acquire(&cons.lock);
+  r = POLLOUT;
+  if(input.r != input.w)
+    r |= POLLIN;
+  release(&cons.lock);
+  return r;
+}
+
 int
 consolewrite(struct inode *ip, char *buf, int n)
 {
@@ -279,6 +326,7 @@ consolewrite(struct inode *ip, char *buf, int n)
   acquire(&cons.lock);
   for(i = 0; i < n; i++)
     consputc(buf[i] & 0xff);
+  cgacursor();
   release(&cons.lock);
   ilock(ip);
 
@@ -289,11 +337,16 @@ void
 consoleinit(void)
 {
   initlock(&cons.lock, "console");
+  outb(CRTPORT, 14);
+  cgapos = inb(CRTPORT+1) << 8;
+  outb(CRTPORT, 15);
+  cgapos |= inb(CRTPORT+1);
 
   devsw[CONSOLE].write = consolewrite;
   devsw[CONSOLE].read = consoleread;
+  devsw[CONSOLE].poll = consolepoll;
   cons.locking = 1;
 
-  ioapicenable(IRQ_KBD, 0);
+  ioapicenable(IRQ_KBD, -1);
 }
 
@@ -1,18 +1,35 @@
 struct buf;
 struct context;
+struct dirent;
 struct file;
 struct inode;
+struct iovec;
 struct pipe;
+struct pollfd;
 struct proc;
 struct rtcdate;
+struct shm;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct swapstat;
+struct sysstat;
+struct trapframe;
+struct vma;
+struct vmspace;
 
 // bio.c
 void            binit(void);
+void            biodone(struct buf*);
 struct buf*     bread(uint, uint);
+struct buf*     bgetblk(uint, uint);
+struct buf*     btryget(uint, uint);
+struct buf*     bread_async(uint, uint);
+void            bwrite_async(struct buf*);
+void            bsubmit(struct buf**, int);
+void            bwait(struct buf*);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 
@@ -24,68 +41,116 @@ void            panic(char*) __attribute__((noreturn));
 
 // exec.c
 int             exec(char*, char**);
+struct vmspace* execload(char*, char**, char*, uint*, uint*);
 
 // file.c
+int             fdalloc(struct file*);
+void            fdcloseall(void);
+int             fdcopy(struct proc*, struct file**);
+struct file*    fdget(int);
+void            fdremove(int);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             filepoll(struct file*);
+int             filereadv(struct file*, struct iovec*, int, int);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filewritev(struct file*, struct iovec*, int, int);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            dcacheforget(struct inode*, char*);
 int             dirlink(struct inode*, char*, uint);
+int             dirread(struct inode*, uint*, struct dirent*, int);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            iflushall(struct inode*);
+void            flusher(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             mount(struct inode*, uint);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
+struct inode*   nameiat(struct inode*, char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
+char*           textget(struct inode*, uint, uint);
+int             pcshrink(int);
 int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
-void            iderw(struct buf*);
+void            idesubmit(struct buf**, int);
+void            idewaitbuf(struct buf*);
+void            idestatdump(void);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
+void            ioapicfollow(int irq, int cpu);
 extern uchar    ioapicid;
 void            ioapicinit(void);
+void            ioapicspread(void);
+int             irqaffinity(int irq, int cpu);
+void            irqstatdump(void);
 
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+void            kincref(char*);
+char*           kzalloc(void);
+int             kzfill(void);
+int             krefcount(char*);
+int             kfreecount(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kinit2ap(void);
 
 // kbd.c
 void            kbdintr(void);
 
+// kmalloc.c
+void            kmallocinit(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+
 // lapic.c
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
-void            lapicstartap(uchar, uint);
+void            lapicipi(uchar, int);
+void            lapicstartall(uint);
+void            lapiconeshot(uint64);
+void            tscsync(void);
+void            tscsyncall(void);
 void            microdelay(int);
+uint64          nsec(void);
+uint64          udiv64(uint64, uint);
 
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+int             log_data(struct buf*);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+void            end_opn(int);
+int             log_opmax(void);
+int             log_reserved(uint);
+void            log_sync(void);
 
 // mp.c
 extern int      ismp;
@@ -98,44 +163,91 @@ void            picinit(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, char*, int);
-int             pipewrite(struct pipe*, char*, int);
+int             pipepoll(struct pipe*, int);
+int             piperead(struct pipe*, char*, int, int);
+int             pipewrite(struct pipe*, char*, int, int);
+
+// poll.c
+int             poll(struct pollfd*, int, int);
+void            pollwake(void);
 
 //PAGEBREAK: 16
+// prof.c
+void            profinit(void);
+void            profsample(struct trapframe*);
+extern volatile int profiling;
+
 // proc.c
+int             clone(uint, uint, uint);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             futexwait(uint, int);
+int             futexwake(uint);
 int             growproc(int);
+int             join(uint*);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
+struct vmspace* procvm(int*);
+int             procstats(int, struct sysstat*, int);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             setaffinity(int, uint);
+int             setprio(int, int, int);
 void            setproc(struct proc*);
+struct vmspace* setvm(struct proc*, struct vmspace*);
+int             spawn(char*, char**, struct file**);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(void (*)(void), char*);
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 
+// swap.c
+void            swapdump(void);
+int             swapdup(uint);
+void            swapfree(uint);
+void            swapinit(void);
+int             swapout(int);
+void            swapread(uint, char*);
+void            swapstat(struct swapstat*);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// uaccess.S
+int             ucopy(void*, const void*, uint);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            lockstatdump(void);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// ramdisk.c
+void            ramdiskinit(void);
+
+// shm.c
+void            shmdup(struct shm*);
+int             shmat(int);
+int             shmget(int, uint);
+void            shminit(void);
+void            shmput(struct shm*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
@@ -151,24 +263,38 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argptrw(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
+int             userbuf(uint, int, int);
+int             getstats(int, struct sysstat*, int);
 void            syscall(void);
+void            fastsyscall(struct trapframe*);
 
 // timer.c
+void            timeradd(uint64, void*);
+void            timerarm(void);
+void            timerdel(void*);
 void            timerinit(void);
+void            timerintr(void);
 
 // trap.c
+extern int      havesysenter;
 void            idtinit(void);
-extern uint     ticks;
 void            tvinit(void);
 extern struct spinlock tickslock;
 
+// trace.c
+void            trace(int, uint, uint, char*);
+void            traceinit(void);
+extern volatile int tracing;
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartputcsync(int);
 
 // vm.c
 void            seginit(void);
@@ -179,12 +305,34 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, struct vma*);
+void            tlbflush(struct vmspace*);
+void            tlbintr(void);
+void            vmclear(struct vmspace*, uint, uint);
+struct vmspace* vmcopy(struct vmspace*);
+void            vmdrain(struct vmspace*);
+void            vmexit(struct vmspace*);
+struct vmspace* vmnew(void);
+void            vmput(struct vmspace*);
+void            vmshare(struct vmspace*);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
+int             ucopyin(void*, uint, uint);
+int             ucopyout(uint, void*, uint);
+int             umove(void*, const void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             pagefault(struct proc*, uint, uint);
+int             uvmfaultin(struct proc*, uint, uint, int);
+void            vmadup(struct vma*, struct vma*);
+void            vmaflush(struct vmspace*);
+void            vmafree(struct vma*);
+int             vmamap(struct proc*, struct inode*, uint, uint, int);
+int             vmaoverlap(struct vma*, uint, uint);
+int             vmaunmap(struct proc*, uint, uint);
+char*           vmevict(struct vmspace*, uint*, uint);
+int             vmshmat(struct proc*, struct shm*);
+int             vmshmdt(struct proc*, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
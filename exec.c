@@ -6,27 +6,40 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vm.h"
 
-int
-exec(char *path, char **argv)
+// Build a new address space running the program path with
+// arguments argv, without touching the current process's.
+// On success, copy the program's name into name (the size of
+// a proc's), set *eip and *esp to its entry point and initial
+// stack pointer, and return the address space; else return 0.
+struct vmspace*
+execload(char *path, char **argv, char *name, uint *eip, uint *esp)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
-  struct proc *curproc = myproc();
+  struct vma vma[NVMA];
+  pde_t *pgdir;
+  struct vmspace *vm;
+
+  memset(vma, 0, sizeof(vma));
+  nvma = 0;
 
   begin_op();
 
   if((ip = namei(path)) == 0){
     end_op();
     cprintf("exec: fail\n");
-    return -1;
+    return 0;
   }
-  ilock(ip);
+  ilockshared(ip);
+  vm = 0;
   pgdir = 0;
 
   // Check ELF header
@@ -35,10 +48,12 @@ exec(char *path, char **argv)
   if(elf.magic != ELF_MAGIC)
     goto bad;
 
-  if((pgdir = setupkvm()) == 0)
+  if((vm = vmnew()) == 0)
     goto bad;
+  pgdir = vm->pgdir;
 
-  // Load program into memory.
+  // Record where each segment comes from; pagefault()
+  // reads the pages in when the program first touches them.
   sz = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -47,16 +62,22 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr % PGSIZE != 0 || nvma == NVMA)
       goto bad;
+    vma[nvma].start = ph.vaddr;
+    vma[nvma].end = PGROUNDUP(ph.vaddr + ph.memsz);
+    vma[nvma].ip = idup(ip);
+    vma[nvma].off = ph.off;
+    vma[nvma].filesz = ph.filesz;
+    vma[nvma].flags = VMA_WRITE | VMA_TEXT;
+    nvma++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  iunlockshared(ip);
+  iput(ip);
   end_op();
   ip = 0;
 
@@ -91,24 +112,47 @@ exec(char *path, char **argv)
   for(last=s=path; *s; s++)
     if(*s == '/')
       last = s+1;
-  safestrcpy(curproc->name, last, sizeof(curproc->name));
-
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
-  curproc->tf->esp = sp;
-  switchuvm(curproc);
-  freevm(oldpgdir);
-  return 0;
+  safestrcpy(name, last, sizeof(myproc()->name));
+
+  vm->sz = sz;
+  memmove(vm->vma, vma, sizeof(vma));
+  *eip = elf.entry;  // main
+  *esp = sp;
+  return vm;
 
  bad:
-  if(pgdir)
-    freevm(pgdir);
+  if(vm)
+    vmput(vm);
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
+    vmafree(vma);
+    end_op();
+  } else {
+    begin_op();
+    vmafree(vma);
     end_op();
   }
-  return -1;
+  return 0;
+}
+
+int
+exec(char *path, char **argv)
+{
+  struct vmspace *vm, *oldvm;
+  struct proc *curproc = myproc();
+  uint eip, esp;
+
+  if((vm = execload(path, argv, curproc->name, &eip, &esp)) == 0)
+    return -1;
+
+  // Commit to the user image.  Any other threads
+  // sharing the old address space keep running in it.
+  oldvm = setvm(curproc, vm);
+  curproc->tf->eip = eip;
+  curproc->tf->esp = esp;
+  switchuvm(curproc);
+  vmexit(oldvm);
+  vmput(oldvm);
+  return 0;
 }
@@ -5,15 +5,23 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "fs.h"
+#include "stat.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "uio.h"
+#include "poll.h"
 
 struct devsw devsw[NDEV];
+
+// struct files come from kmalloc(); ftable.n counts them
+// against the system-wide limit NFILE.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  int n;
 } ftable;
 
 void
@@ -29,15 +37,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.n == NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.n++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmalloc(sizeof(*f))) == 0){
+    acquire(&ftable.lock);
+    ftable.n--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -66,9 +81,9 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.n--;
   release(&ftable.lock);
+  kmfree(f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -84,74 +99,338 @@ int
 filestat(struct file *f, struct stat *st)
 {
   if(f->type == FD_INODE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     return 0;
   }
   return -1;
 }
 
-// Read from file f.
+// What a read or write of f would find ready, for poll().
 int
-fileread(struct file *f, char *addr, int n)
+filepoll(struct file *f)
 {
   int r;
 
+  if(f->type == FD_PIPE)
+    return pipepoll(f->pipe, f->writable);
+  r = POLLIN|POLLOUT;
+  if(f->ip->type == T_DEV && f->ip->major >= 0 && f->ip->major < NDEV &&
+     devsw[f->ip->major].poll)
+    r = devsw[f->ip->major].poll(f->ip);
+  if(!f->readable)
+    r &= ~POLLIN;
+  if(!f->writable)
+    r &= ~POLLOUT;
+  return r;
+}
+
+// Read from file f into the iovcnt buffers in iov, at
+// offset off, or at f's own offset if off is -1.  A pipe
+// has no offset, and fills at most the first buffer, since
+// reading more might block after some data has arrived.
+// The inode stays locked for the whole call: shared, so that
+// other readers can run too, unless f is a device, whose read
+// may unlock and relock it, or other fds share f's offset.
+int
+filereadv(struct file *f, struct iovec *iov, int iovcnt, int off)
+{
+  int i, r, o, tot, shared;
+
   if(f->readable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return piperead(f->pipe, addr, n);
+  if(f->type == FD_PIPE){
+    if(off != -1)
+      return -1;
+    for(i = 0; i < iovcnt; i++)
+      if(iov[i].len > 0)
+        return piperead(f->pipe, iov[i].base, iov[i].len, f->nonblock);
+    return 0;
+  }
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
-    return r;
+    // A device read might wait; a non-blocking one
+    // goes ahead only if poll() would say it is ready.
+    if(f->nonblock && !(filepoll(f) & POLLIN))
+      return -1;
+    shared = f->ip->type != T_DEV && (off != -1 || f->ref == 1);
+    if(shared)
+      ilockshared(f->ip);
+    else
+      ilock(f->ip);
+    o = off == -1 ? f->off : off;
+    tot = 0;
+    for(i = 0; i < iovcnt; i++){
+      if((r = readi(f->ip, iov[i].base, o, iov[i].len)) < 0){
+        if(tot == 0)
+          tot = -1;
+        break;
+      }
+      tot += r;
+      o += r;
+      if(r < iov[i].len)
+        break;
+    }
+    if(off == -1 && tot > 0)
+      f->off += tot;
+    if(shared)
+      iunlockshared(f->ip);
+    else
+      iunlock(f->ip);
+    return tot;
   }
   panic("fileread");
 }
 
+// Read from file f.
+int
+fileread(struct file *f, char *addr, int n)
+{
+  struct iovec iov;
+
+  iov.base = addr;
+  iov.len = n;
+  return filereadv(f, &iov, 1, -1);
+}
+
 //PAGEBREAK!
-// Write to file f.
+// The most log blocks writei() can use to write n bytes at
+// offset off: the data blocks, the i-node, the indirect blocks
+// the range crosses, the bitmap blocks for allocating it all,
+// and a block of slop in case off moves before the write.
+static int
+wblocks(uint off, uint n)
+{
+  uint d;
+
+  d = (off + n + BSIZE-1)/BSIZE - off/BSIZE + 1;
+  return d + 1 + (d/NINDIRECT + 3) + (d/BPB + 2);
+}
+
+// Write the iovcnt buffers in iov to file f, at offset off,
+// or at f's own offset if off is -1.
 int
-filewrite(struct file *f, char *addr, int n)
+filewritev(struct file *f, struct iovec *iov, int iovcnt, int off)
 {
-  int r;
+  int i, k, n, n1, r, o, tot, want, max, nb, opmax;
 
   if(f->writable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return pipewrite(f->pipe, addr, n);
+  want = 0;
+  for(i = 0; i < iovcnt; i++){
+    if(iov[i].len < 0 || want + iov[i].len < want)
+      return -1;
+    want += iov[i].len;
+  }
+  if(f->type == FD_PIPE){
+    if(off != -1)
+      return -1;
+    tot = 0;
+    for(i = 0; i < iovcnt; i++){
+      if((r = pipewrite(f->pipe, iov[i].base, iov[i].len, f->nonblock)) < 0)
+        return tot > 0 ? tot : -1;
+      tot += r;
+      if(r < iov[i].len)
+        break;
+    }
+    return tot;
+  }
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as much as one transaction can hold at a time,
+    // reserving log space for just the blocks this part
+    // of the write can touch (see wblocks).
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
+    // Each transaction takes up to max bytes from as
+    // many of the buffers as they span.
+    opmax = log_opmax();
+    i = k = tot = 0;  // k bytes of iov[i] are written
+    r = 0;
+    while(tot < want && r >= 0){
+      o = off == -1 ? f->off : off + tot;
+      max = want - tot;
+      if(max > opmax*BSIZE)
+        max = opmax*BSIZE;
+      while(max > BSIZE && wblocks(o, max) > opmax)
+        max -= BSIZE;
+      nb = wblocks(o, max);
+      begin_opn(nb);
       ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      o = off == -1 ? f->off : off + tot;
+      for(n = 0; n < max && tot < want; n += r){
+        while(k == iov[i].len){
+          i++;
+          k = 0;
+        }
+        n1 = iov[i].len - k;
+        if(n1 > max - n)
+          n1 = max - n;
+        if((r = writei(f->ip, (char*)iov[i].base + k, o, n1)) < 0)
+          break;
+        if(r != n1)
+          panic("short filewrite");
+        o += r;
+        k += r;
+        tot += r;
+      }
+      if(off == -1)
+        f->off = o;
       iunlock(f->ip);
-      end_op();
-
-      if(r < 0)
-        break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
+      end_opn(nb);
     }
-    return i == n ? n : -1;
+    return tot == want ? want : -1;
   }
   panic("filewrite");
 }
 
+// Write to file f.
+int
+filewrite(struct file *f, char *addr, int n)
+{
+  struct iovec iov;
+
+  iov.base = addr;
+  iov.len = n;
+  return filewritev(f, &iov, 1, -1);
+}
+
+// File descriptor tables.
+//
+// A process's fds index p->ofile, which starts out as the
+// NOFILE0 slots in struct proc and doubles, up to NOFILE, when
+// they are all in use.  p->fdmap has a bit for each fd in use
+// and p->fdfull a bit for each full word of fdmap, so finding
+// the lowest free fd takes two bit scans however many are open.
+// Only the process itself touches its table.
+
+static struct file**
+fdtalloc(int n)
+{
+  if(n*sizeof(struct file*) == PGSIZE)
+    return (struct file**)kalloc();
+  return kmalloc(n*sizeof(struct file*));
+}
+
+static void
+fdtfree(struct file **t, int n)
+{
+  if(n*sizeof(struct file*) == PGSIZE)
+    kfree((char*)t);
+  else
+    kmfree(t);
+}
+
+static void
+fdset(struct proc *p, int fd, struct file *f)
+{
+  p->ofile[fd] = f;
+  p->fdmap[fd/32] |= 1 << (fd%32);
+  if(p->fdmap[fd/32] == ~0)
+    p->fdfull |= 1 << (fd/32);
+}
+
+// Make p's table at least n slots long.
+static int
+fdgrow(struct proc *p, int n)
+{
+  struct file **t;
+  int m;
+
+  for(m = p->nofile; m < n; m *= 2)
+    ;
+  if(m == p->nofile)
+    return 0;
+  if(m > NOFILE || (t = fdtalloc(m)) == 0)
+    return -1;
+  memset(t, 0, m*sizeof(*t));
+  memmove(t, p->ofile, p->nofile*sizeof(*t));
+  if(p->ofile != p->ofile0)
+    fdtfree(p->ofile, p->nofile);
+  else
+    memset(p->ofile0, 0, sizeof(p->ofile0));  // fdcloseall() goes back to it
+  p->ofile = t;
+  p->nofile = m;
+  return 0;
+}
+
+// Allocate the lowest free file descriptor for f.
+// Takes over file reference from caller on success.
+int
+fdalloc(struct file *f)
+{
+  struct proc *p = myproc();
+  int w, fd;
+
+  if(~p->fdfull == 0 || (w = __builtin_ctz(~p->fdfull)) >= NOFILE/32)
+    return -1;
+  fd = w*32 + __builtin_ctz(~p->fdmap[w]);
+  if(fd >= p->nofile && fdgrow(p, fd+1) < 0)
+    return -1;
+  fdset(p, fd, f);
+  return fd;
+}
+
+// The file open as fd, or 0.
+struct file*
+fdget(int fd)
+{
+  struct proc *p = myproc();
+
+  if(fd < 0 || fd >= p->nofile)
+    return 0;
+  return p->ofile[fd];
+}
+
+// Free fd, giving the caller its file reference.
+void
+fdremove(int fd)
+{
+  struct proc *p = myproc();
+
+  p->ofile[fd] = 0;
+  p->fdmap[fd/32] &= ~(1 << (fd%32));
+  p->fdfull &= ~(1 << (fd/32));
+}
+
+// Give np copies of the current process's fds, or if ofile
+// is not 0, of ofile[0..2] as fds 0 to 2.
+int
+fdcopy(struct proc *np, struct file **ofile)
+{
+  struct proc *p = myproc();
+  int fd;
+
+  if(ofile){
+    for(fd = 0; fd < 3; fd++)
+      if(ofile[fd])
+        fdset(np, fd, filedup(ofile[fd]));
+    return 0;
+  }
+  if(fdgrow(np, p->nofile) < 0)
+    return -1;
+  for(fd = 0; fd < p->nofile; fd++)
+    if(p->ofile[fd])
+      fdset(np, fd, filedup(p->ofile[fd]));
+  return 0;
+}
+
+// Close all of the current process's fds, for exit().
+void
+fdcloseall(void)
+{
+  struct proc *p = myproc();
+  int fd;
+
+  for(fd = 0; fd < p->nofile; fd++){
+    if(p->ofile[fd]){
+      fileclose(p->ofile[fd]);
+      p->ofile[fd] = 0;
+    }
+  }
+  if(p->ofile != p->ofile0)
+    fdtfree(p->ofile, p->nofile);
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE0;
+  memset(p->fdmap, 0, sizeof(p->fdmap));
+  p->fdfull = 0;
+}
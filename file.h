@@ -3,6 +3,7 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock;  // O_NONBLOCK
   struct pipe *pipe;
   struct inode *ip;
   uint off;
@@ -14,15 +15,26 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;  // icache hash chain
+  struct inode *lprev;  // icache LRU list, when ref is 0
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // block after the last one read
+  uint raend;         // block after the last one read ahead
+  uint goal;          // where to allocate the next block
+  struct dblock *delay; // blocks written but not yet allocated
+  struct inode *dnext;  // next on delay.dirty
+  int ondirty;        // on delay.dirty? protected by delay.lock
+  struct tpage *text; // shared program pages; see textget()
+  struct cpage *pages; // page cache; protected by pcache.lock
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
 };
 
 // table mapping major device number to
@@ -30,8 +42,11 @@ struct inode {
 struct devsw {
   int (*read)(struct inode*, char*, int);
   int (*write)(struct inode*, char*, int);
+  int (*poll)(struct inode*);   // POLLIN|POLLOUT ready now; 0 means always both
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define PROF    2
+#define TRACE   3
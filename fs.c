@@ -22,11 +22,16 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define BM_NOZERO 2   // bmap alloc: don't zero a new data block
 static void itrunc(struct inode*);
-// there should be one superblock per disk device, but we run with
-// only one device
-struct superblock sb; 
-
+static int iflush(struct inode*, int);
+static void textpurge(struct inode*);
+static void delayinit(void);
+static void dcacheinit(void);
+static void textinit(void);
+static void pcpurge(struct inode*);
+static void pcinit(void);
+static void dcachepurge(uint, uint);
 // Read the super block.
 void
 readsb(int dev, struct superblock *sb)
@@ -50,25 +55,96 @@ bzero(int dev, int bno)
   brelse(bp);
 }
 
+// Mounted file systems.
+//
+// mounts[0] is the root file system on ROOTDEV.  Each slot
+// holds its device's super block and free-block summary; mount()
+// fills a slot in before setting its dev, and a slot does not
+// change once its dev is set.
+
+#define BGROUP  BPB   // blocks per group: one bitmap block's worth
+#define NBGROUP 2048  // so at most 8M blocks, a 4GB disk
+
+struct mount {
+  uint dev;             // 0 if the slot is free
+  struct inode *mp;     // directory it is mounted on, 0 for the root
+  struct superblock sb;
+  int ngroup;           // free-block summary, see balloc()
+  uint rotor;           // where to look when there is no goal
+  ushort nfree[NBGROUP];
+};
+
+static struct spinlock mountlock;  // serializes mount()
+static struct mount mounts[NMOUNT];
+
+// The mount of device dev.
+static struct mount*
+mountof(uint dev)
+{
+  struct mount *m;
+
+  for(m = mounts; m < &mounts[NMOUNT]; m++)
+    if(m->dev == dev)
+      return m;
+  panic("mountof");
+}
+
 // Blocks.
+//
+// m->nfree[g] counts the free blocks in group g, the BGROUP
+// blocks starting at g*BGROUP, so that balloc() can skip full
+// groups without reading the bitmap.  A group's count changes
+// only while holding the bitmap block that covers it.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Count the free blocks in each group of device dev.
+static void
+bsuminit(struct mount *m, int dev)
 {
-  int b, bi, m;
+  int b, bi;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+  m->ngroup = (m->sb.size + BGROUP-1) / BGROUP;
+  if(m->ngroup > NBGROUP)
+    panic("bsuminit: disk too big");
+  for(b = 0; b < m->sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, m->sb));
+    for(bi = 0; bi < BPB && b + bi < m->sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        m->nfree[(b + bi) / BGROUP]++;
+    brelse(bp);
+  }
+}
+
+// Allocate a disk block, at goal if it is free and
+// otherwise at the next free block after it.
+// Zero the block unless zero is 0.
+static uint
+balloc(uint dev, uint goal, int zero)
+{
+  int b, bi, g, i, k;
+  struct buf *bp;
+  struct mount *m;
+
+  m = mountof(dev);
+  if(goal == 0 || goal >= m->sb.size)
+    goal = m->rotor;
+  for(i = 0; i <= m->ngroup; i++){
+    g = (goal / BGROUP + i) % m->ngroup;
+    if(m->nfree[g] == 0)
+      continue;
+    b = g * BGROUP;
+    bp = bread(dev, BBLOCK(b, m->sb));
+    // The last pass looks at the part of goal's group before goal.
+    for(bi = (i == 0 ? goal % BGROUP : 0); bi < BGROUP && b + bi < m->sb.size; bi++){
+      k = 1 << ((b + bi) % 8);
+      if((bp->data[(b + bi) % BPB / 8] & k) == 0){  // Is block free?
+        bp->data[(b + bi) % BPB / 8] |= k;  // Mark block in use.
         log_write(bp);
+        m->nfree[g]--;
         brelse(bp);
-        bzero(dev, b + bi);
+        m->rotor = b + bi + 1;
+        if(zero)
+          bzero(dev, b + bi);
         return b + bi;
       }
     }
@@ -82,16 +158,18 @@ static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
-  int bi, m;
+  struct mount *m;
+  int bi, k;
 
-  readsb(dev, &sb);
-  bp = bread(dev, BBLOCK(b, sb));
+  m = mountof(dev);
+  bp = bread(dev, BBLOCK(b, m->sb));
   bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
+  k = 1 << (bi % 8);
+  if((bp->data[bi/8] & k) == 0)
     panic("freeing free block");
-  bp->data[bi/8] &= ~m;
+  bp->data[bi/8] &= ~k;
   log_write(bp);
+  m->nfree[b / BGROUP]++;
   brelse(bp);
 }
 
@@ -155,39 +233,143 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The cache is a hash table of entries chained by (dev, inum).
+// Entries come from kmalloc() and are never freed.  Entries with
+// ip->ref == 0 stay hashed, on the icache.lru list, until iget()
+// recycles them; it allocates new entries until there are NINODE,
+// and beyond that only when every entry is in use.
+//
+// A bucket's lock protects its chain and the dev and inum of the
+// entries on it.  ip->ref is updated atomically; it may only go
+// from 0 to 1, or from 1 to 0, while holding the bucket's lock,
+// which is also when entries join and leave icache.lru.
+// icache.lock protects icache.lru, icache.free and icache.n, and
+// is taken after a bucket lock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+
+struct ihash {
+  struct spinlock lock;
+  struct inode *head;
+};
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode lru;      // head of least recently used ref==0 entries
+  struct inode *free;    // unhashed entries
+  int n;                 // entries allocated
+  struct ihash hash[NIHASH];
 } icache;
 
+static struct ihash*
+ihash(uint dev, uint inum)
+{
+  return &icache.hash[(dev * 31 + inum) % NIHASH];
+}
+
+static struct inode* iget(uint dev, uint inum);
+
+// Mount device dev's file system on directory ip, which the
+// mount keeps a reference to.  Caller must not hold ip's lock
+// or be in a transaction.  Returns 0, or -1 if dev is not a
+// block device, already mounted, or out of slots.
+int
+mount(struct inode *ip, uint dev)
+{
+  struct mount *m, *free;
+
+  if(dev >= NBDEV || bdevsw[dev].submit == 0)
+    return -1;
+  acquire(&mountlock);
+  free = 0;
+  for(m = mounts; m < &mounts[NMOUNT]; m++){
+    if(m->dev == dev || (ip && m->mp == ip)){
+      release(&mountlock);
+      return -1;
+    }
+    if(free == 0 && m->dev == 0 && m->mp == 0)
+      free = m;
+  }
+  if(free == 0){
+    release(&mountlock);
+    return -1;
+  }
+  m = free;
+  m->mp = ip;  // claims the slot until dev is set
+  release(&mountlock);
+
+  readsb(dev, &m->sb);
+  initlog(dev);
+  bsuminit(m, dev);
+  __sync_synchronize();
+  m->dev = dev;
+  return 0;
+}
+
+// If ip is the root of a mounted file system, return
+// the directory it is mounted on, else 0.
+static struct inode*
+mountpoint(struct inode *ip)
+{
+  struct mount *m;
+
+  if(ip->inum != ROOTINO)
+    return 0;
+  for(m = mounts; m < &mounts[NMOUNT]; m++)
+    if(m->dev == ip->dev)
+      return m->mp;
+  return 0;
+}
+
+// If ip is a directory with a file system mounted on it,
+// drop ip and return the mounted root instead.  A call that
+// began its transaction before the mount went in has no space
+// in the new device's log, so it goes on seeing ip, as if it
+// had got past namei() before the mount.
+static struct inode*
+mountcross(struct inode *ip)
+{
+  struct mount *m;
+
+  for(m = mounts; m < &mounts[NMOUNT]; m++){
+    if(m->dev != 0 && m->mp == ip && log_reserved(m->dev)){
+      iput(ip);
+      return iget(m->dev, ROOTINO);
+    }
+  }
+  return ip;
+}
+
 void
 iinit(int dev)
 {
+  struct mount *m;
   int i = 0;
   
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
-
-  readsb(dev, &sb);
+  icache.lru.lnext = icache.lru.lprev = &icache.lru;
+  for(i = 0; i < NIHASH; i++)
+    initlock(&icache.hash[i].lock, "ihash");
+  dcacheinit();
+  delayinit();
+  textinit();
+  pcinit();
+
+  initlock(&mountlock, "mount");
+  m = &mounts[0];
+  readsb(dev, &m->sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
-          sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+ inodestart %d bmap start %d\n", m->sb.size, m->sb.nblocks,
+          m->sb.ninodes, m->sb.nlog, m->sb.logstart, m->sb.inodestart,
+          m->sb.bmapstart);
+  bsuminit(m, dev);
+  m->dev = dev;
 }
 
-static struct inode* iget(uint dev, uint inum);
-
 //PAGEBREAK!
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -197,10 +379,12 @@ ialloc(uint dev, short type)
 {
   int inum;
   struct buf *bp;
+  struct mount *m;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  m = mountof(dev);
+  for(inum = 1; inum < m->sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, m->sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
@@ -224,7 +408,7 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, mountof(ip->dev)->sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -236,50 +420,135 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
-static struct inode*
-iget(uint dev, uint inum)
+// Take ip off icache.lru.  Caller must hold icache.lock.
+static void
+lruunlink(struct inode *ip)
 {
-  struct inode *ip, *empty;
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext = ip->lprev = 0;
+}
 
-  acquire(&icache.lock);
+// Take the least recently used unreferenced entry out of
+// the cache.  Returns 0 if every entry is in use.
+static struct inode*
+irecycle(void)
+{
+  struct inode *ip, **pp;
+  struct ihash *h;
+  uint dev, inum;
+  int ok;
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(;;){
+    acquire(&icache.lock);
+    ip = icache.lru.lnext;
+    if(ip == &icache.lru){
       release(&icache.lock);
+      return 0;
+    }
+    dev = ip->dev;
+    inum = ip->inum;
+    release(&icache.lock);
+
+    // ip may be reused or recycled before we lock its bucket.
+    h = ihash(dev, inum);
+    acquire(&h->lock);
+    acquire(&icache.lock);
+    ok = ip->lnext != 0 && ip->dev == dev && ip->inum == inum;
+    if(ok){
+      lruunlink(ip);
+      for(pp = &h->head; *pp != ip; pp = &(*pp)->hnext)
+        ;
+      *pp = ip->hnext;
+    }
+    release(&icache.lock);
+    release(&h->lock);
+    if(ok){
+      textpurge(ip);
+      pcpurge(ip);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
+}
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+// Return an unhashed entry.
+static struct inode*
+inew(void)
+{
+  struct inode *ip;
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
+  acquire(&icache.lock);
+  if((ip = icache.free) != 0)
+    icache.free = ip->hnext;
   release(&icache.lock);
-
+  if(ip == 0 && (icache.n < NINODE || (ip = irecycle()) == 0)){
+    if((ip = kmalloc(sizeof(*ip))) == 0)
+      panic("iget: no inodes");
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    acquire(&icache.lock);
+    icache.n++;
+    release(&icache.lock);
+  }
   return ip;
 }
 
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+static struct inode*
+iget(uint dev, uint inum)
+{
+  struct inode *ip, *new;
+  struct ihash *h;
+
+  h = ihash(dev, inum);
+  new = 0;
+  for(;;){
+    acquire(&h->lock);
+
+    // Is the inode already cached?
+    for(ip = h->head; ip; ip = ip->hnext){
+      if(ip->dev == dev && ip->inum == inum){
+        if(__sync_fetch_and_add(&ip->ref, 1) == 0){
+          acquire(&icache.lock);
+          lruunlink(ip);
+          release(&icache.lock);
+        }
+        release(&h->lock);
+        if(new){
+          acquire(&icache.lock);
+          new->hnext = icache.free;
+          icache.free = new;
+          release(&icache.lock);
+        }
+        return ip;
+      }
+    }
+
+    if(new){
+      new->dev = dev;
+      new->inum = inum;
+      new->ref = 1;
+      new->valid = 0;
+      new->hnext = h->head;
+      h->head = new;
+      release(&h->lock);
+      return new;
+    }
+
+    // Find an entry without holding h->lock, then look again.
+    release(&h->lock);
+    new = inew();
+  }
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
-  ip->ref++;
-  release(&icache.lock);
+  __sync_fetch_and_add(&ip->ref, 1);
   return ip;
 }
 
@@ -297,7 +566,7 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, mountof(ip->dev)->sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -306,6 +575,8 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ranext = ip->raend = 0;
+    ip->goal = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -322,6 +593,35 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode in shared mode, for readi(), stati()
+// and dirlookup(), which other shared holders may run at the
+// same time.  They may update only the read-ahead hints.
+// Reads in the inode, under an exclusive lock, if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  for(;;){
+    acquiresleepshared(&ip->lock);
+    if(ip->valid)
+      return;
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+  }
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
@@ -332,13 +632,16 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct ihash *h;
+  int r;
+
   acquiresleep(&ip->lock);
   if(ip->valid && ip->nlink == 0){
-    acquire(&icache.lock);
-    int r = ip->ref;
-    release(&icache.lock);
+    r = ip->ref;
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcachepurge(ip->dev, ip->inum);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
@@ -347,9 +650,21 @@ iput(struct inode *ip)
   }
   releasesleep(&ip->lock);
 
-  acquire(&icache.lock);
-  ip->ref--;
-  release(&icache.lock);
+  // Only the last reference needs the bucket lock.
+  for(r = ip->ref; r > 1; r = ip->ref)
+    if(__sync_bool_compare_and_swap(&ip->ref, r, r-1))
+      return;
+  h = ihash(ip->dev, ip->inum);
+  acquire(&h->lock);
+  if(__sync_sub_and_fetch(&ip->ref, 1) == 0){
+    acquire(&icache.lock);
+    ip->lprev = icache.lru.lprev;
+    ip->lnext = &icache.lru;
+    icache.lru.lprev->lnext = ip;
+    icache.lru.lprev = ip;
+    release(&icache.lock);
+  }
+  release(&h->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -366,40 +681,105 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The next NDINDIRECT
+// blocks are listed in the indirect blocks listed in the
+// double-indirect block ip->addrs[NDIRECT+1].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Allocate a block for ip just after the last one it got,
+// so that a file's blocks end up next to each other.
+// Zero it unless alloc is BM_NOZERO.
+static uint
+bmapalloc(struct inode *ip, int alloc)
+{
+  uint addr;
+
+  addr = balloc(ip->dev, ip->goal, alloc != BM_NOZERO);
+  ip->goal = addr + 1;
+  return addr;
+}
+
+// Return entry bn of the block-number array in block addr.
+// If the entry is empty and alloc is set, allocate a block for it.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapind(struct inode *ip, uint addr, uint bn, int alloc)
 {
-  uint addr, *a;
+  uint *a;
   struct buf *bp;
 
+  if(addr == 0)
+    return 0;
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[bn]) == 0 && alloc){
+    a[bn] = addr = bmapalloc(ip, alloc);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one if alloc is set,
+// and otherwise returns 0.  alloc is BM_NOZERO if the caller
+// is going to overwrite all of a new data block itself.
+static uint
+bmap(struct inode *ip, uint bn, int alloc)
+{
+  uint addr;
+
+  // Carry on from the previous block after an ilock().
+  if(alloc && ip->goal == 0 && bn > 0 && (addr = bmap(ip, bn-1, 0)) != 0)
+    ip->goal = addr + 1;
+
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = addr = bmapalloc(ip, alloc);
     return addr;
   }
   bn -= NDIRECT;
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+    if((addr = ip->addrs[NDIRECT]) == 0 && alloc)
+      ip->addrs[NDIRECT] = addr = bmapalloc(ip, 1);
+    return bmapind(ip, addr, bn, alloc);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load double-indirect block, then the indirect block.
+    if((addr = ip->addrs[NDIRECT+1]) == 0 && alloc)
+      ip->addrs[NDIRECT+1] = addr = bmapalloc(ip, 1);
+    addr = bmapind(ip, addr, bn / NINDIRECT, alloc ? 1 : 0);
+    return bmapind(ip, addr, bn % NINDIRECT, alloc);
   }
 
   panic("bmap: out of range");
 }
 
+// Free the blocks listed in block addr, then addr itself.
+// If depth > 1, the listed blocks are themselves lists.
+static void
+itruncind(uint dev, uint addr, int depth)
+{
+  int j;
+  uint *a;
+  struct buf *bp;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      itruncind(dev, a[j], depth-1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -408,10 +788,11 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
+  iflush(ip, 0);
+  textpurge(ip);
+  pcpurge(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -420,18 +801,17 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip->dev, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    itruncind(ip->dev, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
   ip->size = 0;
+  ip->ranext = ip->raend = 0;
   iupdate(ip);
 }
 
@@ -447,6 +827,609 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Blocks readi keeps in flight ahead of a sequential reader.
+#define NREADAHEAD 16
+
+// Called by readi for a read of blocks [bn, nbn).  If the read
+// starts in or just after the block where the previous one ended,
+// queue any of these blocks
+// and the NREADAHEAD after them that have not been asked for yet,
+// so that the disk can fetch them in one go while readi copies.
+static void
+readahead(struct inode *ip, uint bn, uint nbn)
+{
+  uint b, end, addr;
+
+  if(bn != 0 && (bn + 1 < ip->ranext || bn > ip->ranext)){
+    // Random access; start over.
+    ip->ranext = ip->raend = nbn;
+    return;
+  }
+  ip->ranext = nbn;
+
+  end = nbn + NREADAHEAD;
+  if(end > (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE;
+  for(b = (bn > ip->raend ? bn : ip->raend); b < end; b++)
+    if((addr = bmap(ip, b, 0)) != 0)
+      breadahead(ip->dev, addr);
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
+//PAGEBREAK!
+// Delayed allocation.
+//
+// writei() of a regular file neither allocates disk blocks nor
+// logs the data.  It keeps each block it writes in a buf on
+// DELAYDEV, pinned in the cache with B_DIRTY, and lists it on
+// ip->delay in file order; readi() looks there first.  ip goes
+// on delay.dirty, which holds a reference to it.  The flusher
+// thread, every FLUSHNS or when NDELAY blocks are waiting, and
+// fsync() allocate the blocks together, so that they are
+// contiguous, and log them, or in ordered mode write them home
+// (see log_data()).  A file unlinked before then never costs a
+// data write.  Between a crash and the flush, the file's size
+// may cover blocks that read as zeros.
+//
+// ip->delay is protected by ip->lock, the rest by delay.lock.
+
+#define DELAYDEV ((uint)-2)
+
+struct dblock {
+  struct dblock *next;
+  uint bn;        // block number in the file
+  uint key;       // blockno of its buf on DELAYDEV
+};
+
+struct {
+  struct spinlock lock;
+  int n;                // blocks waiting
+  uint key;             // next DELAYDEV blockno
+  struct inode *dirty;  // inodes with waiting blocks
+} delay;
+
+static void
+delayinit(void)
+{
+  initlock(&delay.lock, "delay");
+}
+
+// Find ip's delayed block bn.
+static struct dblock*
+dfind(struct inode *ip, uint bn)
+{
+  struct dblock *d;
+
+  for(d = ip->delay; d && d->bn <= bn; d = d->next)
+    if(d->bn == bn)
+      return d;
+  return 0;
+}
+
+// Return the locked buf holding ip's block bn, making it a
+// delayed block with the block's current contents if it is not
+// one already.  Returns 0 if too many blocks are waiting.
+static struct buf*
+dgetblk(struct inode *ip, uint bn)
+{
+  struct dblock *d, **pp;
+  struct buf *bp, *b;
+  uint addr;
+
+  if((d = dfind(ip, bn)) != 0)
+    return bread(DELAYDEV, d->key);
+
+  acquire(&delay.lock);
+  if(delay.n >= NDELAY || (d = kmalloc(sizeof(*d))) == 0){
+    release(&delay.lock);
+    acquire(&tickslock);
+    wakeup(&delay);  // memory pressure: wake the flusher
+    release(&tickslock);
+    return 0;
+  }
+  delay.n++;
+  d->key = delay.key++;
+  if(!ip->ondirty){
+    ip->ondirty = 1;
+    ip->dnext = delay.dirty;
+    delay.dirty = idup(ip);
+  }
+  release(&delay.lock);
+
+  d->bn = bn;
+  for(pp = &ip->delay; *pp && (*pp)->bn < bn; pp = &(*pp)->next)
+    ;
+  d->next = *pp;
+  *pp = d;
+
+  bp = bgetblk(DELAYDEV, d->key);
+  if((addr = bmap(ip, bn, 0)) != 0){
+    b = bread(ip->dev, addr);
+    memmove(bp->data, b->data, BSIZE);
+    brelse(b);
+  } else
+    memset(bp->data, 0, BSIZE);
+  bp->flags |= B_DIRTY;
+  return bp;
+}
+
+// Allocate and log, or in ordered mode write home, as many of
+// ip's delayed blocks as fit in nlog log blocks, or discard
+// them all if nlog is 0 or ip is unlinked.  Caller must hold
+// ip->lock, and be in a transaction that reserved nlog blocks.
+// Returns the number of delayed blocks left.
+static int
+iflush(struct inode *ip, int nlog)
+{
+  struct dblock *d;
+  struct buf *bp, *hb, *home[NBATCH];
+  int i, n, nhome, cost, leaf, lastleaf, newleaf, nbitmap, nalloc;
+
+  if(ip->nlink == 0)
+    nlog = 0;
+  // The i-node and the double-indirect block, plus the bitmap
+  // blocks.  Each block allocated dirties at most one bitmap
+  // block, so charge one per allocation, up to all of them.
+  cost = 2;
+  nbitmap = (mountof(ip->dev)->sb.size + BPB-1) / BPB;
+  lastleaf = -1;
+  n = nhome = 0;
+  while((d = ip->delay) != 0){
+    bp = bread(DELAYDEV, d->key);
+    if(nlog > 0){
+      leaf = d->bn < NDIRECT ? -1 : (d->bn - NDIRECT) / NINDIRECT;
+      newleaf = leaf != lastleaf && leaf >= 0;
+      // The data block, a new leaf, and on the first block the
+      // double-indirect block may each need allocating.
+      nalloc = 1 + newleaf + (n == 0);
+      if(nalloc > nbitmap)
+        nalloc = nbitmap;
+      nbitmap -= nalloc;
+      cost += newleaf + nalloc;
+      if(cost + 1 > nlog){
+        brelse(bp);
+        break;
+      }
+      lastleaf = leaf;
+      hb = bgetblk(ip->dev, bmap(ip, d->bn, BM_NOZERO));
+      memmove(hb->data, bp->data, BSIZE);
+      if(log_data(hb)){
+        // Ordered mode: write it home, NBATCH at a time,
+        // before this transaction commits.
+        hb->flags |= B_DIRTY;
+        home[nhome++] = hb;
+      } else {
+        cost++;
+        brelse(hb);
+      }
+      if(nhome == NBATCH){
+        bsubmit(home, nhome);
+        for(i = 0; i < nhome; i++){
+          bwait(home[i]);
+          brelse(home[i]);
+        }
+        nhome = 0;
+      }
+      n++;
+    }
+    bp->flags = 0;  // unpin; DELAYDEV keys are never reused
+    brelse(bp);
+    ip->delay = d->next;
+    kmfree(d);
+    acquire(&delay.lock);
+    delay.n--;
+    release(&delay.lock);
+  }
+  bsubmit(home, nhome);
+  for(i = 0; i < nhome; i++){
+    bwait(home[i]);
+    brelse(home[i]);
+  }
+  if(n > 0)
+    iupdate(ip);
+  if(ip->delay != 0 && n == 0)
+    panic("iflush: log too small");
+  for(n = 0, d = ip->delay; d; d = d->next)
+    n++;
+  return n;
+}
+
+// Write out all of ip's delayed blocks.
+// Caller must not hold ip->lock or be in a transaction.
+void
+iflushall(struct inode *ip)
+{
+  int nlog, left;
+
+  nlog = log_opmax();
+  do {
+    begin_opn(nlog);
+    ilock(ip);
+    left = iflush(ip, nlog);
+    iunlock(ip);
+    end_opn(nlog);
+  } while(left > 0);
+}
+
+// Body of the flusher kernel thread.
+void
+flusher(void)
+{
+  struct inode *ip;
+
+  for(;;){
+    acquire(&tickslock);
+    timeradd(nsec() + FLUSHNS, &delay);
+    sleep(&delay, &tickslock);
+    release(&tickslock);
+    timerdel(&delay);
+
+    for(;;){
+      acquire(&delay.lock);
+      if((ip = delay.dirty) != 0){
+        delay.dirty = ip->dnext;
+        ip->ondirty = 0;
+      }
+      release(&delay.lock);
+      if(ip == 0)
+        break;
+      iflushall(ip);
+      begin_op();
+      iput(ip);
+      end_op();
+    }
+  }
+}
+
+//PAGEBREAK!
+// Shared program pages.
+//
+// The processes running one program share the pages exec()
+// reads from its file: each inode keeps the pages read so far
+// on ip->text, keyed by file offset and length, and holds a
+// reference to each.  The pages are mapped copy-on-write, so a
+// process that writes to one (its data) gets a private copy.
+// Writing or truncating the file, or recycling its icache
+// entry, drops the cached pages; processes already mapping
+// them keep them, as if they had read private copies.
+//
+// text.lock protects every ip->text list; inserting takes
+// ip->lock too (shared), and writers hold it exclusively.
+
+struct tpage {
+  struct tpage *next;
+  uint off;       // file offset
+  uint n;         // bytes from the file; the rest is zeros
+  char *page;
+};
+
+struct {
+  struct spinlock lock;
+} text;
+
+static void
+textinit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+// Find ip's cached page for n bytes at off, with a new
+// reference.  Caller must hold text.lock.
+static char*
+textfind(struct inode *ip, uint off, uint n)
+{
+  struct tpage *t;
+
+  for(t = ip->text; t; t = t->next){
+    if(t->off == off && t->n == n){
+      kincref(t->page);
+      return t->page;
+    }
+  }
+  return 0;
+}
+
+// Return a page holding the n bytes of ip at off followed by
+// zeros, shared with every process that maps the same bytes,
+// with a reference for the caller.  Returns 0 if out of memory
+// or the read fails.  Caller must hold ip->lock, shared or not.
+char*
+textget(struct inode *ip, uint off, uint n)
+{
+  struct tpage *t;
+  char *mem, *old;
+
+  acquire(&text.lock);
+  mem = textfind(ip, off, n);
+  release(&text.lock);
+  if(mem)
+    return mem;
+
+  if((mem = kzalloc()) == 0)
+    return 0;
+  if(readi(ip, mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+  if((t = kmalloc(sizeof(*t))) == 0)
+    return mem;  // stays private
+  t->off = off;
+  t->n = n;
+  t->page = mem;
+  acquire(&text.lock);
+  if((old = textfind(ip, off, n)) != 0){
+    // Another process read it meanwhile.
+    release(&text.lock);
+    kmfree(t);
+    kfree(mem);
+    return old;
+  }
+  kincref(mem);
+  t->next = ip->text;
+  ip->text = t;
+  release(&text.lock);
+  return mem;
+}
+
+// Drop ip's cached pages.  Caller must hold ip->lock
+// exclusively, or have the only pointer to ip.
+static void
+textpurge(struct inode *ip)
+{
+  struct tpage *t, *next;
+
+  if(ip->text == 0)
+    return;
+  acquire(&text.lock);
+  t = ip->text;
+  ip->text = 0;
+  release(&text.lock);
+  for(; t; t = next){
+    next = t->next;
+    kfree(t->page);
+    kmfree(t);
+  }
+}
+
+//PAGEBREAK!
+// Page cache.
+//
+// readi() of a regular file copies out of whole pages of the
+// file kept in kalloc()ed memory, and fills a missing page from
+// the buffer cache.  All files' pages hang off one hash table
+// keyed by (inode, page number), and ip->pages lists an inode's
+// own.  Pages are only added while more than PCFREE pages of
+// memory are free, and kalloc() takes the least recently used
+// ones back with pcshrink() when it runs out, so the cache
+// grows into idle memory and shrinks when it is needed.  Small
+// metadata reads (directories, indirect blocks) stay in the
+// buffer cache.
+//
+// writei() also copies what it writes into any cached pages;
+// itrunc() and recycling an icache entry drop an inode's pages.
+// pcache.lock protects the hash chains, the LRU list and every
+// ip->pages list.  A page's contents are protected by its
+// inode's lock: readers hold it shared, writers exclusively.
+// Whoever copies to or from a page holds a reference to it, so
+// that pcshrink() can drop the cache's without ip->lock.
+
+#define NPCHASH 1021
+#define PCFREE  2048  // pages left free for everyone else
+
+struct cpage {
+  struct inode *ip;
+  uint pn;                     // page number in the file
+  char *page;
+  struct cpage *hnext;         // hash chain
+  struct cpage *inext;         // ip->pages
+  struct cpage *lprev, *lnext; // LRU list, most recent first
+};
+
+struct {
+  struct spinlock lock;
+  struct cpage *hash[NPCHASH];
+  struct cpage lru;
+  struct cpage *free;  // unused cpages, chained by hnext
+  int n;
+} pcache;
+
+static void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.lnext = pcache.lru.lprev = &pcache.lru;
+}
+
+static struct cpage**
+pchash(struct inode *ip, uint pn)
+{
+  return &pcache.hash[((uint)ip / sizeof(*ip) + pn) % NPCHASH];
+}
+
+// Move c to the front of the LRU list.
+// Caller must hold pcache.lock.
+static void
+pcfront(struct cpage *c)
+{
+  if(c->lnext){
+    c->lnext->lprev = c->lprev;
+    c->lprev->lnext = c->lnext;
+  }
+  c->lnext = pcache.lru.lnext;
+  c->lprev = &pcache.lru;
+  pcache.lru.lnext->lprev = c;
+  pcache.lru.lnext = c;
+}
+
+// Take c out of the cache.  Caller must hold pcache.lock,
+// and is left to free c and drop its page.
+static void
+pcunlink(struct cpage *c)
+{
+  struct cpage **pp;
+
+  for(pp = pchash(c->ip, c->pn); *pp != c; pp = &(*pp)->hnext)
+    ;
+  *pp = c->hnext;
+  for(pp = &c->ip->pages; *pp != c; pp = &(*pp)->inext)
+    ;
+  *pp = c->inext;
+  c->lnext->lprev = c->lprev;
+  c->lprev->lnext = c->lnext;
+  pcache.n--;
+}
+
+// Return ip's cached page pn, or 0.
+// Caller must hold pcache.lock.
+static struct cpage*
+pclookup(struct inode *ip, uint pn)
+{
+  struct cpage *c;
+
+  for(c = *pchash(ip, pn); c; c = c->hnext)
+    if(c->ip == ip && c->pn == pn)
+      return c;
+  return 0;
+}
+
+static int readblocks(struct inode*, char*, uint, uint);
+
+// Return ip's page pn with a new reference, reading it into
+// the cache if need be, or 0 if memory is short.  Caller must
+// hold ip->lock, shared or not.
+static char*
+pcget(struct inode *ip, uint pn)
+{
+  struct cpage *c, *old;
+  char *page;
+  uint off, n;
+
+  acquire(&pcache.lock);
+  if((c = pclookup(ip, pn)) != 0){
+    pcfront(c);
+    kincref(c->page);
+    release(&pcache.lock);
+    return c->page;
+  }
+  if((c = pcache.free) != 0)
+    pcache.free = c->hnext;
+  release(&pcache.lock);
+
+  if(kfreecount() < PCFREE)
+    goto bad;
+  if(c == 0 && (c = kmalloc(sizeof(*c))) == 0)
+    return 0;
+  if((page = kalloc()) == 0)
+    goto bad;
+  off = pn * PGSIZE;
+  n = min(ip->size - off, PGSIZE);
+  readblocks(ip, page, off, n);
+  memset(page + n, 0, PGSIZE - n);
+
+  acquire(&pcache.lock);
+  if((old = pclookup(ip, pn)) != 0){
+    // Another reader filled it first.
+    kincref(old->page);
+    c->hnext = pcache.free;
+    pcache.free = c;
+    release(&pcache.lock);
+    kfree(page);
+    return old->page;
+  }
+  c->ip = ip;
+  c->pn = pn;
+  c->page = page;
+  c->hnext = *pchash(ip, pn);
+  *pchash(ip, pn) = c;
+  c->inext = ip->pages;
+  ip->pages = c;
+  c->lnext = 0;
+  pcfront(c);
+  pcache.n++;
+  kincref(page);  // one for the cache, one for the caller
+  release(&pcache.lock);
+  return page;
+
+bad:
+  if(c){
+    acquire(&pcache.lock);
+    c->hnext = pcache.free;
+    pcache.free = c;
+    release(&pcache.lock);
+  }
+  return 0;
+}
+
+// Copy n bytes written at off from src, a buf's data, into
+// ip's cached pages.  Caller must hold ip->lock exclusively.
+static void
+pcupdate(struct inode *ip, char *src, uint off, uint n)
+{
+  struct cpage *c;
+  char *page;
+  uint tot, m;
+
+  if(ip->pages == 0)
+    return;
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    acquire(&pcache.lock);
+    page = 0;
+    if((c = pclookup(ip, off/PGSIZE)) != 0){
+      page = c->page;
+      kincref(page);
+    }
+    release(&pcache.lock);
+    if(page){
+      memmove(page + off%PGSIZE, src, m);
+      kfree(page);
+    }
+  }
+}
+
+// Drop ip's cached pages.  Caller must hold ip->lock
+// exclusively, or have the only pointer to ip.
+static void
+pcpurge(struct inode *ip)
+{
+  struct cpage *c;
+
+  if(ip->pages == 0)
+    return;
+  acquire(&pcache.lock);
+  while((c = ip->pages) != 0){
+    pcunlink(c);
+    kfree(c->page);
+    c->hnext = pcache.free;
+    pcache.free = c;
+  }
+  release(&pcache.lock);
+}
+
+// Give up to n of the least recently used pages back to
+// kalloc(), which calls this when it runs out.  Returns the
+// number dropped.  A page still being copied is freed by
+// whoever holds the last reference.
+int
+pcshrink(int n)
+{
+  struct cpage *c;
+  int i;
+
+  if(pcache.n == 0)
+    return 0;
+  acquire(&pcache.lock);
+  for(i = 0; i < n && (c = pcache.lru.lprev) != &pcache.lru; i++){
+    pcunlink(c);
+    kfree(c->page);
+    c->hnext = pcache.free;  // kmfree() here could deadlock
+    pcache.free = c;
+  }
+  release(&pcache.lock);
+  return i;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
@@ -454,7 +1437,8 @@ int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  char *page;
+  int r;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -466,16 +1450,81 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->type != T_FILE)
+    return readblocks(ip, dst, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((page = pcget(ip, off/PGSIZE)) == 0){
+      if(readblocks(ip, dst, off, m) < 0)
+        return -1;
+      continue;
+    }
+    r = umove(dst, page + off%PGSIZE, m);
+    kfree(page);
+    if(r < 0)
+      return -1;
   }
   return n;
 }
 
+// Read n bytes at off, all within ip->size, through the
+// buffer cache.  Returns n, or -1 if dst is a bad user address.
+static int
+readblocks(struct inode *ip, char *dst, uint off, uint n)
+{
+  static char zeroes[BSIZE];
+  uint tot, m, bn, nbn;
+  struct buf *bp[NBATCH];
+  struct dblock *d;
+  int i, k, r;
+
+  if(n == 0)
+    return 0;
+  readahead(ip, off/BSIZE, (off + n - 1)/BSIZE + 1);
+
+  // Start reading up to NBATCH blocks at once, then copy
+  // each out as it arrives.
+  r = 0;
+  for(tot=0; tot<n && r == 0; ){
+    nbn = min((off + n - tot - 1)/BSIZE + 1, off/BSIZE + NBATCH);
+    for(bn = off/BSIZE, k = 0; bn < nbn; bn++, k++){
+      if((d = dfind(ip, bn)) != 0)
+        bp[k] = bread(DELAYDEV, d->key);
+      else if((m = bmap(ip, bn, 0)) == 0)
+        bp[k] = 0;  // a block never written reads as zeros
+      else
+        bp[k] = bread_async(ip->dev, m);
+    }
+    for(i = 0; i < k; i++, tot+=m, off+=m, dst+=m){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(bp[i] == 0){
+        if(r == 0)
+          r = umove(dst, zeroes, m);
+        continue;
+      }
+      bwait(bp[i]);
+      if(r == 0)
+        r = umove(dst, bp[i]->data + off%BSIZE, m);
+      brelse(bp[i]);  // all of them, even after a failed copy
+    }
+  }
+  return r < 0 ? -1 : n;
+}
+
+// Copy m bytes from src into bp for file offset off.  If src
+// is a bad user address, fill the range with zeros instead, so
+// that a buf from bgetblk() does not keep some other block's
+// data, and return -1.
+static int
+wcopy(struct buf *bp, uint off, char *src, uint m)
+{
+  if(umove(bp->data + off%BSIZE, src, m) == 0)
+    return 0;
+  memset(bp->data + off%BSIZE, 0, m);
+  return -1;
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
@@ -484,6 +1533,7 @@ writei(struct inode *ip, char *src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  int r;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
@@ -495,20 +1545,43 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  textpurge(ip);
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+  // Each block's new bytes go into the page cache from
+  // bp->data, so that the cache matches what is written.
+  r = 0;
+  for(tot=0; tot<n && r == 0; tot+=m, off+=m, src+=m){
     m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(ip->type == T_FILE && (bp = dgetblk(ip, off/BSIZE)) != 0){
+      r = wcopy(bp, off, src, m);
+      pcupdate(ip, (char*)bp->data + off%BSIZE, off, m);
+      brelse(bp);  // still pinned with B_DIRTY
+      continue;
+    }
+    // No need to read a block that will be overwritten in full.
+    if(m == BSIZE)
+      bp = bgetblk(ip->dev, bmap(ip, off/BSIZE, BM_NOZERO));
+    else
+      bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
+    r = wcopy(bp, off, src, m);
+    pcupdate(ip, (char*)bp->data + off%BSIZE, off, m);
+    if(ip->type != T_FILE)
+      log_write(bp);
+    else if(log_data(bp))
+      bwrite(bp);  // ordered mode
     brelse(bp);
   }
 
-  if(n > 0 && off > ip->size){
-    ip->size = off;
+  // Write the inode back even if the size did not change,
+  // since bmap may have filled a hole in ip->addrs[].
+  // After a failed copy, off is past the block it was for,
+  // which holds zeros there.
+  if(n > 0){
+    if(off > ip->size)
+      ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return r < 0 ? -1 : n;
 }
 
 //PAGEBREAK!
@@ -520,16 +1593,186 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Directory name cache.
+//
+// The dcache remembers the results of recent dirlookup()s,
+// keyed by (dev, directory inum, name), so that namex() can
+// resolve hot paths without scanning directory blocks.
+// An entry with inum 0 records that name is absent.
+// It is a direct-mapped table: each key has one slot, and a
+// new entry simply replaces whatever was there.
+//
+// Entries for a directory are only changed while that
+// directory is locked: dirlookup() fills them in, and
+// dirlink() and dcacheforget() correct them when the
+// directory changes.  dcache.lock protects the table itself.
+
+struct dentry {
+  uint dev;
+  uint dinum;         // directory inode number, 0 if slot is empty
+  char name[DIRSIZ];
+  uint inum;          // inode number name refers to, 0 if none
+  uint off;           // byte offset of entry in directory
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+} dcache;
+
+static void
+dcacheinit(void)
 {
-  uint off, inum;
-  struct dirent de;
+  initlock(&dcache.lock, "dcache");
+}
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+static struct dentry*
+dslot(struct inode *dp, char *name)
+{
+  uint h;
+  int i;
+
+  h = dp->dev * 31 + dp->inum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.dentry[h % NDCACHE];
+}
+
+// Look name up in the dcache.  Return 1 and set *pinum
+// and *poff if dp's entry for name is known, else 0.
+static int
+dcachelookup(struct inode *dp, char *name, uint *pinum, uint *poff)
+{
+  struct dentry *d;
+  int found;
+
+  acquire(&dcache.lock);
+  d = dslot(dp, name);
+  found = d->dinum == dp->inum && d->dev == dp->dev &&
+          namecmp(d->name, name) == 0;
+  if(found){
+    *pinum = d->inum;
+    *poff = d->off;
+  }
+  release(&dcache.lock);
+  return found;
+}
+
+// Record that dp's entry for name is inum at offset off.
+static void
+dcacheenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  d = dslot(dp, name);
+  d->dev = dp->dev;
+  d->dinum = dp->inum;
+  strncpy(d->name, name, DIRSIZ);
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Record that name has been removed from directory dp.
+void
+dcacheforget(struct inode *dp, char *name)
+{
+  dcacheenter(dp, name, 0, 0);
+}
+
+// Drop every entry for directory inode inum, which is being freed.
+static void
+dcachepurge(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < &dcache.dentry[NDCACHE]; d++)
+    if(d->dinum == inum && d->dev == dev)
+      d->dinum = 0;
+  release(&dcache.lock);
+}
+
+// Look for name in hashed directory dp: only the blocks
+// on name's bucket chain need to be searched.
+// Return its inode number and set *poff, or return 0.
+static uint
+hdirfind(struct inode *dp, char *name, uint *poff)
+{
+  uint bn, addr, k, inum;
+  struct buf *bp;
+  struct dirent *de;
+
+  bn = dirhash(name) % NDIRHASH;
+  do {
+    if((addr = bmap(dp, bn, 0)) == 0)
+      break;  // empty bucket
+    bp = bread(dp->dev, addr);
+    de = (struct dirent*)bp->data;
+    for(k = 1; k < DPB; k++){
+      if(de[k].inum != 0 && namecmp(name, de[k].name) == 0){
+        inum = de[k].inum;
+        brelse(bp);
+        *poff = bn*BSIZE + k*sizeof(*de);
+        return inum;
+      }
+    }
+    bn = ((struct dirhead*)de)->next;
+    brelse(bp);
+  } while(bn != 0);
+  return 0;
+}
+
+// Find a free slot for name in hashed directory dp,
+// chaining a new overflow block onto its bucket if the
+// bucket is full.  Return the slot's byte offset.
+static uint
+hdirslot(struct inode *dp, char *name)
+{
+  uint bn, addr, k, next;
+  struct buf *bp;
+  struct dirent *de;
+  struct dirhead h;
+
+  bn = dirhash(name) % NDIRHASH;
+  for(;;){
+    if((addr = bmap(dp, bn, 0)) == 0)
+      return bn*BSIZE + sizeof(*de);  // writei allocates the bucket
+    bp = bread(dp->dev, addr);
+    de = (struct dirent*)bp->data;
+    for(k = 1; k < DPB; k++)
+      if(de[k].inum == 0)
+        break;
+    next = ((struct dirhead*)de)->next;
+    brelse(bp);
+    if(k < DPB)
+      return bn*BSIZE + k*sizeof(*de);
+    if(next == 0)
+      break;
+    bn = next;
+  }
+
+  // Append an empty overflow block and link it after bn.
+  next = dp->size / BSIZE;
+  memset(&h, 0, sizeof(h));
+  if(writei(dp, (char*)&h, next*BSIZE, sizeof(h)) != sizeof(h))
+    panic("hdirslot");
+  dp->size = (next+1)*BSIZE;
+  iupdate(dp);
+  h.next = next;
+  if(writei(dp, (char*)&h, bn*BSIZE, sizeof(h)) != sizeof(h))
+    panic("hdirslot");
+  return next*BSIZE + sizeof(*de);
+}
+
+// Look for name in linear directory dp.
+// Return its inode number and set *poff, or return 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
+{
+  uint off;
+  struct dirent de;
 
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -538,16 +1781,78 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       continue;
     if(namecmp(name, de.name) == 0){
       // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      *poff = off;
+      return de.inum;
     }
   }
-
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint off, inum;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(!dcachelookup(dp, name, &inum, &off)){
+    off = 0;
+    if(dp->major == DIRHASHED)
+      inum = hdirfind(dp, name, &off);
+    else
+      inum = dirfind(dp, name, &off);
+    dcacheenter(dp, name, inum, off);
+  }
+
+  if(inum == 0)
+    return 0;
+  if(poff)
+    *poff = off;
+  return iget(dp->dev, inum);
+}
+
+// Copy up to n in-use entries of directory dp, starting at
+// byte offset *off, into de, and advance *off past the entries
+// looked at.  Holes in a hashed directory are skipped without
+// being read.  Returns the number of entries copied, or -1 if
+// de is a bad user address.
+// Caller must hold dp->lock.
+int
+dirread(struct inode *dp, uint *off, struct dirent *de, int n)
+{
+  uint o, addr, k;
+  struct buf *bp;
+  struct dirent *d;
+  int i;
+
+  if(dp->type != T_DIR)
+    panic("dirread not DIR");
+
+  i = 0;
+  o = *off - *off % sizeof(*d);
+  while(i < n && o < dp->size){
+    if((addr = bmap(dp, o/BSIZE, 0)) == 0){
+      o += BSIZE - o%BSIZE;
+      continue;
+    }
+    bp = bread(dp->dev, addr);
+    d = (struct dirent*)bp->data;
+    for(k = o%BSIZE/sizeof(*d); k < DPB && i < n && o < dp->size; k++){
+      if(d[k].inum != 0 && umove(&de[i++], &d[k], sizeof(*d)) < 0){
+        brelse(bp);
+        return -1;
+      }
+      o += sizeof(*d);
+    }
+    brelse(bp);
+  }
+  *off = o;
+  return i;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
@@ -562,18 +1867,23 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dp->major == DIRHASHED)
+    off = hdirslot(dp, name);
+  else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcacheenter(dp, name, inum, off);
 
   return 0;
 }
@@ -621,34 +1931,43 @@ skipelem(char *path, char *name)
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
+// A relative path starts from directory dp.
 // Must be called inside a transaction since it calls iput().
 static struct inode*
-namex(char *path, int nameiparent, char *name)
+namex(struct inode *dp, char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(dp);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
-      return 0;
+    if(namecmp(name, "..") == 0 && (next = mountpoint(ip)) != 0){
+      // Up out of a mounted file system.
+      iunlockshared(ip);
+      iput(ip);
+      ip = idup(next);
+      ilockshared(ip);
     }
-    iunlockput(ip);
-    ip = next;
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if(next == 0)
+      return 0;
+    ip = mountcross(next);
   }
   if(nameiparent){
     iput(ip);
@@ -661,11 +1980,20 @@ struct inode*
 namei(char *path)
 {
   char name[DIRSIZ];
-  return namex(path, 0, name);
+  return namex(myproc()->cwd, path, 0, name);
+}
+
+// Look up path relative to directory dp rather than the
+// current directory, as fstatat() does.
+struct inode*
+nameiat(struct inode *dp, char *path)
+{
+  char name[DIRSIZ];
+  return namex(dp, path, 0, name);
 }
 
 struct inode*
 nameiparent(char *path, char *name)
 {
-  return namex(path, 1, name);
+  return namex(myproc()->cwd, path, 1, name);
 }
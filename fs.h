@@ -19,11 +19,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // SB_*
 };
 
-#define NDIRECT 12
+#define SB_ORDERED 0x1  // file data goes home, not through the log
+
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +36,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -55,3 +59,33 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory whose major number is DIRHASHED is indexed:
+// it is a sparse file whose first NDIRHASH blocks are hash
+// buckets, and an entry lives in bucket dirhash(name)%NDIRHASH.
+// When a bucket fills, overflow blocks are appended to the
+// file and chained from it.  Each block of such a directory
+// begins with a dirhead, which has inum 0 so that programs
+// reading the directory as a list of dirents skip over it.
+#define DIRHASHED 1
+#define NDIRHASH 64
+#define DPB (BSIZE / sizeof(struct dirent))
+
+struct dirhead {
+  ushort inum;             // always 0
+  ushort pad;
+  uint next;               // block number of next overflow block, or 0
+  char unused[DIRSIZ-6];
+};
+
+static inline uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h;
+}
+
@@ -1,54 +1,222 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled to a list of nodes, each a character
+// or . with an optional *, which is an NFA whose states are the
+// positions between nodes.  Sets of NFA states become DFA states
+// as the input needs them, so each byte of input costs one table
+// lookup.  Lines that lack the pattern's first literal character
+// are rejected by memchr() without running the DFA at all.
 
 #include "types.h"
 #include "stat.h"
 #include "user.h"
 
-char buf[1024];
-int match(char*, char*);
+#define NNODE   63    // longest pattern; state NNODE is reserved to accept
+#define NDSTATE 128   // DFA states kept before starting over
+#define ANY     -1
+
+struct node {
+  int c;      // character to match, or ANY
+  int star;   // followed by *
+};
+
+struct dstate {
+  uint64 set;       // NFA states this stands for
+  short next[256];  // DFA state after each byte, -1 if not yet known
+};
+
+struct node node[NNODE];
+int nnode;
+int bol, eol;       // pattern has ^, $
+int lit = -1;       // character every match starts with, if any
+
+struct dstate dstate[NDSTATE];
+int ndstate;
+int start;          // DFA state at the start of a line
+
+char buf[32768];
+char obuf[4096];
+int nobuf;
+
+void
+compile(char *re)
+{
+  if(*re == '^'){
+    bol = 1;
+    re++;
+  }
+  for(; *re; re++){
+    if(re[0] == '$' && re[1] == '\0'){
+      eol = 1;
+      break;
+    }
+    if(nnode == NNODE){
+      printf(2, "grep: pattern too long\n");
+      exit();
+    }
+    node[nnode].c = re[0] == '.' ? ANY : (uchar)re[0];
+    if((node[nnode].star = re[1] == '*'))
+      re++;
+    nnode++;
+  }
+  if(!bol && nnode > 0 && node[0].c != ANY && !node[0].star)
+    lit = node[0].c;
+}
+
+// Add the states reachable by skipping starred nodes.
+uint64
+closure(uint64 s)
+{
+  int i;
+
+  for(i = 0; i < nnode; i++)
+    if((s >> i & 1) && node[i].star)
+      s |= (uint64)1 << (i+1);
+  return s;
+}
+
+// NFA states after reading byte c in states s.
+uint64
+step(uint64 s, int c)
+{
+  uint64 t;
+  int i;
+
+  t = 0;
+  for(i = 0; i < nnode; i++){
+    if(!(s >> i & 1) || (node[i].c != ANY && node[i].c != c))
+      continue;
+    t |= (uint64)1 << (node[i].star ? i : i+1);
+  }
+  if(!bol)
+    t |= 1;  // a match may start at the next byte
+  return closure(t);
+}
+
+int
+accepting(int d)
+{
+  return dstate[d].set >> nnode & 1;
+}
+
+// The DFA state for NFA state set s, made if need be.
+// When the table fills, it is emptied and rebuilt.
+int
+dfind(uint64 s)
+{
+  int i;
+
+  for(i = 0; i < ndstate; i++)
+    if(dstate[i].set == s)
+      return i;
+  if(ndstate == NDSTATE){
+    ndstate = 0;
+    start = dfind(closure(1));
+    if(s == dstate[start].set)
+      return start;
+  }
+  i = ndstate++;
+  dstate[i].set = s;
+  memset(dstate[i].next, 0xff, sizeof(dstate[i].next));
+  return i;
+}
+
+// Does the line p[0..n-1] match?
+int
+match(char *p, int n)
+{
+  char *e, *q;
+  int d, k, c;
+  uint64 s;
+
+  e = p + n;
+  if(lit >= 0){
+    if((q = memchr(p, lit, n)) == 0)
+      return 0;
+    p = q;
+  }
+  d = start;
+  for(; p < e; p++){
+    if(!eol && accepting(d))
+      return 1;
+    c = (uchar)*p;
+    if((k = dstate[d].next[c]) < 0){
+      s = dstate[d].set;
+      k = dfind(step(s, c));
+      if(d < ndstate && dstate[d].set == s)
+        dstate[d].next[c] = k;
+    }
+    d = k;
+    if(dstate[d].set == 0)
+      return 0;
+  }
+  return accepting(d);
+}
 
 void
-grep(char *pattern, int fd)
+oflush(void)
+{
+  write(1, obuf, nobuf);
+  nobuf = 0;
+}
+
+void
+output(char *p, int n)
+{
+  if(nobuf + n > sizeof(obuf))
+    oflush();
+  if(n > sizeof(obuf)){
+    write(1, p, n);
+    return;
+  }
+  memmove(obuf + nobuf, p, n);
+  nobuf += n;
+}
+
+void
+grep(int fd)
 {
   int n, m;
   char *p, *q;
 
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
+  while((n = read(fd, buf+m, sizeof(buf)-m)) > 0){
     m += n;
-    buf[m] = '\0';
     p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
+    while((q = memchr(p, '\n', buf+m - p)) != 0){
+      if(match(p, q - p))
+        output(p, q+1 - p);
       p = q+1;
     }
-    if(p == buf)
+    if(p == buf && m == sizeof(buf)){
+      // A line longer than buf: treat this much as a line.
+      if(match(buf, m))
+        output(buf, m);
       m = 0;
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+      continue;
     }
+    m -= p - buf;
+    memmove(buf, p, m);
   }
+  if(m > 0 && match(buf, m))
+    output(buf, m);
+  oflush();
 }
 
 int
 main(int argc, char *argv[])
 {
   int fd, i;
-  char *pattern;
 
   if(argc <= 1){
     printf(2, "usage: grep pattern [file ...]\n");
     exit();
   }
-  pattern = argv[1];
+  compile(argv[1]);
+  start = dfind(closure(1));
 
   if(argc <= 2){
-    grep(pattern, 0);
+    grep(0);
     exit();
   }
 
@@ -57,51 +225,8 @@ main(int argc, char *argv[])
       printf(1, "grep: cannot open %s\n", argv[i]);
       exit();
     }
-    grep(pattern, fd);
+    grep(fd);
     close(fd);
   }
   exit();
 }
-
-// Regexp matcher from Kernighan & Pike,
-// The Practice of Programming, Chapter 9.
-
-int matchhere(char*, char*);
-int matchstar(int, char*, char*);
-
-int
-match(char *re, char *text)
-{
-  if(re[0] == '^')
-    return matchhere(re+1, text);
-  do{  // must look at empty string
-    if(matchhere(re, text))
-      return 1;
-  }while(*text++ != '\0');
-  return 0;
-}
-
-// matchhere: search for re at beginning of text
-int matchhere(char *re, char *text)
-{
-  if(re[0] == '\0')
-    return 1;
-  if(re[1] == '*')
-    return matchstar(re[0], re+2, text);
-  if(re[0] == '$' && re[1] == '\0')
-    return *text == '\0';
-  if(*text!='\0' && (re[0]=='.' || re[0]==*text))
-    return matchhere(re+1, text+1);
-  return 0;
-}
-
-// matchstar: search for c*re at beginning of text
-int matchstar(int c, char *re, char *text)
-{
-  do{  // a * matches zero or more instances
-    if(matchhere(re, text))
-      return 1;
-  }while(*text!='\0' && (*text++==c || c=='.'));
-  return 0;
-}
-
@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code, using bus-master DMA when the controller
+// supports it and programmed I/O otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +13,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "trace.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,15 +25,63 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+// Bus-master IDE registers, relative to the base in PCI BAR4.
+#define BM_CMD        0       // Command
+  #define BM_START    0x01    // Start transfer
+  #define BM_READ     0x08    // Transfer is a disk read (to memory)
+#define BM_STATUS     2       // Status
+  #define BM_ERR      0x02    // Transfer failed
+  #define BM_INTR     0x04    // Device raised its interrupt
+#define BM_PRDT       4       // Physical address of PRD table
+
+#define PRD_EOT       0x80000000  // Last entry of a PRD table
+
+// Max blocks merged into one command.  Each block needs at
+// most two PRD entries, since a PRD entry must not cross a
+// 64 Kbyte boundary.
+#define IDE_MAXRUN    32
+
+// Physical region descriptor: one piece of a DMA transfer.
+struct prd {
+  uint addr;
+  uint count;   // byte count in low 16 bits, PRD_EOT
+};
+
+// Requests older than this are not overtaken by new ones.
+#define IDE_DEADLINE  100000000ULL  // ns
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
+// The command in flight covers the first idenbuf bufs of the
+// queue, which are consecutive blocks of the same device.
 // You must hold idelock while manipulating queue.
+//
+// The rest of the queue is in C-LOOK order: ascending block
+// numbers from idepos, where the disk head will be once the
+// command in flight is done, then ascending from the lowest
+// block again.  A buf cannot be queued ahead of one that has
+// waited longer than IDE_DEADLINE, so nothing starves.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idenbuf;
+static uint64 idepos;
+
+// Counts and latencies (submit to completion) of reads [0]
+// and writes [1], and the number of disk commands.
+static struct {
+  uint n[2];
+  uint64 lat[2];
+  uint64 maxlat[2];
+  uint ncmd;
+} idestat;
 
 static int havedisk1;
+static ushort bmbase;   // bus-master I/O base, or 0 if no DMA
+static struct prd prdt[2*IDE_MAXRUN] __attribute__((aligned(512)));
 static void idestart(struct buf*);
 
 // Wait for IDE disk to become ready.
@@ -47,13 +97,53 @@ idewait(int checkerr)
   return 0;
 }
 
+static uint
+pciread(int bus, int dev, int func, int off)
+{
+  outl(0xcf8, 0x80000000 | bus<<16 | dev<<11 | func<<8 | (off & 0xfc));
+  return inl(0xcfc);
+}
+
+static void
+pciwrite(int bus, int dev, int func, int off, uint v)
+{
+  outl(0xcf8, 0x80000000 | bus<<16 | dev<<11 | func<<8 | (off & 0xfc));
+  outl(0xcfc, v);
+}
+
+// Look on PCI bus 0 for an IDE controller that can do
+// bus-master DMA, enable it, and record its register base.
+static void
+idedmainit(void)
+{
+  int dev, func;
+  uint class, bar;
+
+  for(dev = 0; dev < 32; dev++){
+    for(func = 0; func < 8; func++){
+      if((pciread(0, dev, func, 0x00) & 0xffff) == 0xffff)
+        continue;
+      class = pciread(0, dev, func, 0x08) >> 16;
+      if(class != 0x0101)  // mass storage, IDE
+        continue;
+      bar = pciread(0, dev, func, 0x20);
+      if((bar & 1) == 0 || (bar & ~3) == 0)
+        continue;
+      // Enable I/O space and bus mastering.
+      pciwrite(0, dev, func, 0x04, pciread(0, dev, func, 0x04) | 0x5);
+      bmbase = bar & 0xfffc;
+      return;
+    }
+  }
+}
+
 void
 ideinit(void)
 {
   int i;
 
   initlock(&idelock, "ide");
-  ioapicenable(IRQ_IDE, ncpu - 1);
+  ioapicenable(IRQ_IDE, -1);
   idewait(0);
 
   // Check if disk 1 is present
@@ -67,16 +157,46 @@ ideinit(void)
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  idedmainit();
+  for(i = 0; i < 2; i++){
+    bdevsw[i].submit = idesubmit;
+    bdevsw[i].wait = idewaitbuf;
+  }
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Fill prdt to cover the data of the n bufs starting at b.
+static void
+idefillprd(struct buf *b, int n)
+{
+  struct prd *e;
+  uint pa, len, m;
+
+  e = prdt;
+  for(; n > 0; n--, b = b->qnext){
+    pa = V2P(b->data);
+    for(len = BSIZE; len > 0; len -= m, pa += m, e++){
+      m = 0x10000 - (pa & 0xffff);  // bytes to the next 64K boundary
+      if(m > len)
+        m = len;
+      e->addr = pa;
+      e->count = m;
+    }
+  }
+  e[-1].count |= PRD_EOT;
+}
+
+// Start the request for b, merging the bufs that follow it
+// in the queue when they continue it on disk.
+// Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *q;
+  int n, write;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
   int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
@@ -84,14 +204,40 @@ idestart(struct buf *b)
 
   if (sector_per_block > 7) panic("idestart");
 
+  write = (b->flags & B_DIRTY) != 0;
+  n = 1;
+  if(bmbase){
+    for(q = b; n < IDE_MAXRUN && q->qnext; q = q->qnext, n++){
+      if(q->qnext->dev != b->dev || q->qnext->blockno != q->blockno+1)
+        break;
+      if(((q->qnext->flags & B_DIRTY) != 0) != write)
+        break;
+    }
+  }
+  if((b->blockno + n) * sector_per_block > (1 << 28))  // LBA28
+    panic("incorrect blockno");
+  idenbuf = n;
+  idepos = ((uint64)b->dev << 32) + b->blockno + n;
+  idestat.ncmd++;
+  // Complete on the CPU the waiting process is likely on.
+  ioapicfollow(IRQ_IDE, b->qcpu);
+  trace(TR_DISKSTART, b->blockno, n, 0);
+
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, n * sector_per_block);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  if(bmbase){
+    idefillprd(b, n);
+    outl(bmbase+BM_PRDT, V2P(prdt));
+    outb(bmbase+BM_STATUS, inb(bmbase+BM_STATUS) | BM_ERR | BM_INTR);
+    outb(bmbase+BM_CMD, write ? 0 : BM_READ);
+    outb(0x1f7, write ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(bmbase+BM_CMD, (write ? 0 : BM_READ) | BM_START);
+  } else if(write){
     outb(0x1f7, write_cmd);
     outsl(0x1f0, b->data, BSIZE/4);
   } else {
@@ -104,24 +250,48 @@ void
 ideintr(void)
 {
   struct buf *b;
+  int n, st, w;
+  uint64 lat, now;
 
-  // First queued buffer is the active request.
+  // First queued buffers are the active request.
   acquire(&idelock);
 
   if((b = idequeue) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
+  trace(TR_DISKDONE, b->blockno, idenbuf, 0);
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
+  if(bmbase){
+    // Stop the DMA engine and acknowledge the interrupt.
+    st = inb(bmbase+BM_STATUS);
+    outb(bmbase+BM_CMD, 0);
+    outb(bmbase+BM_STATUS, st | BM_ERR | BM_INTR);
+    if((st & BM_ERR) || idewait(1) < 0)
+      panic("ideintr: dma error");
+  } else if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
+    // Read data if needed.
     insl(0x1f0, b->data, BSIZE/4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for these bufs,
+  // and release the asynchronous ones.
+  now = nsec();
+  for(n = idenbuf; n > 0; n--){
+    b = idequeue;
+    idequeue = b->qnext;
+    w = (b->flags & B_DIRTY) != 0;
+    lat = now - b->qtime;
+    idestat.n[w]++;
+    idestat.lat[w] += lat;
+    if(lat > idestat.maxlat[w])
+      idestat.maxlat[w] = lat;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC)
+      biodone(b);
+    else
+      wakeup(b);
+  }
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
@@ -130,39 +300,101 @@ ideintr(void)
   release(&idelock);
 }
 
-//PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void
-iderw(struct buf *b)
+// Where b falls in C-LOOK order from idepos.
+static uint64
+idekey(struct buf *b)
 {
-  struct buf **pp;
+  uint64 k;
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+  k = ((uint64)b->dev << 32) + b->blockno;
+  if(k < idepos)
+    k += 1ULL << 40;  // after the wrap-around
+  return k;
+}
 
-  acquire(&idelock);  //DOC:acquire-lock
+// Insert b into idequeue after the first nactive bufs.
+// Caller must hold idelock.
+static void
+ideinsert(struct buf *b, int nactive, uint64 now)
+{
+  struct buf **pp, **start;
+  uint64 k;
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+  start = &idequeue;
+  for(; nactive > 0; nactive--)
+    start = &(*start)->qnext;
+  for(pp = start; *pp; pp = &(*pp)->qnext)
+    if(now - (*pp)->qtime > IDE_DEADLINE)
+      start = &(*pp)->qnext;
+  k = idekey(b);
+  for(pp = start; *pp && idekey(*pp) <= k; pp = &(*pp)->qnext)
     ;
+  b->qtime = now;
+  b->qcpu = cpuid();
+  b->qnext = *pp;
   *pp = b;
+}
 
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+// Print disk request statistics, for procdump().
+void
+idestatdump(void)
+{
+  char *what[] = { "reads", "writes" };
+  int w;
 
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  for(w = 0; w < 2; w++)
+    if(idestat.n[w] > 0)
+      cprintf("ide %s: %d avg %d us max %d us\n", what[w], idestat.n[w],
+              (uint)udiv64(udiv64(idestat.lat[w], idestat.n[w]), 1000),
+              (uint)udiv64(idestat.maxlat[w], 1000));
+  cprintf("ide commands: %d\n", idestat.ncmd);
+}
+
+//PAGEBREAK!
+// Queue the n bufs in bs for the disk without waiting.
+// For each, if B_DIRTY is set, write buf to disk, clear B_DIRTY,
+// set B_VALID.  Else if B_VALID is not set, read buf from disk,
+// set B_VALID.  Queueing them together lets idestart() merge
+// consecutive blocks into one command.
+void
+idesubmit(struct buf **bs, int n)
+{
+  struct buf *b;
+  uint64 now;
+  int i, idle;
+
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    if(!holdingsleep(&b->lock))
+      panic("iderw: buf not locked");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(b->dev != 0 && !havedisk1)
+      panic("iderw: ide disk 1 not present");
   }
 
+  acquire(&idelock);  //DOC:acquire-lock
+
+  // Sort bs into idequeue, behind the command in flight.
+  idle = idequeue == 0;
+  now = nsec();
+  for(i = 0; i < n; i++)  //DOC:insert-queue
+    ideinsert(bs[i], idle ? 0 : idenbuf, now);
+
+  // Start disk if necessary.
+  if(idle && idequeue != 0)
+    idestart(idequeue);
+
+  release(&idelock);
+}
 
+// Wait for the request for b queued by idesubmit() to finish.
+void
+idewaitbuf(struct buf *b)
+{
+  acquire(&idelock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &idelock);
   release(&idelock);
 }
+
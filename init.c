@@ -10,7 +10,7 @@ char *argv[] = { "sh", 0 };
 int
 main(void)
 {
-  int pid, wpid;
+  int pid, wpid, fd;
 
   if(open("console", O_RDWR) < 0){
     mknod("console", 1, 1);
@@ -19,6 +19,19 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  if((fd = open("prof", O_RDONLY)) < 0)
+    mknod("prof", 2, 0);  // major PROF, see prof.c
+  else
+    close(fd);
+  if((fd = open("trace", O_RDONLY)) < 0)
+    mknod("trace", 3, 0);  // major TRACE, see trace.c
+  else
+    close(fd);
+
+  mkdir("tmp");
+  if(mount("tmp", 2) < 0)
+    printf(1, "init: cannot mount tmp\n");
+
   for(;;){
     printf(1, "init: starting sh\n");
     pid = fork();
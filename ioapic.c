@@ -4,6 +4,10 @@
 
 #include "types.h"
 #include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
 #include "traps.h"
 
 #define IOAPIC  0xFEC00000   // Default physical address of IO APIC
@@ -24,6 +28,23 @@
 
 volatile struct ioapic *ioapic;
 
+// Where each enabled interrupt is routed.  ioapicenable() with
+// cpu -1 routes the interrupt to the boot CPU, and each CPU
+// spreads such interrupts over the CPUs started so far, with
+// ioapicspread(), once it is up to take them.  A device
+// driver may move its interrupt to the CPU that started the
+// request it will complete, with ioapicfollow(), unless
+// irqaffinity() has pinned it.  ioapic.lock serializes the
+// register writes, which take two steps.
+static struct {
+  struct spinlock lock;
+  int maxintr;
+  char enabled[NIOIRQ];
+  char spread[NIOIRQ];     // enabled with cpu -1
+  char pinned[NIOIRQ];
+  char cpu[NIOIRQ];
+} route;
+
 // IO APIC MMIO structure: write reg, then read or write data.
 struct ioapic {
   uint reg;
@@ -50,8 +71,10 @@ ioapicinit(void)
 {
   int i, id, maxintr;
 
+  initlock(&route.lock, "ioapic");
   ioapic = (volatile struct ioapic*)IOAPIC;
   maxintr = (ioapicread(REG_VER) >> 16) & 0xFF;
+  route.maxintr = maxintr < NIOIRQ ? maxintr : NIOIRQ - 1;
   id = ioapicread(REG_ID) >> 24;
   if(id != ioapicid)
     cprintf("ioapicinit: id isn't equal to ioapicid; not a MP\n");
@@ -64,12 +87,110 @@ ioapicinit(void)
   }
 }
 
+// Point irq at cpu.  Caller must hold route.lock.
+static void
+ioapicset(int irq, int cpu)
+{
+  route.cpu[irq] = cpu;
+  ioapicwrite(REG_TABLE+2*irq+1, cpus[cpu].apicid << 24);
+}
+
+// Mark interrupt irq edge-triggered, active high, enabled,
+// and routed to CPU cpu, or if cpu is -1 to this CPU until
+// ioapicspread() moves it.  Called during boot.
 void
-ioapicenable(int irq, int cpunum)
+ioapicenable(int irq, int cpu)
 {
-  // Mark interrupt edge-triggered, active high,
-  // enabled, and routed to the given cpunum,
-  // which happens to be that cpu's APIC ID.
+  acquire(&route.lock);
+  if(irq > route.maxintr)
+    panic("ioapicenable");
+  if(cpu < 0){
+    route.spread[irq] = 1;
+    cpu = cpuid();
+  }
+  ioapicset(irq, cpu);
   ioapicwrite(REG_TABLE+2*irq, T_IRQ0 + irq);
-  ioapicwrite(REG_TABLE+2*irq+1, cpunum << 24);
+  route.enabled[irq] = 1;
+  release(&route.lock);
+}
+
+// Deal the unpinned interrupts enabled with cpu -1 out over
+// the CPUs that have started, in turn.  Each CPU calls this
+// once it has set started, so that no interrupt is routed to
+// a CPU that cannot yet take it.
+void
+ioapicspread(void)
+{
+  int irq, i, n;
+  struct cpu *c, *up[NCPU];
+
+  n = 0;
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c->started)
+      up[n++] = c;
+  acquire(&route.lock);
+  for(irq = 0, i = 0; irq <= route.maxintr; irq++){
+    if(!route.enabled[irq] || !route.spread[irq] || route.pinned[irq])
+      continue;
+    ioapicset(irq, up[i++ % n] - cpus);
+  }
+  release(&route.lock);
+}
+
+// Route irq to cpu, which is about to start the request its
+// next interrupt will complete, unless irq is pinned.
+// Called only by the driver of irq, with its lock held, so
+// that no interrupt is pending.
+void
+ioapicfollow(int irq, int cpu)
+{
+  if(route.pinned[irq] || route.cpu[irq] == cpu)
+    return;
+  acquire(&route.lock);
+  if(!route.pinned[irq])
+    ioapicset(irq, cpu);
+  release(&route.lock);
+}
+
+// Pin enabled interrupt irq to CPU cpu, or unpin it
+// if cpu is -1.
+int
+irqaffinity(int irq, int cpu)
+{
+  if(irq < 0 || irq >= NIOIRQ || cpu < -1 || cpu >= ncpu ||
+     (cpu >= 0 && !cpus[cpu].started))
+    return -1;
+  acquire(&route.lock);
+  if(!route.enabled[irq]){
+    release(&route.lock);
+    return -1;
+  }
+  route.pinned[irq] = cpu >= 0;
+  if(cpu >= 0)
+    ioapicset(irq, cpu);
+  release(&route.lock);
+  return 0;
+}
+
+// Print interrupt counts per CPU, and where each device
+// interrupt goes, for procdump().
+void
+irqstatdump(void)
+{
+  int irq, i, any;
+  struct cpu *c;
+
+  for(irq = 0; irq < NIOIRQ; irq++){
+    any = route.enabled[irq];
+    for(c = cpus; c < cpus+ncpu; c++)
+      any |= c->nintr[irq] != 0;
+    if(!any)
+      continue;
+    cprintf("irq %d:", irq);
+    for(i = 0; i < ncpu; i++)
+      cprintf(" %d", cpus[i].nintr[irq]);
+    if(route.enabled[irq])
+      cprintf(" -> cpu%d%s", route.cpu[irq], route.pinned[irq] ? " pinned" : "");
+    cprintf("\n");
+  }
 }
@@ -1,13 +1,32 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Each CPU has its own free list with its own lock, so that
+// kalloc() and kfree() on different CPUs do not contend.
+// A CPU whose list runs dry steals a batch of pages from
+// the other CPUs' lists.
+//
+// Every allocated page also has a reference count, so that
+// a page shared copy-on-write by several page tables is only
+// returned to a free list when its last reference is dropped.
+//
+// kzalloc() hands out zeroed pages from a small pool that idle
+// CPUs keep full (kzfill(), from scheduler()), so that most
+// callers do not pay for zeroing.  Freed pages are filled with
+// junk only when the kernel is built with -DMEMDEBUG.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
+#include "x86.h"
+
+#define KSTEAL 32  // pages moved per steal from another CPU
+#define NZERO  64  // pages kept in the zeroed pool
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,40 +36,188 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
-  int use_lock;
   struct run *freelist;
+  int nfree;
+};
+
+struct {
+  volatile int use_lock;
+  int next;      // next CPU list to receive a page from freerange
+  char *start;   // kinit2's range, shared out to the CPUs
+  char *end;
+  volatile int go;
+  volatile int nleft;  // CPUs still freeing their share
+  struct kmem cpu[NCPU];
 } kmem;
 
+// Zeroed pages, allocated but not yet handed out.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} kzero;
+
+// Reference counts of physical pages, indexed by page number.
+// Updated with atomic instructions rather than under a lock.
+static ushort pgref[PHYSTOP/PGSIZE];
+
+static void kpush(struct kmem*, struct run*);
+static char* kzpop(void);
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// kinit1() deals its pages out round-robin to the CPUs' lists.
+// In kinit2() every CPU frees a slice of the range onto its own
+// list, in parallel; the APs join in from kinit2ap().
 void
 kinit1(void *vstart, void *vend)
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem");
+  initlock(&kzero.lock, "kzero");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
 
+// Free this CPU's slice of kinit2's range.  No locks:
+// nothing else touches this CPU's list until use_lock is set.
+static void
+kinitslice(void)
+{
+  struct kmem *km;
+  char *p, *e;
+  uint npage;
+  int id;
+
+  id = cpuid();
+  km = &kmem.cpu[id];
+  npage = (kmem.end - kmem.start) / PGSIZE;
+  p = kmem.start + npage*id/ncpu*PGSIZE;
+  e = kmem.start + npage*(id+1)/ncpu*PGSIZE;
+  for(; p < e; p += PGSIZE){
+    if(p < end || V2P(p) >= PHYSTOP)
+      panic("kinitslice");
+#ifdef MEMDEBUG
+    memset(p, 1, PGSIZE);
+#endif
+    kpush(km, (struct run*)p);
+  }
+  __sync_fetch_and_sub(&kmem.nleft, 1);
+}
+
 void
 kinit2(void *vstart, void *vend)
 {
-  freerange(vstart, vend);
+  kmem.start = (char*)PGROUNDUP((uint)vstart);
+  kmem.end = kmem.start + ((char*)vend - kmem.start) / PGSIZE * PGSIZE;
+  kmem.nleft = ncpu;
+  __sync_synchronize();
+  kmem.go = 1;
+  kinitslice();
+  while(kmem.nleft > 0)
+    pause();
   kmem.use_lock = 1;
 }
 
+// Called by each AP on its way up: free its share of
+// kinit2's range, and wait until the allocator is ready.
+void
+kinit2ap(void)
+{
+  while(kmem.go == 0)
+    pause();
+  kinitslice();
+  while(kmem.use_lock == 0)
+    pause();
+}
+
 void
 freerange(void *vstart, void *vend)
 {
   char *p;
+  int n;
+
+  n = ncpu > 0 ? ncpu : 1;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    if((uint)p % PGSIZE || p < end || V2P(p) >= PHYSTOP)
+      panic("freerange");
+#ifdef MEMDEBUG
+    memset(p, 1, PGSIZE);
+#endif
+    kpush(&kmem.cpu[kmem.next++ % n], (struct run*)p);
+  }
+}
+
+// Return the free list of the CPU we are running on.
+// The caller may be rescheduled onto another CPU right
+// after; that is harmless since every list is locked.
+static struct kmem*
+mykmem(void)
+{
+  struct kmem *km;
+
+  pushcli();
+  km = &kmem.cpu[cpuid()];
+  popcli();
+  return km;
+}
+
+// Put page r on list km.
+static void
+kpush(struct kmem *km, struct run *r)
+{
+  if(kmem.use_lock)
+    acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  if(kmem.use_lock)
+    release(&km->lock);
 }
+
+// Move up to KSTEAL pages from another CPU's list to km.
+// Only one list lock is held at a time, so two CPUs
+// stealing from each other cannot deadlock.
+static void
+ksteal(struct kmem *km)
+{
+  struct kmem *victim;
+  struct run *head, *tail;
+  int n;
+
+  for(victim = kmem.cpu; victim < &kmem.cpu[NCPU]; victim++){
+    if(victim == km || victim->freelist == 0)
+      continue;
+    acquire(&victim->lock);
+    head = tail = victim->freelist;
+    n = 0;
+    if(head){
+      for(n = 1; n < KSTEAL && tail->next; n++)
+        tail = tail->next;
+      victim->freelist = tail->next;
+      victim->nfree -= n;
+    }
+    release(&victim->lock);
+    if(head == 0)
+      continue;
+
+    acquire(&km->lock);
+    tail->next = km->freelist;
+    km->freelist = head;
+    km->nfree += n;
+    release(&km->lock);
+    return;
+  }
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
@@ -59,21 +226,27 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  ushort r;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  // Only the last reference actually frees the page.
+  r = __sync_sub_and_fetch(&pgref[V2P(v)/PGSIZE], 1);
+  if(r == (ushort)-1)
+    panic("kfree: ref");
+  if(r > 0)
+    return;
+
+#ifdef MEMDEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
   if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+    kpush(mykmem(), (struct run*)v);
+  else
+    kpush(&kmem.cpu[0], (struct run*)v);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -82,15 +255,125 @@ kfree(char *v)
 char*
 kalloc(void)
 {
+  struct kmem *km;
   struct run *r;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
+  if(!kmem.use_lock)
+    km = &kmem.cpu[0];
+  else
+    km = mykmem();
+
+  for(;;){
+    if(kmem.use_lock)
+      acquire(&km->lock);
+    r = km->freelist;
+    if(r){
+      km->freelist = r->next;
+      km->nfree--;
+    }
+    if(kmem.use_lock)
+      release(&km->lock);
+    if(r || !kmem.use_lock)
+      break;
+    ksteal(km);
+    // Take pages back from the page cache before
+    // dipping into the zeroed pool.
+    if(km->freelist == 0 && pcshrink(KSTEAL) == 0)
+      break;
+  }
   if(r)
-    kmem.freelist = r->next;
+    pgref[V2P(r)/PGSIZE] = 1;
+  else
+    r = (struct run*)kzpop();  // last resort: the zeroed pool
+  return (char*)r;
+}
+
+// Take a page from the zeroed pool, or return 0 if it is empty.
+static char*
+kzpop(void)
+{
+  struct run *r;
+
+  if(kzero.list == 0)
+    return 0;
+  if(kmem.use_lock)
+    acquire(&kzero.lock);
+  if((r = kzero.list) != 0){
+    kzero.list = r->next;
+    kzero.n--;
+    r->next = 0;   // the only non-zero word
+  }
   if(kmem.use_lock)
-    release(&kmem.lock);
+    release(&kzero.lock);
   return (char*)r;
 }
 
+// Allocate one zeroed page.
+// Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(void)
+{
+  char *p;
+
+  if((p = kzpop()) != 0)
+    return p;
+  if((p = kalloc()) != 0)
+    memset(p, 0, PGSIZE);
+  return p;
+}
+
+// Zero one page into the pool, if it is not full.
+// Called by idle CPUs with interrupts enabled; returns
+// 0 if there was nothing to do.
+int
+kzfill(void)
+{
+  char *p;
+
+  if(!kmem.use_lock || kzero.n >= NZERO)
+    return 0;
+  if((p = kalloc()) == 0)
+    return 0;
+  memset(p, 0, PGSIZE);
+  acquire(&kzero.lock);
+  if(kzero.n < NZERO){
+    ((struct run*)p)->next = kzero.list;
+    kzero.list = (struct run*)p;
+    kzero.n++;
+    p = 0;
+  }
+  release(&kzero.lock);
+  if(p)
+    kfree(p);
+  return 1;
+}
+
+// Return the number of free pages, for the page cache.
+// Not exact, since no lock is held.
+int
+kfreecount(void)
+{
+  int i, n;
+
+  n = kzero.n;
+  for(i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].nfree;
+  return n;
+}
+
+// Add a reference to the allocated page v, which will then
+// take one more kfree() to release.
+void
+kincref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kincref");
+  __sync_add_and_fetch(&pgref[V2P(v)/PGSIZE], 1);
+}
+
+// Return the number of references to the allocated page v.
+int
+krefcount(char *v)
+{
+  return pgref[V2P(v)/PGSIZE];
+}
@@ -0,0 +1,187 @@
+// Kernel allocator for objects smaller than a page.
+//
+// kmalloc(n) rounds n up to a power-of-two size class between
+// KMINSIZE and KMAXSIZE bytes.  Each class carves objects out of
+// slabs: pages from kalloc() that begin with a struct slab header
+// and hold objects of that one size.  kmfree() finds an object's
+// slab by rounding its address down to the page.
+//
+// Each CPU keeps a magazine of recently freed objects per class,
+// so that most kmalloc() and kmfree() calls take no lock at all.
+// A CPU whose magazine is empty refills half of it from the
+// class's slabs; one whose magazine is full flushes half back.
+// A slab whose objects are all free is returned to kalloc().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define KMINSIZE 16
+#define KMAXSIZE 2048
+#define NKCLASS  8      // 16, 32, ..., 2048
+#define MAGSIZE  16     // objects per per-CPU magazine
+
+struct kobj {
+  struct kobj *next;
+};
+
+// Header at the start of every slab page.
+struct slab {
+  struct slab *next;    // next on class's partial list
+  struct kobj *free;    // free objects in this slab
+  int nfree;
+  int cls;
+};
+
+struct kclass {
+  struct spinlock lock;
+  uint size;
+  int perslab;          // objects per slab
+  struct slab *partial; // slabs with at least one free object
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct {
+  struct kclass cls[NKCLASS];
+  struct magazine mag[NCPU][NKCLASS];
+} kmcache;
+
+void
+kmallocinit(void)
+{
+  int i;
+  struct kclass *c;
+
+  for(i = 0; i < NKCLASS; i++){
+    c = &kmcache.cls[i];
+    initlock(&c->lock, "kmalloc");
+    c->size = KMINSIZE << i;
+    c->perslab = (PGSIZE - sizeof(struct slab)) / c->size;
+  }
+}
+
+// Take one free object from class c's slabs,
+// allocating a new slab if necessary.
+// Caller must hold c->lock.
+static void*
+slaballoc(struct kclass *c)
+{
+  struct slab *s;
+  struct kobj *o;
+  char *p;
+  int i;
+
+  if((s = c->partial) == 0){
+    if((p = kalloc()) == 0)
+      return 0;
+    s = (struct slab*)p;
+    s->cls = c - kmcache.cls;
+    s->free = 0;
+    s->nfree = 0;
+    for(i = 0; i < c->perslab; i++){
+      o = (struct kobj*)(p + sizeof(struct slab) + i*c->size);
+      o->next = s->free;
+      s->free = o;
+      s->nfree++;
+    }
+    s->next = 0;
+    c->partial = s;
+  }
+  o = s->free;
+  s->free = o->next;
+  if(--s->nfree == 0)
+    c->partial = s->next;   // now full; s was at the head
+  return o;
+}
+
+// Return object v to its slab in class c, freeing
+// the slab if it becomes empty.
+// Caller must hold c->lock.
+static void
+slabfree(struct kclass *c, void *v)
+{
+  struct slab *s, **ss;
+  struct kobj *o;
+
+  s = (struct slab*)PGROUNDDOWN((uint)v);
+  o = (struct kobj*)v;
+  o->next = s->free;
+  s->free = o;
+  if(s->nfree++ == 0){
+    s->next = c->partial;
+    c->partial = s;
+  }
+  if(s->nfree == c->perslab){
+    for(ss = &c->partial; *ss; ss = &(*ss)->next){
+      if(*ss == s){
+        *ss = s->next;
+        break;
+      }
+    }
+    kfree((char*)s);
+  }
+}
+
+// Allocate n bytes of kernel memory.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmalloc(uint n)
+{
+  int i;
+  void *v;
+  struct kclass *c;
+  struct magazine *m;
+
+  if(n > KMAXSIZE)
+    panic("kmalloc: too big");
+  for(i = 0; (KMINSIZE << i) < n; i++)
+    ;
+  c = &kmcache.cls[i];
+
+  pushcli();
+  m = &kmcache.mag[cpuid()][i];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (v = slaballoc(c)) != 0)
+      m->obj[m->n++] = v;
+    release(&c->lock);
+  }
+  v = 0;
+  if(m->n > 0)
+    v = m->obj[--m->n];
+  popcli();
+  return v;
+}
+
+// Free memory v returned by kmalloc().
+void
+kmfree(void *v)
+{
+  int i;
+  struct slab *s;
+  struct kclass *c;
+  struct magazine *m;
+
+  s = (struct slab*)PGROUNDDOWN((uint)v);
+  if((uint)v % KMINSIZE || s->cls < 0 || s->cls >= NKCLASS)
+    panic("kmfree");
+  c = &kmcache.cls[s->cls];
+
+  pushcli();
+  m = &kmcache.mag[cpuid()][s->cls];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    for(i = 0; i < MAGSIZE/2; i++)
+      slabfree(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = v;
+  popcli();
+}
@@ -0,0 +1,165 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// Profile the kernel while a command runs, and print where the
+// timer samples landed, counted against the symbols in kernel.sym:
+//   kprof command [args...]
+// "self" counts samples in the function itself, "total" those
+// with it anywhere in the recorded call chain.
+
+#define NPROFPC 4   // as in the kernel's prof.c
+#define NTOP   20
+
+struct sym {
+  uint addr;
+  char *name;
+  int self;
+  int total;
+};
+
+struct sym *syms;
+int nsym;
+int user;
+int nsample;
+
+// Read kernel.sym, lines of "address name", sorted by address.
+void
+readsyms(void)
+{
+  struct stat st;
+  struct sym t;
+  char *buf, *p, *e;
+  int fd, j;
+
+  if((fd = open("kernel.sym", O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf(2, "kprof: cannot read kernel.sym\n");
+    exit();
+  }
+  buf = malloc(st.size + 1);
+  if(read(fd, buf, st.size) != st.size){
+    printf(2, "kprof: cannot read kernel.sym\n");
+    exit();
+  }
+  close(fd);
+  buf[st.size] = 0;
+  for(nsym = 1, p = buf; *p; p++)
+    if(*p == '\n')
+      nsym++;
+  syms = malloc(nsym * sizeof(syms[0]));
+  memset(syms, 0, nsym * sizeof(syms[0]));
+
+  nsym = 0;
+  for(p = buf; *p; p = e){
+    for(e = p; *e && *e != '\n'; e++)
+      ;
+    if(*e)
+      *e++ = 0;
+    t.addr = 0;
+    for(; *p && *p != ' '; p++)
+      t.addr = t.addr*16 + (*p >= 'a' ? *p - 'a' + 10 : *p - '0');
+    if(*p != ' ' || t.addr < 0x80000000)
+      continue;
+    t.name = p + 1;
+    // Insertion sort: kernel.sym is mostly in order already.
+    for(j = nsym++; j > 0 && syms[j-1].addr > t.addr; j--)
+      syms[j] = syms[j-1];
+    syms[j].addr = t.addr;
+    syms[j].name = t.name;
+  }
+}
+
+// The symbol containing pc: the last one at or below it.
+struct sym*
+lookup(uint pc)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = nsym;
+  while(hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if(syms[mid].addr <= pc)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if(nsym == 0 || syms[lo].addr > pc)
+    return 0;
+  return &syms[lo];
+}
+
+void
+count(uint *pc)
+{
+  struct sym *s, *seen[NPROFPC];
+  int i, j;
+
+  nsample++;
+  if(pc[0] < 0x80000000){
+    user++;
+    return;
+  }
+  for(i = 0; i < NPROFPC && pc[i]; i++){
+    if((seen[i] = s = lookup(pc[i])) == 0)
+      continue;
+    for(j = 0; j < i; j++)
+      if(seen[j] == s)
+        break;
+    if(j == i)
+      s->total++;
+    if(i == 0)
+      s->self++;
+  }
+}
+
+void
+report(void)
+{
+  struct sym *best;
+  int i, n;
+
+  printf(1, "%d samples, %d in user space\n", nsample, user);
+  printf(1, "  self total function\n");
+  for(n = 0; n < NTOP; n++){
+    best = 0;
+    for(i = 0; i < nsym; i++)
+      if(syms[i].total > 0 && (best == 0 || syms[i].self > best->self ||
+         (syms[i].self == best->self && syms[i].total > best->total)))
+        best = &syms[i];
+    if(best == 0)
+      break;
+    printf(1, "%d %d %s\n", best->self, best->total, best->name);
+    best->total = 0;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint buf[64*NPROFPC];
+  int fd, n, i;
+
+  if(argc < 2){
+    printf(2, "usage: kprof command [args...]\n");
+    exit();
+  }
+  readsyms();
+  if((fd = open("prof", O_RDWR)) < 0){
+    printf(2, "kprof: cannot open prof\n");
+    exit();
+  }
+  write(fd, "1", 1);
+  if(spawn(argv[1], argv + 1, 0) < 0)
+    printf(2, "kprof: exec %s failed\n", argv[1]);
+  else
+    wait();
+  write(fd, "0", 1);
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    for(i = 0; i < n / sizeof(uint); i += NPROFPC)
+      count(&buf[i]);
+  close(fd);
+  report();
+  exit();
+}
@@ -9,6 +9,8 @@
 #include "traps.h"
 #include "mmu.h"
 #include "x86.h"
+#include "proc.h"
+#include "timepage.h"
 
 // Local APIC registers, divided by 4 for use as uint[] indices.
 #define ID      (0x0020/4)   // ID
@@ -26,6 +28,7 @@
   #define DEASSERT   0x00000000
   #define LEVEL      0x00008000   // Level triggered
   #define BCAST      0x00080000   // Send to all APICs, including self.
+  #define ALLBUT     0x000C0000   // Send to all APICs, excluding self.
   #define BUSY       0x00001000
   #define FIXED      0x00000000
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
@@ -43,6 +46,18 @@
 
 volatile uint *lapic;  // Initialized in mp.c
 
+// Clock calibration, done once by the boot CPU.
+static uint64 tscbase;     // rdtsc() at calibration; nsec() counts from here
+static uint tscmult;       // nanoseconds per TSC cycle, times 2^24
+static uint tscperus;      // TSC cycles per microsecond
+static uint lapicperus;    // lapic timer counts per microsecond
+
+static void calibrate(void);
+
+// The clock page, which kmap in vm.c lets user code read at
+// TIMEPAGE.  It is written only here, after calibrating.
+char timepage[PGSIZE] __attribute__((aligned(PGSIZE)));
+
 //PAGEBREAK!
 static void
 lapicw(int index, int value)
@@ -60,13 +75,15 @@ lapicinit(void)
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // The timer counts down once at bus frequency from
+  // lapic[TICR] and then issues an interrupt; lapiconeshot()
+  // loads TICR for each deadline.  Both the timer and the TSC
+  // are calibrated against the PIT the first time through.
+  if(tscmult == 0)
+    calibrate();
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, 0);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -114,19 +131,208 @@ lapiceoi(void)
 }
 
 // Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
 void
 microdelay(int us)
 {
+  uint64 t;
+
+  t = rdtsc() + (uint64)us * tscperus;
+  while(rdtsc() < t)
+    pause();
+}
+
+// n / d, without libgcc's 64-bit division.
+uint64
+udiv64(uint64 n, uint d)
+{
+  uint64 q, r;
+  int i;
+
+  q = r = 0;
+  for(i = 63; i >= 0; i--){
+    r = (r << 1) | ((n >> i) & 1);
+    if(r >= d){
+      r -= d;
+      q |= (uint64)1 << i;
+    }
+  }
+  return q;
+}
+
+#define PIT_HZ   1193182   // PIT input clock
+#define CALMS    10        // calibration interval in milliseconds
+
+// Measure the TSC and the lapic timer against CALMS ms
+// counted by PIT channel 2, whose gate is bit 0 of port 0x61
+// and whose output shows up in bit 5.
+static void
+calibrate(void)
+{
+  struct timepage *tp;
+  uint64 t0, t1;
+  uint cnt, left, v;
+
+  lapicw(TDCR, X1);
+  lapicw(TIMER, MASKED | (T_IRQ0 + IRQ_TIMER));
+
+  v = inb(0x61) & ~0x03;   // gate off, speaker off
+  outb(0x61, v);
+  outb(0x43, 0xB0);        // channel 2, lo/hi byte, mode 0
+  cnt = PIT_HZ / (1000/CALMS);
+  outb(0x42, cnt);
+  outb(0x42, cnt >> 8);
+
+  lapicw(TICR, 0xFFFFFFFF);
+  t0 = rdtsc();
+  outb(0x61, v | 0x01);    // gate on: start counting
+  while((inb(0x61) & 0x20) == 0)
+    ;
+  t1 = rdtsc();
+  left = lapic[TCCR];
+  lapicw(TICR, 0);
+
+  tscbase = t0;
+  tscmult = udiv64((uint64)(CALMS*1000000) << 24, (uint)(t1 - t0));
+  tscperus = (uint)(t1 - t0) / (CALMS*1000);
+  lapicperus = (0xFFFFFFFF - left) / (CALMS*1000);
+  if(lapicperus == 0)
+    lapicperus = 1;
+
+  tp = (struct timepage*)timepage;
+  tp->seq++;
+  __sync_synchronize();
+  tp->tscbase = tscbase;
+  tp->tscmult = tscmult;
+  __sync_synchronize();
+  tp->seq++;
+}
+
+// TSC synchronization.  nsec(), the per-CPU timer deadlines
+// and user clockns() all assume that every CPU's TSC reads the
+// same, but firmware need not start them together.  So as each
+// AP comes up, the boot CPU measures its skew: it reads its TSC,
+// has the AP read its own, and reads its TSC again, NSYNC times;
+// the round trip with the least delay gives the best estimate.
+// An AP whose skew is more than that round trip sets its TSC
+// to match.
+#define NSYNC 16
+
+static struct {
+  volatile int cpu;      // the AP being measured, cpus index
+  volatile int go;       // round the boot CPU has started
+  volatile int ack;      // round the AP has answered
+  volatile uint64 tsc;   // the AP's TSC in that round
+  volatile int done;     // cpu+1 once off is set
+  volatile int fixed;    // cpu+1 once the AP has applied it
+  volatile long long off;  // the AP's TSC minus the boot CPU's
+} tsync = { -1 };
+
+// Measure the skew of each AP, which must call tscsync().
+// Called by the boot CPU once it has started them.
+void
+tscsyncall(void)
+{
+  struct cpu *c;
+  uint64 t0, t1, best;
+  long long off;
+  int i;
+
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c == mycpu())
+      continue;
+    tsync.go = tsync.ack = 0;
+    __sync_synchronize();
+    tsync.cpu = c - cpus;
+    best = ~0ULL;
+    off = 0;
+    for(i = 1; i <= NSYNC; i++){
+      t0 = rdtsc();
+      tsync.go = i;
+      while(tsync.ack != i)
+        ;
+      t1 = rdtsc();
+      if(t1 - t0 < best){
+        best = t1 - t0;
+        off = (long long)(tsync.tsc - (t0 + best/2));
+      }
+    }
+    if(off <= (long long)best && -off <= (long long)best)
+      off = 0;
+    tsync.off = off;
+    __sync_synchronize();
+    tsync.done = c - cpus + 1;
+    while(tsync.fixed != c - cpus + 1)
+      pause();
+  }
+}
+
+// This AP's half of tscsyncall().
+void
+tscsync(void)
+{
+  int me, i;
+
+  me = cpuid();
+  while(tsync.cpu != me)
+    pause();
+  for(i = 1; i <= NSYNC; i++){
+    while(tsync.go != i)
+      ;
+    tsync.tsc = rdtsc();
+    __sync_synchronize();
+    tsync.ack = i;
+  }
+  while(tsync.done != me + 1)
+    pause();
+  if(tsync.off != 0)
+    wrmsr(MSR_TSC, rdtsc() - tsync.off);
+  tsync.fixed = me + 1;
+}
+
+// Nanoseconds since the clock was calibrated at boot.
+uint64
+nsec(void)
+{
+  uint64 d;
+
+  d = rdtsc() - tscbase;
+  return (((d >> 32) * tscmult) << 8) + (((d & 0xFFFFFFFF) * tscmult) >> 24);
+}
+
+// Make this CPU's timer interrupt at nsec() == when,
+// or not at all if when is 0.  Deadlines more than a
+// second away are cut to a second, after which the
+// interrupt handler re-arms.
+void
+lapiconeshot(uint64 when)
+{
+  uint64 now;
+  uint us;
+
+  if(!lapic)
+    return;
+  if(when == 0){
+    lapicw(TICR, 0);
+    return;
+  }
+  now = nsec();
+  if(when <= now)
+    us = 1;
+  else if(when - now >= 1000000000)
+    us = 1000000;
+  else
+    us = (uint)(when - now) / 1000 + 1;
+  lapicw(TICR, us * lapicperus);
 }
 
 #define CMOS_PORT    0x70
 #define CMOS_RETURN  0x71
 
-// Start additional processor running entry code at addr.
+// Start all the other processors running entry code at addr,
+// at once, by broadcasting the startup sequence.
 // See Appendix B of MultiProcessor Specification.
 void
-lapicstartap(uchar apicid, uint addr)
+lapicstartall(uint addr)
 {
   int i;
   ushort *wrv;
@@ -141,11 +347,11 @@ lapicstartap(uchar apicid, uint addr)
   wrv[1] = addr >> 4;
 
   // "Universal startup algorithm."
-  // Send INIT (level-triggered) interrupt to reset other CPU.
-  lapicw(ICRHI, apicid<<24);
-  lapicw(ICRLO, INIT | LEVEL | ASSERT);
+  // Send INIT (level-triggered) interrupt to reset other CPUs.
+  lapicw(ICRHI, 0);
+  lapicw(ICRLO, ALLBUT | INIT | LEVEL | ASSERT);
   microdelay(200);
-  lapicw(ICRLO, INIT | LEVEL);
+  lapicw(ICRLO, ALLBUT | INIT | LEVEL);
   microdelay(100);    // should be 10ms, but too slow in Bochs!
 
   // Send startup IPI (twice!) to enter code.
@@ -154,12 +360,26 @@ lapicstartap(uchar apicid, uint addr)
   // should be ignored, but it is part of the official Intel algorithm.
   // Bochs complains about the second one.  Too bad for Bochs.
   for(i = 0; i < 2; i++){
-    lapicw(ICRHI, apicid<<24);
-    lapicw(ICRLO, STARTUP | (addr>>12));
+    lapicw(ICRHI, 0);
+    lapicw(ICRLO, ALLBUT | STARTUP | (addr>>12));
     microdelay(200);
   }
 }
 
+// Send interrupt vector to the CPU with the given APIC ID.
+void
+lapicipi(uchar apicid, int vector)
+{
+  if(!lapic)
+    return;
+  pushcli();  // keep ICRHI and ICRLO together
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+  popcli();
+}
+
 #define CMOS_STATA   0x0a
 #define CMOS_STATB   0x0b
 #define CMOS_UIP    (1 << 7)        // RTC update in progress
@@ -5,6 +5,9 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "trace.h"
+#include "mmu.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -20,6 +23,13 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// The log is double-buffered.  A commit first copies the
+// transaction's blocks into the log area's buffers, which
+// takes no disk I/O, and then lets new FS system calls start
+// a second in-memory transaction while it writes the first
+// one to disk.  The second transaction commits once the
+// first is installed.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -27,177 +37,588 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The header also holds a checksum of the logged blocks and
+// one of itself.  A commit writes the blocks and the header
+// together, without waiting for the blocks before starting
+// the header; recovery replays a transaction only if both
+// checksums match, so one that was cut off by a crash is
+// ignored.  The commit is complete when all the writes are.
+// The header is cleared, synchronously, after installing,
+// since in ordered mode a logged block may be reused for file
+// data that must not be overwritten by a later replay.
+//
+// A file system made with mkfs -o uses ordered journaling: the
+// log holds only metadata (inode, bitmap, directory and indirect
+// blocks), and writers put file data blocks straight home before
+// the transaction that points at them commits; see log_data().
+// A crash can then lose recently written data but never leaves a
+// committed inode pointing at a block that was not written.  It
+// can, though, leave a file holding another file's data: a block
+// freed by a transaction that has not committed yet may be
+// reused and written home first.  So fs.img is fully journaled.
+//
+// The size of the log area is chosen by mkfs and read from
+// the superblock; a transaction can use all of it, up to the
+// number of block numbers that fit in the header block.
+
+#define LOGMAXBLOCKS ((BSIZE - 4*sizeof(int)) / sizeof(int))
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;        // commit() number, as of boot
+  uint sum;        // logsum() of the n log blocks, in order
+  uint hsum;       // logsum() of the fields above and block[0..n)
+  int block[LOGMAXBLOCKS];
 };
 
+#define LOGSUM0 2166136261U
+
+// FNV-1a, a word at a time, of n words at data, from h.
+static uint
+logsum(uint h, void *data, int n)
+{
+  uint *w;
+
+  for (w = data; n > 0; n--, w++)
+    h = (h ^ *w) * 16777619;
+  return h;
+}
+
+// The checksum of header lh.
+static uint
+headsum(struct logheader *lh)
+{
+  return logsum(logsum(LOGSUM0, lh, 3), lh->block, lh->n);
+}
+
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the log area, including the header
+  int cap;         // max blocks in one transaction
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks reserved by the outstanding calls
+  int seq;         // transactions commit() has taken
+  int ndone;       // transactions on disk
+  int copying;     // commit() is copying lh; begin_op must wait.
   int committing;  // in commit(), please wait.
   int dev;
-  struct logheader lh;
+  int ordered;     // SB_ORDERED: file data skips the log
+  struct logheader lh;   // transaction accepting new updates
+  struct logheader clh;  // transaction being committed
+  struct buf shadow[NBATCH];  // for writing committed blocks home
 };
-struct log log;
 
-static void recover_from_log(void);
-static void commit();
+// One log per mounted device.  logs.n only grows, and
+// logs.log[i] is not touched again once set up.
+struct {
+  struct spinlock lock;
+  int n;
+  struct log log[NMOUNT];
+} logs;
 
+static void recover_from_log(struct log*);
+static void commit(struct log*);
+static void logend(struct log*, int);
+
+// The log of device dev.
+static struct log*
+logof(uint dev)
+{
+  int i;
+
+  for(i = 0; i < logs.n; i++)
+    if(logs.log[i].dev == dev)
+      return &logs.log[i];
+  panic("no log");
+}
+
+// Set up the log of a newly mounted device, recovering any
+// committed transaction.  FS calls that begin after this
+// returns reserve space in it.
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   struct superblock sb;
-  initlock(&log.lock, "log");
+  struct log *log;
+  int i;
+
+  if (logs.n == 0)
+    initlock(&logs.lock, "logs");
+  acquire(&logs.lock);
+  if (logs.n == NMOUNT)
+    panic("initlog: too many logs");
+  log = &logs.log[logs.n];
+  release(&logs.lock);
+
+  initlock(&log->lock, "log");
+  for (i = 0; i < NBATCH; i++)
+    initsleeplock(&log->shadow[i].lock, "log shadow");
   readsb(dev, &sb);
-  log.start = sb.logstart;
-  log.size = sb.nlog;
-  log.dev = dev;
-  recover_from_log();
+  log->start = sb.logstart;
+  log->size = sb.nlog;
+  log->cap = log->size - 1;
+  if(log->cap > LOGMAXBLOCKS)
+    log->cap = LOGMAXBLOCKS;
+  if(log->cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log->dev = dev;
+  log->ordered = (sb.flags & SB_ORDERED) != 0;
+  recover_from_log(log);
+
+  acquire(&logs.lock);
+  logs.n++;
+  release(&logs.lock);
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(void)
+// Do the log blocks match the checksum in log->clh?
+// Used only by recovery.
+static int
+check_trans(struct log *log)
 {
-  int tail;
+  int tail, i, n;
+  struct buf *lbuf[NBATCH];
+  uint sum;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  sum = LOGSUM0;
+  for (tail = 0; tail < log->clh.n; tail += n) {
+    n = log->clh.n - tail;
+    if (n > NBATCH)
+      n = NBATCH;
+    for (i = 0; i < n; i++)
+      lbuf[i] = bread_async(log->dev, log->start+tail+i+1);
+    for (i = 0; i < n; i++) {
+      bwait(lbuf[i]);
+      sum = logsum(sum, lbuf[i]->data, BSIZE/sizeof(uint));
+      brelse(lbuf[i]);
+    }
   }
+  return sum == log->clh.sum;
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy committed blocks from log to their home location.
+// Used only by recovery, when nothing else is running.
 static void
-read_head(void)
+install_trans(struct log *log)
+{
+  int tail, i, n;
+  struct buf *lbuf[NBATCH], *dbuf[NBATCH];
+
+  for (tail = 0; tail < log->clh.n; tail += n) {
+    n = log->clh.n - tail;
+    if (n > NBATCH)
+      n = NBATCH;
+    for (i = 0; i < n; i++)
+      lbuf[i] = bread_async(log->dev, log->start+tail+i+1); // read log block
+    for (i = 0; i < n; i++) {
+      bwait(lbuf[i]);
+      dbuf[i] = bgetblk(log->dev, log->clh.block[tail+i]); // dst
+      memmove(dbuf[i]->data, lbuf[i]->data, BSIZE);  // copy block to dst
+      dbuf[i]->flags |= B_DIRTY;
+      brelse(lbuf[i]);
+    }
+    bsubmit(dbuf, n);  // write dsts to disk
+    for (i = 0; i < n; i++) {
+      bwait(dbuf[i]);
+      brelse(dbuf[i]);
+    }
+  }
+}
+
+// Read the log header from disk into the in-memory log header.
+// Returns 0 if it is not intact, or holds no transaction.
+static int
+read_head(struct log *log)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(log->dev, log->start);
   struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  int i, ok;
+  ok = lh->n > 0 && lh->n <= log->cap && lh->hsum == headsum(lh);
+  log->clh.n = ok ? lh->n : 0;
+  log->clh.seq = lh->seq;
+  log->clh.sum = lh->sum;
+  for (i = 0; i < log->clh.n; i++) {
+    log->clh.block[i] = lh->block[i];
   }
   brelse(buf);
+  return ok;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Return the header buf, locked, holding the committing log
+// header and ready to be written.
+static struct buf*
+head_buf(struct log *log)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(log->dev, log->start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log->clh.n;
+  hb->seq = log->clh.seq;
+  hb->sum = log->clh.sum;
+  for (i = 0; i < log->clh.n; i++) {
+    hb->block[i] = log->clh.block[i];
   }
+  hb->hsum = headsum(hb);
+  buf->flags |= B_DIRTY;
+  return buf;
+}
+
+// Write the committing log header to disk, and wait.
+static void
+write_head(struct log *log)
+{
+  struct buf *buf = head_buf(log);
   bwrite(buf);
   brelse(buf);
 }
 
 static void
-recover_from_log(void)
+recover_from_log(struct log *log)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  if (read_head(log) && check_trans(log))
+    install_trans(log); // if committed, copy from log to disk
+  log->clh.n = 0;
+  write_head(log); // clear the log
 }
 
-// called at the start of each FS system call.
-void
-begin_op(void)
+// Reserve n blocks in log for an FS system call.
+static void
+logbegin(struct log *log, int n)
 {
-  acquire(&log.lock);
+  if(n > log->cap)
+    panic("begin_op: too big");
+  acquire(&log->lock);
   while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    if(log->copying){
+      sleep(log, &log->lock);
+    } else if(log->lh.n + log->reserved + n > log->cap){
       // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+      sleep(log, &log->lock);
     } else {
-      log.outstanding += 1;
-      release(&log.lock);
+      log->outstanding += 1;
+      log->reserved += n;
+      release(&log->lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call that
+// writes at most n blocks to any one device.  It reserves
+// space in every log, in order, since the call does not yet
+// know which devices it will touch, and records in
+// p->oplogs which ones it reserved.
 void
-end_op(void)
+begin_opn(int n)
+{
+  struct proc *p;
+  int i;
+
+  p = myproc();
+  if(p->oplogs)
+    panic("begin_op: nested");
+  for(i = 0; i < logs.n; i++){
+    logbegin(&logs.log[i], n);
+    p->oplogs |= 1 << i;
+  }
+}
+
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// Did the FS system call in progress reserve space in dev's
+// log?  Not if dev was mounted after the call began.
+int
+log_reserved(uint dev)
+{
+  int i;
+
+  for(i = 0; i < logs.n; i++)
+    if(logs.log[i].dev == dev)
+      return (myproc()->oplogs >> i) & 1;
+  return 0;
+}
+
+// The most blocks one begin_opn() may reserve while
+// leaving room for other FS system calls.
+int
+log_opmax(void)
+{
+  int i, m;
+
+  m = LOGMAXBLOCKS;
+  for(i = 0; i < logs.n; i++)
+    if(logs.log[i].cap < m)
+      m = logs.log[i].cap;
+  return m / 2;
+}
+
+// called at the end of each FS system call, with the
+// n that was passed to begin_opn().
+void
+end_opn(int n)
+{
+  struct proc *p;
+  int i;
+
+  p = myproc();
+  for(i = 0; i < NMOUNT; i++)
+    if(p->oplogs & (1 << i))
+      logend(&logs.log[i], n);
+  p->oplogs = 0;
+}
+
+// Release an FS system call's n blocks in log.
+// commits if this was the last outstanding operation
+// and no other commit is in progress.
+static void
+logend(struct log *log, int n)
 {
   int do_commit = 0;
 
-  acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  acquire(&log->lock);
+  log->outstanding -= 1;
+  log->reserved -= n;
+  if(log->copying)
+    panic("log.copying");
+  if(log->outstanding == 0 && !log->committing){
     do_commit = 1;
-    log.committing = 1;
+    log->committing = 1;
+    log->copying = 1;
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
+    // and decrementing log->outstanding has decreased
     // the amount of reserved space.
-    wakeup(&log);
+    wakeup(log);
   }
-  release(&log.lock);
+  release(&log->lock);
 
-  if(do_commit){
+  while(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+    commit(log);
+    acquire(&log->lock);
+    // Commit the transaction that filled up meanwhile,
+    // unless FS calls are still adding to it.
+    if(log->lh.n == 0 || log->outstanding > 0){
+      log->committing = 0;
+      do_commit = 0;
+    } else
+      log->copying = 1;
+    wakeup(log);
+    release(&log->lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Copy modified blocks from cache to the log area's buffers,
+// and pin those with B_DIRTY until write_log() writes them.
+// Checksum them for the header on the way.
 static void
-write_log(void)
+copy_log(struct log *log)
 {
   int tail;
+  uint sum;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  sum = LOGSUM0;
+  for (tail = 0; tail < log->clh.n; tail++) {
+    struct buf *to = bgetblk(log->dev, log->start+tail+1); // log block
+    struct buf *from = bread(log->dev, log->clh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    sum = logsum(sum, to->data, BSIZE/sizeof(uint));
+    to->flags |= B_DIRTY;
     brelse(from);
     brelse(to);
   }
+  log->clh.sum = sum;
+}
+
+// Write the copied blocks and then the header to the log,
+// NBATCH at a time, the header in the last batch.  This is
+// the true point at which the current transaction commits.
+static void
+write_log(struct log *log)
+{
+  int tail, i, n;
+  struct buf *to[NBATCH];
+
+  for (tail = 0; tail <= log->clh.n; tail += n) {
+    n = log->clh.n + 1 - tail;
+    if (n > NBATCH)
+      n = NBATCH;
+    for (i = 0; i < n; i++) {
+      if (tail+i < log->clh.n)
+        to[i] = bread(log->dev, log->start+tail+i+1); // log block, B_DIRTY
+      else
+        to[i] = head_buf(log);
+    }
+    bsubmit(to, n);  // write the log
+    for (i = 0; i < n; i++) {
+      bwait(to[i]);
+      brelse(to[i]);
+    }
+  }
+}
+
+// Is block b in the transaction accepting new updates?
+// Caller must hold log->lock.
+static int
+in_next_trans(struct log *log, uint b)
+{
+  int i;
+
+  for (i = 0; i < log->lh.n; i++)
+    if (log->lh.block[i] == b)
+      return 1;
+  return 0;
+}
+
+// Write the committed blocks to their home locations, in
+// block order and NBATCH at a time, so that the disk driver
+// can merge runs of them into single commands.
+//
+// Usually the cached home buf still holds the committed data
+// and is written straight from the cache; the write clears its
+// B_DIRTY pin.  If the next transaction has logged the block
+// since, or someone holds its buf, the copy in the log buffer
+// goes to disk through a private shadow buf instead, and the
+// home buf is unpinned afterwards unless the next transaction
+// has logged it.  Waiting for a home buf while holding others
+// could deadlock with an FS call holding two bufs.
+static void
+install_copies(struct log *log)
+{
+  int tail, i, j, k, n, t;
+  int order[LOGMAXBLOCKS];
+  char shadowed[LOGMAXBLOCKS];
+  struct buf *lbuf, *b, *bs[NBATCH];
+
+  // Sort the log slots by home block number.
+  for (i = 0; i < log->clh.n; i++) {
+    t = i;
+    for (j = i; j > 0 && log->clh.block[order[j-1]] > log->clh.block[t]; j--)
+      order[j] = order[j-1];
+    order[j] = t;
+  }
+
+  for (tail = 0; tail < log->clh.n; tail += n) {
+    n = log->clh.n - tail;
+    if (n > NBATCH)
+      n = NBATCH;
+    k = 0;
+    for (i = 0; i < n; i++) {
+      t = order[tail+i];
+      shadowed[t] = 0;
+      if ((b = btryget(log->dev, log->clh.block[t])) != 0) {
+        acquire(&log->lock);
+        j = in_next_trans(log, b->blockno);
+        release(&log->lock);
+        if (!j && (b->flags & B_DIRTY)) {
+          bs[i] = b;
+          continue;
+        }
+        brelse(b);
+      }
+      shadowed[t] = 1;
+      b = &log->shadow[k++];
+      acquiresleep(&b->lock);
+      lbuf = bread(log->dev, log->start+t+1);
+      b->dev = log->dev;
+      b->blockno = log->clh.block[t];
+      memmove(b->data, lbuf->data, BSIZE);
+      brelse(lbuf);
+      b->flags = B_DIRTY;
+      bs[i] = b;
+    }
+    bsubmit(bs, n);
+    for (i = 0; i < n; i++) {
+      bwait(bs[i]);
+      if (bs[i] >= log->shadow && bs[i] < log->shadow+NBATCH)
+        releasesleep(&bs[i]->lock);
+      else
+        brelse(bs[i]);
+    }
+  }
+
+  for (t = 0; t < log->clh.n; t++) {
+    if (!shadowed[t])
+      continue;
+    b = bread(log->dev, log->clh.block[t]);
+    acquire(&log->lock);
+    if (!in_next_trans(log, b->blockno))
+      b->flags &= ~B_DIRTY;
+    release(&log->lock);
+    brelse(b);
+  }
 }
 
+// Called with log->copying set and no FS calls outstanding.
 static void
-commit()
+commit(struct log *log)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int seq;
+
+  trace(TR_COMMIT, log->dev, 0, 0);
+  acquire(&log->lock);
+  log->clh = log->lh;
+  log->lh.n = 0;
+  seq = ++log->seq;
+  log->clh.seq = seq;
+  release(&log->lock);
+
+  if (log->clh.n > 0)
+    copy_log(log);      // Snapshot modified blocks into log buffers
+
+  // New FS system calls may now start the next transaction.
+  acquire(&log->lock);
+  log->copying = 0;
+  wakeup(log);
+  release(&log->lock);
+
+  if (log->clh.n > 0)
+    write_log(log);      // Write the snapshot and header -- the real commit
+  acquire(&log->lock);
+  log->ndone = seq;
+  wakeup(log);
+  release(&log->lock);
+
+  if (log->clh.n > 0) {
+    install_copies(log); // Now install writes to home locations
+    log->clh.n = 0;
+    write_head(log);     // Erase the transaction from the log
+  }
+  trace(TR_COMMITDONE, log->dev, 0, 0);
+}
+
+// Wait until every FS system call that has finished is on disk.
+void
+log_sync(void)
+{
+  struct log *log;
+  int i, seq;
+
+  for (i = 0; i < logs.n; i++) {
+    log = &logs.log[i];
+    acquire(&log->lock);
+    seq = log->seq + (log->lh.n > 0);
+    while (log->ndone < seq)
+      sleep(log, &log->lock);
+    release(&log->lock);
   }
 }
 
@@ -213,22 +634,54 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct log *log;
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
-  if (log.outstanding < 1)
+  log = logof(b->dev);
+  if ((myproc()->oplogs & (1 << (log - logs.log))) == 0)
     panic("log_write outside of trans");
+  acquire(&log->lock);
+  if (log->lh.n >= log->cap)
+    panic("too big a transaction");
 
-  acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  for (i = 0; i < log->lh.n; i++) {
+    if (log->lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
+  log->lh.block[i] = b->blockno;
+  if (i == log->lh.n)
+    log->lh.n++;
   b->flags |= B_DIRTY; // prevent eviction
-  release(&log.lock);
+  release(&log->lock);
 }
 
+// Caller has modified file data block b.  In an ordered-mode
+// file system, returns 1, and the caller must write b home
+// before its transaction ends.  Otherwise, or if b is part of a
+// transaction that has not been installed yet (it was metadata
+// until recently), logs b and returns 0.
+int
+log_data(struct buf *b)
+{
+  struct log *log;
+  int i, inlog;
+
+  log = logof(b->dev);
+  if (!log->ordered) {
+    log_write(b);
+    return 0;
+  }
+  acquire(&log->lock);
+  inlog = in_next_trans(log, b->blockno);
+  for (i = 0; i < log->clh.n && !inlog; i++)
+    if (log->clh.block[i] == b->blockno)
+      inlog = 1;
+  release(&log->lock);
+  if (inlog) {
+    // Writing b home now could be undone by installing
+    // the older transaction; log it after that one.
+    log_write(b);
+    return 0;
+  }
+  return 1;
+}
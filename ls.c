@@ -26,8 +26,8 @@ void
 ls(char *path)
 {
   char buf[512], *p;
-  int fd;
-  struct dirent de;
+  int fd, i, n;
+  struct dirent de[32];
   struct stat st;
 
   if((fd = open(path, 0)) < 0){
@@ -54,16 +54,18 @@ ls(char *path)
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf(1, "ls: cannot stat %s\n", buf);
-        continue;
+    // A batch of entries per getdents, then a stat of each
+    // by name within the directory, with no path walk.
+    while((n = getdents(fd, de, sizeof(de))) > 0){
+      for(i = 0; i < n/sizeof(de[0]); i++){
+        memmove(p, de[i].name, DIRSIZ);
+        p[DIRSIZ] = 0;
+        if(fstatat(fd, p, &st) < 0){
+          printf(1, "ls: cannot stat %s\n", buf);
+          continue;
+        }
+        printf(1, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
       }
-      printf(1, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
     }
     break;
   }
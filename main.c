@@ -18,6 +18,7 @@ int
 main(void)
 {
   kinit1(end, P2V(4*1024*1024)); // phys page allocator
+  kmallocinit();   // small object allocator
   kvmalloc();      // kernel page table
   mpinit();        // detect other processors
   lapicinit();     // interrupt controller
@@ -26,13 +27,19 @@ main(void)
   ioapicinit();    // another interrupt controller
   consoleinit();   // console hardware
   uartinit();      // serial port
+  profinit();      // sampling profiler
+  traceinit();     // event tracing
   pinit();         // process table
   tvinit();        // trap vectors
+  timerinit();     // timer deadlines
   binit();         // buffer cache
   fileinit();      // file table
+  shminit();       // shared memory segments
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  ramdiskinit();   // RAM disk
+  swapinit();      // swap area
   userinit();      // first user process
   mpmain();        // finish this processor's setup
 }
@@ -44,6 +51,8 @@ mpenter(void)
   switchkvm();
   seginit();
   lapicinit();
+  tscsync();
+  kinit2ap();
   mpmain();
 }
 
@@ -53,20 +62,26 @@ mpmain(void)
 {
   cprintf("cpu%d: starting %d\n", cpuid(), cpuid());
   idtinit();       // load idt register
-  xchg(&(mycpu()->started), 1); // tell startothers() we're up
+  xchg(&(mycpu()->started), 1); // we're up
+  ioapicspread();  // take a share of the device interrupts
   scheduler();     // start running processes
 }
 
 pde_t entrypgdir[];  // For entry.S
 
-// Start the non-boot (AP) processors.
+// Start the non-boot (AP) processors, all at once.
+// They do not wait for each other or for the boot CPU
+// until kinit2(), where they share in freeing memory.
 static void
 startothers(void)
 {
   extern uchar _binary_entryother_start[], _binary_entryother_size[];
   uchar *code;
   struct cpu *c;
-  char *stack;
+  char **stacks;
+
+  if(ncpu == 1)
+    return;
 
   // Write entry code to unused memory at 0x7000.
   // The linker has placed the image of entryother.S in
@@ -74,24 +89,23 @@ startothers(void)
   code = P2V(0x7000);
   memmove(code, _binary_entryother_start, (uint)_binary_entryother_size);
 
+  // Tell entryother.S where the lapic is, where to enter, what
+  // pgdir to use, and what stack each CPU should use, by APIC ID.
+  // We cannot use kpgdir yet, because the AP processor is running
+  // in low memory, so we use entrypgdir for the APs too.
+  *(uint*)(code-4) = (uint)lapic;
+  *(void(**)(void))(code-8) = mpenter;
+  *(int**)(code-12) = (void *) V2P(entrypgdir);
+  stacks = (char**)(code-12) - 256;
+  memset(stacks, 0, 256*sizeof(stacks[0]));
   for(c = cpus; c < cpus+ncpu; c++){
     if(c == mycpu())  // We've started already.
       continue;
-
-    // Tell entryother.S what stack to use, where to enter, and what
-    // pgdir to use. We cannot use kpgdir yet, because the AP processor
-    // is running in low  memory, so we use entrypgdir for the APs too.
-    stack = kalloc();
-    *(void**)(code-4) = stack + KSTACKSIZE;
-    *(void(**)(void))(code-8) = mpenter;
-    *(int**)(code-12) = (void *) V2P(entrypgdir);
-
-    lapicstartap(c->apicid, V2P(code));
-
-    // wait for cpu to finish mpmain()
-    while(c->started == 0)
-      ;
+    stacks[c->apicid] = kalloc() + KSTACKSIZE;
   }
+
+  lapicstartall(V2P(code));
+  tscsyncall();    // make their TSCs agree with ours
 }
 
 // The boot page table used in entry.S and entryother.S.
@@ -0,0 +1,43 @@
+// Time malloc and free of small and large blocks.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define N 500      // blocks live at once
+#define ROUNDS 200
+
+void *blk[N];
+
+void
+bench(char *what, uint lo, uint hi)
+{
+  int r, i, t;
+  uint n;
+
+  n = lo;
+  t = uptime();
+  for(r = 0; r < ROUNDS; r++){
+    for(i = 0; i < N; i++){
+      if((blk[i] = malloc(n)) == 0){
+        printf(2, "mallocbench: out of memory\n");
+        exit();
+      }
+      *(char*)blk[i] = i;
+      if(++n > hi)
+        n = lo;
+    }
+    for(i = 0; i < N; i++)
+      free(blk[i]);
+  }
+  printf(1, "%s: %d mallocs in %d ticks\n", what, N*ROUNDS, uptime() - t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  bench("small", 1, 200);
+  bench("medium", 200, 1000);
+  bench("large", 1100, 4000);
+  exit();
+}
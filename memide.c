@@ -23,6 +23,8 @@ ideinit(void)
 {
   memdisk = _binary_fs_img_start;
   disksize = (uint)_binary_fs_img_size/BSIZE;
+  bdevsw[ROOTDEV].submit = idesubmit;
+  bdevsw[ROOTDEV].wait = idewaitbuf;
 }
 
 // Interrupt handler.
@@ -35,7 +37,7 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
-void
+static void
 iderw(struct buf *b)
 {
   uchar *p;
@@ -57,4 +59,26 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->flags & B_ASYNC)
+    biodone(b);
+}
+
+// The memory disk finishes every request at once.
+void
+idesubmit(struct buf **bs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(bs[i]);
+}
+
+void
+idewaitbuf(struct buf *b)
+{
+}
+
+void
+idestatdump(void)
+{
 }
@@ -15,31 +15,56 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
-
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
-int nblocks;  // Number of data blocks
+//
+// The image is created sparse and written in runs of up to
+// RUNBLOCKS consecutive blocks.  The inode table and bitmap are
+// built in memory and written once at the end.
+
+#define RUNBLOCKS 256
+#define NIND      4     // indirect blocks kept in memory
+
+uint fssize = FSSIZE;
+uint ninodes = 200;
+uint nlog = LOGSIZE;
+uint nbitmap;
+uint ninodeblocks;
+uint nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+uint nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+struct dinode *itab;   // the inode table
+uchar *bitmap;
+
+struct {
+  uint start;
+  uint n;
+  char data[RUNBLOCKS*BSIZE];
+} run;                 // blocks start..start+n-1, not yet written
+
+struct {
+  uint sec;
+  int dirty;
+  uint a[NINDIRECT];
+} ind[NIND];
+int indnext;
 
 void balloc(int);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
+void flushrun(void);
+void flushind(void);
+void wmeta(uint, void*, uint);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirappend(uint dinum, char *name, uint inum);
 
 // convert to intel byte order
 ushort
@@ -64,26 +89,66 @@ xint(uint x)
   return y;
 }
 
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-i] [-o] [-s blocks] [-n inodes] [-l logblocks] fs.img files...\n");
+  exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, hashed;
   uint rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
+  static char fbuf[RUNBLOCKS*BSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  hashed = 0;
+  while((i = getopt(argc, argv, "ios:n:l:")) != -1){
+    switch(i){
+    case 'i':
+      // Make the root directory, and so every directory, hashed.
+      hashed = 1;
+      break;
+    case 'o':
+      // Ordered journaling: the kernel writes file data home
+      // before committing, instead of logging it.  See log.c
+      // for the crash window that keeps it from being the default.
+      sb.flags |= xint(SB_ORDERED);
+      break;
+    case 's':
+      fssize = strtoul(optarg, 0, 0);
+      break;
+    case 'n':
+      ninodes = strtoul(optarg, 0, 0);
+      break;
+    case 'l':
+      nlog = strtoul(optarg, 0, 0);
+      break;
+    default:
+      usage();
+    }
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if(argc < 2)
+    usage();
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
+  // The IDE driver addresses at most 2^28 sectors.
+  if(fssize > (1U << 28) / (BSIZE/512) || ninodes < 2 || nlog < MAXOPBLOCKS+1){
+    fprintf(stderr, "mkfs: bad size, inode count or log size\n");
+    exit(1);
+  }
+
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
     perror(argv[1]);
@@ -91,24 +156,39 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if(nmeta >= fssize){
+    fprintf(stderr, "mkfs: no room for data blocks\n");
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // Unwritten blocks read as zeroes.
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
+  itab = calloc(ninodeblocks*IPB, sizeof(struct dinode));
+  bitmap = calloc(nbitmap, BSIZE);
+  if(itab == 0 || bitmap == 0){
+    perror("calloc");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -117,15 +197,15 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  if(hashed){
+    rinode(rootino, &din);
+    din.major = xshort(DIRHASHED);
+    din.size = xint(NDIRHASH*BSIZE);
+    winode(rootino, &din);
+  }
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirappend(rootino, ".", rootino);
+  dirappend(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -143,89 +223,107 @@ main(int argc, char *argv[])
       ++argv[i];
 
     inum = ialloc(T_FILE);
+    dirappend(rootino, argv[i], inum);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
-
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+    while((cc = read(fd, fbuf, sizeof(fbuf))) > 0)
+      iappend(inum, fbuf, cc);
 
     close(fd);
   }
 
   // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(!hashed){
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
+  flushind();
+  flushrun();
+  wmeta(sb.inodestart, itab, ninodeblocks);
   balloc(freeblock);
 
   exit(0);
 }
 
 void
-wsect(uint sec, void *buf)
+flushrun(void)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
+  if(run.n == 0)
+    return;
+  if(pwrite(fsfd, run.data, run.n*BSIZE, (off_t)run.start*BSIZE) != run.n*BSIZE){
     perror("write");
     exit(1);
   }
+  run.n = 0;
 }
 
+// Write block sec, adding it to the current run if it
+// continues it, and starting a new run otherwise.
 void
-winode(uint inum, struct dinode *ip)
+wsect(uint sec, void *buf)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  if(run.n > 0 && sec >= run.start && sec < run.start + run.n){
+    memmove(run.data + (sec - run.start)*BSIZE, buf, BSIZE);
+    return;
+  }
+  if(run.n == RUNBLOCKS || (run.n > 0 && sec != run.start + run.n))
+    flushrun();
+  if(run.n == 0)
+    run.start = sec;
+  memmove(run.data + run.n*BSIZE, buf, BSIZE);
+  run.n++;
 }
 
 void
-rinode(uint inum, struct dinode *ip)
+rsect(uint sec, void *buf)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  if(run.n > 0 && sec >= run.start && sec < run.start + run.n){
+    memmove(buf, run.data + (sec - run.start)*BSIZE, BSIZE);
+    return;
+  }
+  if(pread(fsfd, buf, BSIZE, (off_t)sec*BSIZE) != BSIZE){
+    perror("read");
+    exit(1);
+  }
 }
 
+// Write n blocks of in-memory metadata starting at block sec.
 void
-rsect(uint sec, void *buf)
+wmeta(uint sec, void *buf, uint n)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
+  if(pwrite(fsfd, buf, n*BSIZE, (off_t)sec*BSIZE) != n*BSIZE){
+    perror("write");
     exit(1);
   }
 }
 
+void
+winode(uint inum, struct dinode *ip)
+{
+  assert(inum < ninodeblocks*IPB);
+  itab[inum] = *ip;
+}
+
+void
+rinode(uint inum, struct dinode *ip)
+{
+  assert(inum < ninodeblocks*IPB);
+  *ip = itab[inum];
+}
+
 uint
 ialloc(ushort type)
 {
   uint inum = freeinode++;
   struct dinode din;
 
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes\n");
+    exit(1);
+  }
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -234,24 +332,98 @@ ialloc(ushort type)
   return inum;
 }
 
+// Allocate the next data block.
+uint
+newblock(void)
+{
+  if(freeblock >= fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  return freeblock++;
+}
+
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    bitmap[i/8] = bitmap[i/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: write bitmap blocks at sector %d\n", sb.bmapstart);
+  wmeta(sb.bmapstart, bitmap, nbitmap);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+void
+flushind(void)
+{
+  int i;
+
+  for(i = 0; i < NIND; i++){
+    if(ind[i].dirty)
+      wsect(ind[i].sec, ind[i].a);
+    ind[i].dirty = 0;
+  }
+}
+
+// Return entry i of the block-number array in sector sec,
+// allocating a block for that entry if it is empty.
+// The last few arrays used are kept in memory.
+uint
+iappendind(uint sec, uint i)
+{
+  int k;
+
+  for(k = 0; k < NIND && ind[k].sec != sec; k++)
+    ;
+  if(k == NIND){
+    k = indnext++ % NIND;
+    if(ind[k].dirty)
+      wsect(ind[k].sec, ind[k].a);
+    ind[k].sec = sec;
+    ind[k].dirty = 0;
+    rsect(sec, (char*)ind[k].a);
+  }
+  if(ind[k].a[i] == 0){
+    ind[k].a[i] = xint(newblock());
+    ind[k].dirty = 1;
+  }
+  return xint(ind[k].a[i]);
+}
+
+// Return the sector holding block fbn of the file
+// described by din, allocating it if necessary.
+uint
+ibmap(struct dinode *din, uint fbn)
+{
+  uint x;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(newblock());
+    }
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+  if(fbn < NINDIRECT){
+    if(xint(din->addrs[NDIRECT]) == 0){
+      din->addrs[NDIRECT] = xint(newblock());
+    }
+    return iappendind(xint(din->addrs[NDIRECT]), fbn);
+  }
+  fbn -= NINDIRECT;
+  if(xint(din->addrs[NDIRECT+1]) == 0){
+    din->addrs[NDIRECT+1] = xint(newblock());
+  }
+  x = iappendind(xint(din->addrs[NDIRECT+1]), fbn / NINDIRECT);
+  return iappendind(x, fbn % NINDIRECT);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +431,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,25 +438,10 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = ibmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
+    if(n1 < BSIZE)
+      rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
     wsect(x, buf);
     n -= n1;
@@ -295,3 +451,35 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Add the entry (name, inum) to directory dinum.
+void
+dirappend(uint dinum, char *name, uint inum)
+{
+  struct dirent de, *d;
+  struct dinode din;
+  char buf[BSIZE];
+  uint x, k;
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+
+  rinode(dinum, &din);
+  if(xshort(din.major) != DIRHASHED){
+    iappend(dinum, &de, sizeof(de));
+    return;
+  }
+
+  // Put the entry in the first free slot of its bucket;
+  // mkfs never needs overflow blocks.
+  x = ibmap(&din, dirhash(de.name) % NDIRHASH);
+  winode(dinum, &din);
+  rsect(x, buf);
+  d = (struct dirent*)buf;
+  for(k = 1; k < DPB && d[k].inum != 0; k++)
+    ;
+  assert(k < DPB);
+  d[k] = de;
+  wsect(x, buf);
+}
@@ -0,0 +1,45 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "sched.h"
+
+// Run a command in another scheduling class:
+//   nice [-n nice | -r prio | -b] command [args...]
+int
+main(int argc, char **argv)
+{
+  int class, prio;
+
+  class = SCHED_NORMAL;
+  prio = NNICE-1;
+  argv++;
+  argc--;
+  if(argc > 1 && argv[0][0] == '-'){
+    if(strcmp(argv[0], "-b") == 0){
+      class = SCHED_BATCH;
+      prio = 0;
+      argv++;
+      argc--;
+    } else if(argc > 2 && strcmp(argv[0], "-n") == 0){
+      prio = atoi(argv[1]);
+      argv += 2;
+      argc -= 2;
+    } else if(argc > 2 && strcmp(argv[0], "-r") == 0){
+      class = SCHED_RT;
+      prio = atoi(argv[1]);
+      argv += 2;
+      argc -= 2;
+    }
+  }
+  if(argc < 1 || argv[0][0] == '-'){
+    printf(2, "usage: nice [-n nice | -r prio | -b] command [args...]\n");
+    exit();
+  }
+  if(setprio(0, class, prio) < 0){
+    printf(2, "nice: bad priority\n");
+    exit();
+  }
+  exec(argv[0], argv);
+  printf(2, "nice: exec %s failed\n", argv[0]);
+  exit();
+}
@@ -1,14 +1,35 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NIOIRQ       24  // I/O APIC interrupt inputs
+#define NOFILE     1024  // max open files per process; a page of pointers
+#define NOFILE0      16  // fd table slots a process starts with
+#define NVMA         16  // file-backed memory regions per process
+#define NSHM         16  // shared memory segments per system
+#define SHMPAGES     64  // max pages in a shared memory segment
+#define NFILE      8192  // open files per system
+#define NINODE       50  // i-nodes to cache before recycling
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define SWAPDEV       0  // disk holding the swap area, after the kernel
+#define SWAPSTART 10000  // first block of the swap area
+#define SWAPBLOCKS 65536 // size of the swap area in blocks
+#define SWAPBATCH    16  // pages swapout() frees to make room
+#define RAMDEV        2  // device number of the RAM disk
+#define NMOUNT        4  // maximum number of mounted file systems
+#define NBDEV         3  // number of block devices
 #define MAXARG       32  // max exec arguments
+#define NSYSCALL     64  // system call numbers are below this
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      128  // default blocks in on-disk log, including its header
+#define NBUF         (MAXOPBLOCKS*3)  // initial size of disk block cache
+#define NBUFMAX      4096  // size the disk block cache may grow to
+#define NBATCH       32  // max bufs a caller keeps in flight at once
+#define NDELAY       256  // max file blocks awaiting delayed allocation
+#define FLUSHNS      1000000000ULL  // how often the flusher runs, in ns
+#define NDCACHE     256  // directory entries in name cache
+#define FSSIZE       2000  // default size of file system mkfs makes, in blocks
+#define TICKNS   10000000  // nanoseconds per tick for sleep and uptime
+#define QUANTUM    TICKNS  // scheduling time slice in nanoseconds
+#define PROFNS    1000000  // profiler sampling interval in nanoseconds
 
@@ -7,12 +7,13 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
 
-#define PIPESIZE 512
+#define PIPESIZE PGSIZE
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // ring buffer, one page
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
@@ -28,7 +29,9 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((p = (struct pipe*)kalloc()) == 0)
+  if((p = (struct pipe*)kmalloc(sizeof(*p))) == 0)
+    goto bad;
+  if((p->data = kalloc()) == 0)
     goto bad;
   p->readopen = 1;
   p->writeopen = 1;
@@ -47,8 +50,11 @@ pipealloc(struct file **f0, struct file **f1)
 
 //PAGEBREAK: 20
  bad:
-  if(p)
-    kfree((char*)p);
+  if(p){
+    if(p->data)
+      kfree(p->data);
+    kmfree(p);
+  }
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -67,55 +73,133 @@ pipeclose(struct pipe *p, int writable)
     p->readopen = 0;
     wakeup(&p->nwrite);
   }
+  pollwake();
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    kfree(p->data);
+    kmfree(p);
   } else
     release(&p->lock);
 }
 
+// What a read or write of p would find ready, for poll().
+int
+pipepoll(struct pipe *p, int writable)
+{
+  int r;
+
+  r = 0;
+  acquire(&p->lock);
+  if(writable){
+    if(p->readopen == 0)
+      r = POLLERR;
+    else if(p->nwrite != p->nread + PIPESIZE)
+      r = POLLOUT;
+  } else {
+    if(p->nread != p->nwrite)
+      r = POLLIN;
+    if(p->writeopen == 0)
+      r |= POLLHUP;
+  }
+  release(&p->lock);
+  return r;
+}
+
 //PAGEBREAK: 40
+// Write n bytes to p.  If nonblock, write only what fits,
+// returning how much that was, or -1 if nothing did.
 int
-pipewrite(struct pipe *p, char *addr, int n)
+pipewrite(struct pipe *p, char *addr, int n, int nonblock)
 {
-  int i;
+  int i, m, r, faulted;
 
+  faulted = 0;
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
+  for(i = 0; i < n; i += m){
     while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
-      if(p->readopen == 0 || myproc()->killed){
+      if(p->readopen == 0 || myproc()->killed || (nonblock && i == 0)){
         release(&p->lock);
         return -1;
       }
+      if(nonblock)
+        goto out;
       wakeup(&p->nread);
+      pollwake();
       sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    // Copy as much as fits before the ring wraps or fills.
+    m = PIPESIZE - p->nwrite % PIPESIZE;
+    if(m > p->nread + PIPESIZE - p->nwrite)
+      m = p->nread + PIPESIZE - p->nwrite;
+    if(m > n - i)
+      m = n - i;
+    if(ucopyin(p->data + p->nwrite % PIPESIZE, (uint)addr + i, m) < 0){
+      // Paged out while we slept; fault it in without the lock.
+      // If the copy fails again right after, give up.
+      release(&p->lock);
+      r = faulted ? -1 : uvmfaultin(myproc(), (uint)addr + i, m, 0);
+      faulted = 1;
+      acquire(&p->lock);
+      if(r < 0){
+        if(i == 0)
+          i = -1;
+        goto out;
+      }
+      m = 0;
+      continue;
+    }
+    faulted = 0;
+    p->nwrite += m;
   }
+out:
   wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  pollwake();
   release(&p->lock);
-  return n;
+  return i;
 }
 
+// Read up to n bytes from p, waiting for some unless nonblock,
+// in which case an empty pipe returns -1.
 int
-piperead(struct pipe *p, char *addr, int n)
+piperead(struct pipe *p, char *addr, int n, int nonblock)
 {
-  int i;
+  int i, m, r, faulted;
 
+  faulted = 0;
   acquire(&p->lock);
+again:
   while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
-    if(myproc()->killed){
+    if(myproc()->killed || nonblock){
       release(&p->lock);
       return -1;
     }
     sleep(&p->nread, &p->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
+  for(i = 0; i < n && p->nread != p->nwrite; i += m){  //DOC: piperead-copy
+    m = PIPESIZE - p->nread % PIPESIZE;
+    if(m > p->nwrite - p->nread)
+      m = p->nwrite - p->nread;
+    if(m > n - i)
+      m = n - i;
+    if(ucopyout((uint)addr + i, p->data + p->nread % PIPESIZE, m) < 0){
+      // Paged out or shared copy-on-write; fault it in for
+      // writing without the lock.  If the copy fails again
+      // right after, give up.
+      release(&p->lock);
+      r = faulted ? -1 : uvmfaultin(myproc(), (uint)addr + i, m, 1);
+      faulted = 1;
+      acquire(&p->lock);
+      if(r == 0 && i == 0)
+        goto again;  // the pipe may have been drained meanwhile
+      if(r < 0 && i == 0)
+        i = -1;
       break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+    }
+    faulted = 0;
+    p->nread += m;
   }
   wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  pollwake();
   release(&p->lock);
   return i;
 }
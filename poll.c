@@ -0,0 +1,109 @@
+// poll(): wait until any of several fds is ready.
+//
+// A process in poll() is on the pollers list, and sleeps on
+// itself under tickslock, as sys_sleep() does, so that a
+// timeout can wake it too.  Pipes and the console call
+// pollwake() whenever they might have become readable or
+// writable; that wakes every poller to look at its fds again.
+// npoll lets pollwake() skip tickslock when nobody is polling.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "poll.h"
+
+static struct proc *pollers;  // protected by tickslock
+static volatile int npoll;
+
+// Some fd may have become ready.
+void
+pollwake(void)
+{
+  struct proc *p;
+
+  __sync_synchronize();
+  if(npoll == 0)
+    return;
+  acquire(&tickslock);
+  for(p = pollers; p; p = p->pollnext){
+    p->pollev = 1;
+    wakeup(p);
+  }
+  release(&tickslock);
+}
+
+// Fill in revents for the n fds; return how many are ready.
+static int
+pollscan(struct pollfd *fds, int n)
+{
+  struct file *f;
+  int i, r;
+
+  r = 0;
+  for(i = 0; i < n; i++){
+    fds[i].revents = 0;
+    if(fds[i].fd < 0)
+      continue;
+    if((f = fdget(fds[i].fd)) == 0)
+      fds[i].revents = POLLNVAL;
+    else
+      fds[i].revents = filepoll(f) & (fds[i].events|POLLERR|POLLHUP);
+    if(fds[i].revents)
+      r++;
+  }
+  return r;
+}
+
+// Wait for one of the n fds in fds to be ready, for at most
+// ms milliseconds if ms >= 0.  Return the number ready,
+// 0 on timeout, or -1 if killed.
+int
+poll(struct pollfd *fds, int n, int ms)
+{
+  struct proc *p = myproc(), **pp;
+  uint64 when;
+  int r;
+
+  when = ms > 0 ? nsec() + (uint64)ms * 1000000 : 0;
+  acquire(&tickslock);
+  p->pollnext = pollers;
+  pollers = p;
+  npoll++;
+  if(when)
+    timeradd(when, p);
+  release(&tickslock);
+
+  for(;;){
+    acquire(&tickslock);
+    p->pollev = 0;
+    release(&tickslock);
+    if((r = pollscan(fds, n)) != 0 || ms == 0)
+      break;
+    acquire(&tickslock);
+    if(p->killed){
+      release(&tickslock);
+      r = -1;
+      break;
+    }
+    if(when && nsec() >= when){
+      release(&tickslock);
+      break;
+    }
+    if(!p->pollev)
+      sleep(p, &tickslock);
+    release(&tickslock);
+  }
+
+  acquire(&tickslock);
+  for(pp = &pollers; *pp != p; pp = &(*pp)->pollnext)
+    ;
+  *pp = p->pollnext;
+  npoll--;
+  if(when)
+    timerdel(p);
+  release(&tickslock);
+  return r;
+}
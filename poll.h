@@ -0,0 +1,12 @@
+// poll() requests and results.
+struct pollfd {
+  int fd;         // fd to watch, or negative to skip
+  short events;   // POLLIN and/or POLLOUT
+  short revents;  // what is ready; POLLERR, POLLHUP, POLLNVAL always count
+};
+
+#define POLLIN   0x01  // read would not block
+#define POLLOUT  0x04  // write would not block
+#define POLLERR  0x08  // pipe's reader has gone
+#define POLLHUP  0x10  // pipe's writer has gone
+#define POLLNVAL 0x20  // fd is not open
@@ -1,11 +1,93 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "param.h"
+
+// printf collects output in a buffer per fd instead of calling
+// write once per character.  Output to the console is written
+// at the end of each printf call; output to files and pipes is
+// written when the buffer fills, at flush(fd), close(fd), or
+// exit().  Only the first NOFILE0 fds are buffered.
+
+#define OBUFSIZE 512
+
+enum { OB_UNKNOWN, OB_LINE, OB_FULL };
+
+struct obuf {
+  int mode;
+  int n;
+  char buf[OBUFSIZE];
+};
+
+static struct obuf obuf[NOFILE0];
+
+// Write out fd's buffered output.
+void
+flush(int fd)
+{
+  struct obuf *b;
+
+  if(fd < 0 || fd >= NOFILE0)
+    return;
+  b = &obuf[fd];
+  if(b->n > 0)
+    write(fd, b->buf, b->n);
+  b->n = 0;
+}
+
+// Write out fd's output as it is closed, and forget how it was
+// buffered, since the fd may be reused for something else.
+static void
+closefd(int fd)
+{
+  if(fd < 0 || fd >= NOFILE0)
+    return;
+  flush(fd);
+  obuf[fd].mode = OB_UNKNOWN;
+}
+
+static void
+flushall(void)
+{
+  int fd;
+
+  for(fd = 0; fd < NOFILE0; fd++)
+    flush(fd);
+}
+
+// Decide how to buffer fd, the first time it is printed to.
+static void
+obufmode(int fd)
+{
+  struct stat st;
+  struct obuf *b;
+
+  b = &obuf[fd];
+  if(b->mode == OB_UNKNOWN){
+    // fstat fails on pipes, which are buffered like files.
+    if(fstat(fd, &st) == 0 && st.type == T_DEV)
+      b->mode = OB_LINE;
+    else
+      b->mode = OB_FULL;
+    exitflush = flushall;
+    closeflush = closefd;
+  }
+}
 
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  struct obuf *b;
+
+  if(fd < 0 || fd >= NOFILE0){
+    write(fd, &c, 1);
+    return;
+  }
+  obufmode(fd);
+  b = &obuf[fd];
+  if(b->n == OBUFSIZE)
+    flush(fd);
+  b->buf[b->n++] = c;
 }
 
 static void
@@ -82,4 +164,6 @@ printf(int fd, const char *fmt, ...)
       state = 0;
     }
   }
+  if(fd >= 0 && fd < NOFILE0 && obuf[fd].mode == OB_LINE)
+    flush(fd);
 }
@@ -4,14 +4,55 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "vm.h"
+#include "sysstat.h"
+#include "trace.h"
+#include "sched.h"
+
+// Run-queue levels, most urgent first: one per real-time
+// priority, then the interactive boost level that SCHED_NORMAL
+// processes get when they wake up from sleep, then one per
+// nice value, then SCHED_BATCH.
+#define PRIO_BOOST  NRTPRIO
+#define PRIO_NICE   (PRIO_BOOST+1)
+#define PRIO_BATCH  (PRIO_NICE+NNICE)
+#define NPRIO       (PRIO_BATCH+1)
+
+// Per-CPU queue of RUNNABLE processes, a FIFO per level.
+// A process is RUNNABLE exactly when it is on one of these.
+struct runq {
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  uint mask;        // bit l set if level l is non-empty
+  volatile int n;   // peeked at by idle CPUs without the lock
+};
+
+// SLEEPING processes are kept on hash chains keyed by chan,
+// so that wakeup only looks at processes sleeping on chan.
+#define NSLEEPQ 64
+#define SLEEPQ(chan) (((uint)(chan) >> 2) % NSLEEPQ)
 
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct runq runq[NCPU];
+  struct proc *sleepq[NSLEEPQ];
+  struct proc *free;   // UNUSED procs, chained by rqnext
 } ptable;
 
+// Futex wait queues: a (vmspace, user address) pair hashes to
+// one of these, whose address is the sleep channel.
+#define NFUTEX 64
+#define FUTEXQ(vm, addr) (((uint)(vm) ^ (addr)) >> 2) % NFUTEX
+
+struct futexq {
+  struct spinlock lock;
+} futexq[NFUTEX];
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -19,11 +60,24 @@ extern void forkret(void);
 extern void trapret(void);
 
 static void wakeup1(void *chan);
+static void runqput(struct proc *p, int woken);
+static void kickidle(struct proc *p);
+static void sibadd(struct proc **list, struct proc *p);
+static void sibdel(struct proc *p);
+static void procfree(struct proc *p);
 
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NFUTEX; i++)
+    initlock(&futexq[i].lock, "futex");
+  for(i = NPROC-1; i >= 0; i--){
+    ptable.proc[i].rqnext = ptable.free;
+    ptable.free = &ptable.proc[i];
+  }
 }
 
 // Must be called with interrupts disabled
@@ -66,7 +120,7 @@ myproc(void) {
 }
 
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc off ptable.free.
 // If found, change state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
@@ -77,23 +131,33 @@ allocproc(void)
   char *sp;
 
   acquire(&ptable.lock);
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
-
-found:
+  if((p = ptable.free) == 0){
+    release(&ptable.lock);
+    return 0;
+  }
+  ptable.free = p->rqnext;
+  p->rqnext = 0;
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->cpu = cpuid();
+  p->class = SCHED_NORMAL;
+  p->prio = 0;
+  p->affinity = ~0;
+  p->kfn = 0;
+  p->oplogs = 0;
+  p->ustack = 0;
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE0;
+  memset(p->scount, 0, sizeof(p->scount));
+  memset(p->scycles, 0, sizeof(p->scycles));
 
   release(&ptable.lock);
 
-  // Allocate kernel stack.
-  if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+  // Allocate kernel stack, unless p kept the last one it had.
+  if(p->kstack == 0 && (p->kstack = kalloc()) == 0){
+    acquire(&ptable.lock);
+    procfree(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -115,6 +179,46 @@ found:
   return p;
 }
 
+// Return p, which has given up its address space, to
+// ptable.free.  p keeps its kernel stack for the next
+// allocproc() to reuse.  Caller must hold ptable.lock.
+static void
+procfree(struct proc *p)
+{
+  p->state = UNUSED;
+  p->rqnext = ptable.free;
+  ptable.free = p;
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch here.
+static void
+kthreadret(void)
+{
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+// Start a process that runs fn in the kernel, with only the
+// kernel mapped, and never returns to user space.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0 || (p->vm = vmnew()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context->eip = (uint)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  runqput(p, 0);
+  release(&ptable.lock);
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -126,10 +230,10 @@ userinit(void)
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((p->vm = vmnew()) == 0)
     panic("userinit: out of memory?");
-  inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
+  inituvm(p->vm->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
+  p->vm->sz = PGSIZE;
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -148,39 +252,83 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  runqput(p, 0);
 
   release(&ptable.lock);
+
+  kthread(flusher, "flusher");
 }
 
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Growing only reserves the addresses; pagefault()
+// allocates zeroed pages as they are first touched.
+// Return the old size, or -1 on failure.
 int
 growproc(int n)
 {
   uint sz;
+  struct vmspace *vm = myproc()->vm;
+
+  acquiresleep(&vm->mlock);
+  sz = vm->sz;
+  if((n > 0 && (sz + n < sz || sz + n >= KERNBASE ||
+                vmaoverlap(vm->vma, PGROUNDUP(sz), sz + n))) ||
+     (n < 0 && sz + n > sz)){
+    releasesleep(&vm->mlock);
+    return -1;
+  }
+  acquire(&vm->lock);
+  vm->sz = sz + n;
+  release(&vm->lock);
+  if(n < 0)
+    vmclear(vm, sz + n, sz);
+  releasesleep(&vm->mlock);
+  return sz;
+}
+
+// Give np, which has its address space, trap frame and name,
+// the rest of the current process's state, and start it
+// running as its child.  np gets copies of all the open files,
+// or if ofile is not 0, just ofile[0..2] as fds 0 to 2.
+// If np's fd table cannot be allocated, np is freed instead.
+static int
+forkstart(struct proc *np, struct file **ofile)
+{
+  int pid;
   struct proc *curproc = myproc();
 
-  sz = curproc->sz;
-  if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
-  } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+  if(fdcopy(np, ofile) < 0){
+    vmexit(np->vm);
+    vmput(np->vm);
+    np->vm = 0;
+    acquire(&ptable.lock);
+    procfree(np);
+    release(&ptable.lock);
+    return -1;
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  np->parent = curproc;
+  np->cwd = idup(curproc->cwd);
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  np->class = curproc->class;
+  np->prio = curproc->prio;
+  np->affinity = curproc->affinity;
+  sibadd(&curproc->kids, np);
+  runqput(np, 0);
+
+  release(&ptable.lock);
+
+  return pid;
 }
 
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
-// Caller must set state of returned proc to RUNNABLE.
 int
 fork(void)
 {
-  int i, pid;
   struct proc *np;
   struct proc *curproc = myproc();
 
@@ -190,35 +338,70 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+  if((np->vm = vmcopy(curproc->vm)) == 0){
+    acquire(&ptable.lock);
+    procfree(np);
+    release(&ptable.lock);
     return -1;
   }
-  np->sz = curproc->sz;
-  np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
-
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+  return forkstart(np, 0);
+}
 
-  pid = np->pid;
-
-  acquire(&ptable.lock);
+// Create a child running the program path with arguments
+// argv, as fork() followed by exec() in the child would, but
+// without copying the current address space only to throw
+// it away.  ofile is as for forkstart().
+int
+spawn(char *path, char **argv, struct file **ofile)
+{
+  struct proc *np;
+  uint eip, esp;
 
-  np->state = RUNNABLE;
+  if((np = allocproc()) == 0)
+    return -1;
+  if((np->vm = execload(path, argv, np->name, &eip, &esp)) == 0){
+    acquire(&ptable.lock);
+    procfree(np);
+    release(&ptable.lock);
+    return -1;
+  }
+  *np->tf = *myproc()->tf;
+  np->tf->eip = eip;
+  np->tf->esp = esp;
+  return forkstart(np, ofile);
+}
 
-  release(&ptable.lock);
+// Create a thread: a child process that shares the current
+// process's address space and starts out calling fn(arg) on
+// the user stack whose top is stack, with a return address
+// that faults.  Open files and the current directory are
+// copied as fork() does; they are not shared.
+int
+clone(uint fn, uint arg, uint stack)
+{
+  struct proc *np;
+  struct proc *curproc = myproc();
 
-  return pid;
+  if(stack % 4 || userbuf(stack - 8, 8, 1) < 0 || fn >= KERNBASE)
+    return -1;
+  if((np = allocproc()) == 0)
+    return -1;
+  np->vm = curproc->vm;
+  vmshare(np->vm);
+  np->ustack = stack;
+  *(uint*)(stack - 4) = arg;
+  *(uint*)(stack - 8) = 0xffffffff;  // fake return PC
+  *np->tf = *curproc->tf;
+  np->tf->eip = fn;
+  np->tf->esp = stack - 8;
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+  return forkstart(np, 0);
 }
 
 // Exit the current process.  Does not return.
@@ -229,19 +412,13 @@ exit(void)
 {
   struct proc *curproc = myproc();
   struct proc *p;
-  int fd;
 
   if(curproc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
-    }
-  }
+  fdcloseall();
 
+  vmexit(curproc->vm);
   begin_op();
   iput(curproc->cwd);
   end_op();
@@ -253,55 +430,75 @@ exit(void)
   wakeup1(curproc->parent);
 
   // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->parent == curproc){
+  while((p = curproc->kids) != 0){
+    sibdel(p);
+    p->parent = initproc;
+    sibadd(&initproc->kids, p);
+  }
+  if(curproc->zombies){
+    while((p = curproc->zombies) != 0){
+      sibdel(p);
       p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
+      sibadd(&initproc->zombies, p);
     }
+    wakeup1(initproc);
   }
 
   // Jump into the scheduler, never to return.
+  sibdel(curproc);
+  sibadd(&curproc->parent->zombies, curproc);
   curproc->state = ZOMBIE;
   sched();
   panic("zombie exit");
 }
 
+// Is p one of the current process's threads, sharing its
+// address space?
+static int
+isthread(struct proc *p)
+{
+  return p->vm == myproc()->vm;
+}
+
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
-int
-wait(void)
+// wait() takes only children with their own address space,
+// and join() only threads; join() also returns the stack
+// the thread was given in *ustack.
+static int
+reap(int threads, uint *ustack)
 {
   struct proc *p;
-  int havekids, pid;
+  int pid;
   struct proc *curproc = myproc();
   
   acquire(&ptable.lock);
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
-        continue;
-      havekids = 1;
-      if(p->state == ZOMBIE){
-        // Found one.
-        pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        release(&ptable.lock);
-        return pid;
-      }
+    // Take the first exited child, if any.
+    for(p = curproc->zombies; p; p = p->sibnext)
+      if(isthread(p) == threads)
+        break;
+    if(p != 0){
+      sibdel(p);
+      pid = p->pid;
+      if(ustack)
+        *ustack = p->ustack;
+      vmput(p->vm);
+      p->vm = 0;
+      p->pid = 0;
+      p->parent = 0;
+      p->name[0] = 0;
+      p->killed = 0;
+      procfree(p);
+      release(&ptable.lock);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || curproc->killed){
+    for(p = curproc->kids; p; p = p->sibnext)
+      if(isthread(p) == threads)
+        break;
+    if(p == 0 || curproc->killed){
       release(&ptable.lock);
       return -1;
     }
@@ -311,7 +508,216 @@ wait(void)
   }
 }
 
+int
+wait(void)
+{
+  return reap(0, 0);
+}
+
+// Wait for one of the threads the current process cloned
+// to exit, and return its pid and, in *ustack, its stack.
+int
+join(uint *ustack)
+{
+  return reap(1, ustack);
+}
+
+// Push p onto the front of list, one of its parent's
+// kids or zombies lists.  The ptable lock must be held.
+static void
+sibadd(struct proc **list, struct proc *p)
+{
+  p->sibnext = *list;
+  if(*list)
+    (*list)->sibprev = &p->sibnext;
+  p->sibprev = list;
+  *list = p;
+}
+
+// Unlink p from its parent's list.  The ptable lock must be held.
+static void
+sibdel(struct proc *p)
+{
+  *p->sibprev = p->sibnext;
+  if(p->sibnext)
+    p->sibnext->sibprev = p->sibprev;
+  p->sibnext = 0;
+  p->sibprev = 0;
+}
+
 //PAGEBREAK: 42
+// The run-queue level for p.  A SCHED_NORMAL process that
+// has just woken up from sleep gets the boost level until
+// it next uses up a time slice.
+static int
+runqlevel(struct proc *p, int woken)
+{
+  switch(p->class){
+  case SCHED_RT:
+    return p->prio;
+  case SCHED_BATCH:
+    return PRIO_BATCH;
+  default:
+    return woken ? PRIO_BOOST : PRIO_NICE + p->prio;
+  }
+}
+
+// Make p RUNNABLE by appending it to the run queue of
+// the CPU it last ran on, so that it finds its cache warm,
+// or of the least busy CPU it is allowed on if it may not
+// run there.  woken says whether p is coming out of sleep.
+// The ptable lock must be held.
+static void
+runqput(struct proc *p, int woken)
+{
+  struct runq *q;
+  int i, l;
+
+  if(!(p->affinity & (1 << p->cpu))){
+    for(i = 0; i < ncpu; i++)
+      if((p->affinity & (1 << i)) &&
+         (!(p->affinity & (1 << p->cpu)) || ptable.runq[i].n < ptable.runq[p->cpu].n))
+        p->cpu = i;
+  }
+  l = p->level = runqlevel(p, woken);
+  q = &ptable.runq[p->cpu];
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  if(q->tail[l])
+    q->tail[l]->rqnext = p;
+  else
+    q->head[l] = p;
+  q->tail[l] = p;
+  q->mask |= 1 << l;
+  q->n++;
+  kickidle(p);
+}
+
+// p was just queued.  If its CPU is halted, wake it;
+// otherwise wake some other halted CPU so that it can steal.
+// With no CPU idle, preempt p's CPU if it is running something
+// less urgent than p.  Pairs with the check of halted in scheduler().
+static void
+kickidle(struct proc *p)
+{
+  struct cpu *c;
+
+  __sync_synchronize();
+  c = &cpus[p->cpu];
+  if(!c->halted){
+    for(c = cpus; c < &cpus[ncpu]; c++)
+      if(c->halted)
+        break;
+    if(c == &cpus[ncpu]){
+      c = &cpus[p->cpu];
+      if(c->proc == 0 || c->proc->level <= p->level)
+        return;
+      c->resched = 1;
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+      return;
+    }
+  }
+  if(c != mycpu())
+    lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+}
+
+// Most urgent non-empty level of CPU i's run queue,
+// or NPRIO if it is empty.
+static int
+runqtop(int i)
+{
+  uint m;
+
+  m = ptable.runq[i].mask;
+  return m ? __builtin_ctz(m) : NPRIO;
+}
+
+// Remove and return the first process at the most urgent
+// level of CPU i's run queue, or 0 if it is empty.
+// The ptable lock must be held.
+static struct proc*
+runqget(int i)
+{
+  struct runq *q;
+  struct proc *p;
+  int l;
+
+  q = &ptable.runq[i];
+  if((l = runqtop(i)) == NPRIO)
+    return 0;
+  p = q->head[l];
+  if((q->head[l] = p->rqnext) == 0){
+    q->tail[l] = 0;
+    q->mask &= ~(1 << l);
+  }
+  p->rqnext = 0;
+  q->n--;
+  return p;
+}
+
+// Take p off its run queue.  The ptable lock must be held.
+static void
+runqdel(struct proc *p)
+{
+  struct runq *q;
+  struct proc **pp, *prev;
+  int l;
+
+  q = &ptable.runq[p->cpu];
+  l = p->level;
+  prev = 0;
+  for(pp = &q->head[l]; *pp; pp = &(*pp)->rqnext){
+    if(*pp == p){
+      *pp = p->rqnext;
+      if(q->tail[l] == p)
+        q->tail[l] = prev;
+      if(q->head[l] == 0)
+        q->mask &= ~(1 << l);
+      p->rqnext = 0;
+      q->n--;
+      return;
+    }
+    prev = *pp;
+  }
+  panic("runqdel");
+}
+
+// Pick the next process for CPU i: the most urgent one on
+// any run queue.  Ties go to CPU i's own queue, then to the
+// longest other queue.  A process is only stolen from another
+// queue if its affinity allows CPU i.  The ptable lock must be held.
+static struct proc*
+runqpick(int i)
+{
+  int j, best;
+
+  best = i;
+  for(j = 0; j < ncpu; j++){
+    if(j == i || ptable.runq[j].n == 0)
+      continue;
+    if(!(ptable.runq[j].head[runqtop(j)]->affinity & (1 << i)))
+      continue;
+    if(runqtop(j) < runqtop(best) ||
+       (best != i && runqtop(j) == runqtop(best) &&
+        ptable.runq[j].n > ptable.runq[best].n))
+      best = j;
+  }
+  return runqget(best);
+}
+
+// Is any process RUNNABLE?  Read without the ptable lock,
+// so the answer is only a hint.
+static int
+runqidle(void)
+{
+  int i;
+
+  for(i = 0; i < ncpu; i++)
+    if(ptable.runq[i].n > 0)
+      return 0;
+  return 1;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -324,34 +730,63 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int idle;
+
   c->proc = 0;
-  
+  idle = 0;
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
+    // Leave ptable.lock to the busy CPUs while
+    // there is nothing to run, and stop the time-slice
+    // timer until there is.  Then halt: runqput() sends
+    // an IPI once it has queued a process, if it sees
+    // halted set.
+    if(runqidle()){
+      if(!idle)
+        timerarm();
+      idle = 1;
+      if(kzfill())   // zero a page for kzalloc() while waiting
         continue;
+      cli();
+      c->halted = 1;
+      __sync_synchronize();
+      if(runqidle())
+        stihlt();
+      c->halted = 0;
+      continue;
+    }
+    idle = 0;
 
+    acquire(&ptable.lock);
+    while((p = runqpick(c - cpus)) != 0){
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
+      c->resched = 0;
+      c->quantum = nsec() + (p->class == SCHED_BATCH ? 4*QUANTUM : QUANTUM);
+      timerarm();
+      p->cpu = c - cpus;
       switchuvm(p);
       p->state = RUNNING;
+      trace(TR_SWITCH, p->pid, 0, p->name);
 
       swtch(&(c->scheduler), p->context);
-      switchkvm();
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
+      // Stay on its page table while going straight to the next
+      // process; switchuvm() skips the reload if that is p again.
       c->proc = 0;
     }
+    // Nothing left to run.  Leave p's page table before
+    // releasing ptable.lock, since once p runs elsewhere or
+    // is reaped its page table may be changed or freed.
+    switchkvm();
+    c->vm = 0;
     release(&ptable.lock);
-
   }
 }
 
@@ -377,6 +812,7 @@ sched(void)
   if(readeflags()&FL_IF)
     panic("sched interruptible");
   intena = mycpu()->intena;
+  trace(TR_YIELD, p->state, 0, 0);
   swtch(&p->context, mycpu()->scheduler);
   mycpu()->intena = intena;
 }
@@ -386,7 +822,7 @@ void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  runqput(myproc(), 0);
   sched();
   release(&ptable.lock);
 }
@@ -405,8 +841,8 @@ forkret(void)
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
     first = 0;
+    initlog(ROOTDEV);  // recover before iinit reads the bitmap
     iinit(ROOTDEV);
-    initlog(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -436,8 +872,11 @@ sleep(void *chan, struct spinlock *lk)
     release(lk);
   }
   // Go to sleep.
+  trace(TR_SLEEP, (uint)chan, 0, 0);
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = ptable.sleepq[SLEEPQ(chan)];
+  ptable.sleepq[SLEEPQ(chan)] = p;
 
   sched();
 
@@ -457,11 +896,33 @@ sleep(void *chan, struct spinlock *lk)
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
+  struct proc *p, **pp;
+
+  trace(TR_WAKEUP, (uint)chan, 0, 0);
+  pp = &ptable.sleepq[SLEEPQ(chan)];
+  while((p = *pp) != 0){
+    if(p->chan == chan){
+      *pp = p->sqnext;
+      runqput(p, 1);
+    } else
+      pp = &p->sqnext;
+  }
+}
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+// Take sleeping process p off its sleep chain and make it
+// RUNNABLE.  The ptable lock must be held.
+static void
+unsleep(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &ptable.sleepq[SLEEPQ(p->chan)]; *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      *pp = p->sqnext;
+      break;
+    }
+  }
+  runqput(p, 1);
 }
 
 // Wake up all processes sleeping on chan.
@@ -473,6 +934,81 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Sleep until futexwake(addr), if the int at user address addr
+// still holds val; return at once if it does not.  Looking at
+// the word and going to sleep happen under the queue lock, which
+// futexwake takes too, so a wakeup between them cannot be lost.
+// Waiters that hash to the same queue are woken together, so
+// callers must check again for what they were waiting for.
+int
+futexwait(uint addr, int val)
+{
+  struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
+  struct futexq *q;
+  char *ka;
+  int cur;
+
+  if(addr % 4 || addr >= KERNBASE)
+    return -1;
+  q = &futexq[FUTEXQ(vm, addr)];
+  for(;;){
+    acquire(&q->lock);
+    acquire(&vm->lock);
+    ka = uva2ka(vm->pgdir, (char*)addr);
+    if(ka)
+      cur = *(int*)(ka + addr % PGSIZE);
+    release(&vm->lock);
+    if(ka)
+      break;
+    release(&q->lock);
+    if(uvmfaultin(curproc, addr, 4, 0) < 0)
+      return -1;
+  }
+  if(cur == val && !curproc->killed)
+    sleep(q, &q->lock);
+  release(&q->lock);
+  return 0;
+}
+
+// Wake the processes sleeping in futexwait(addr).
+int
+futexwake(uint addr)
+{
+  struct futexq *q;
+
+  if(addr % 4 || addr >= KERNBASE)
+    return -1;
+  q = &futexq[FUTEXQ(myproc()->vm, addr)];
+  acquire(&q->lock);
+  wakeup(q);
+  release(&q->lock);
+  return 0;
+}
+
+// Copy process pid's system call counts into st[0..n-1].
+// Returns n, or -1 if there is no such process.
+int
+procstats(int pid, struct sysstat *st, int n)
+{
+  struct proc *p;
+  int i;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == pid && p->state != UNUSED){
+      for(i = 0; i < n; i++){
+        st[i].count = p->scount[i];
+        st[i].cycles = p->scycles[i];
+      }
+      release(&ptable.lock);
+      return n;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -487,7 +1023,47 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        unsleep(p);
+      release(&ptable.lock);
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+// Set the scheduling class and priority of process pid,
+// or of the caller if pid is 0.  Takes effect the next
+// time the process is queued.
+int
+setprio(int pid, int class, int prio)
+{
+  struct proc *p;
+
+  switch(class){
+  case SCHED_NORMAL:
+    if(prio < 0 || prio >= NNICE)
+      return -1;
+    break;
+  case SCHED_RT:
+    if(prio < 0 || prio >= NRTPRIO)
+      return -1;
+    break;
+  case SCHED_BATCH:
+    if(prio != 0)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  if(pid == 0)
+    pid = myproc()->pid;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == pid && p->state != UNUSED){
+      p->class = class;
+      p->prio = prio;
       release(&ptable.lock);
       return 0;
     }
@@ -496,6 +1072,84 @@ kill(int pid)
   return -1;
 }
 
+// Make vm p's address space, and return the old one.
+// Holding ptable.lock keeps procvm() from taking a new
+// reference to the old one as the caller drops it.
+struct vmspace*
+setvm(struct proc *p, struct vmspace *vm)
+{
+  struct vmspace *old;
+
+  acquire(&ptable.lock);
+  old = p->vm;
+  p->vm = vm;
+  release(&ptable.lock);
+  return old;
+}
+
+// Return the address space of the first live process at or
+// after ptable slot *i, with a reference to drop with vmput(),
+// and set *i to that slot.  Returns 0 if there is none.
+struct vmspace*
+procvm(int *i)
+{
+  struct proc *p;
+  struct vmspace *vm;
+
+  acquire(&ptable.lock);
+  for(; *i < NPROC; (*i)++){
+    p = &ptable.proc[*i];
+    if(p->state == UNUSED || p->state == EMBRYO || p->state == ZOMBIE)
+      continue;
+    if((vm = p->vm) == 0)
+      continue;
+    __sync_fetch_and_add(&vm->ref, 1);
+    release(&ptable.lock);
+    return vm;
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Restrict process pid, or the caller if pid is 0, to the
+// CPUs in mask.  A process that is queued or running on a
+// CPU no longer in its mask moves at once.
+int
+setaffinity(int pid, uint mask)
+{
+  struct proc *p;
+  struct cpu *c;
+
+  mask &= (1 << ncpu) - 1;
+  if(mask == 0)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->pid == pid && p->state != UNUSED)
+      break;
+  if(p == &ptable.proc[NPROC]){
+    release(&ptable.lock);
+    return -1;
+  }
+  p->affinity = mask;
+  if(!(mask & (1 << p->cpu))){
+    if(p->state == RUNNABLE){
+      runqdel(p);
+      runqput(p, 0);
+    } else if(p->state == RUNNING && p != myproc()){
+      c = &cpus[p->cpu];
+      c->resched = 1;
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+    }
+  }
+  release(&ptable.lock);
+  if(p == myproc() && !(mask & (1 << p->cpu)))
+    yield();
+  return 0;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -531,4 +1185,8 @@ procdump(void)
     }
     cprintf("\n");
   }
+  lockstatdump();
+  idestatdump();
+  irqstatdump();
+  swapdump();
 }
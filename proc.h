@@ -1,3 +1,5 @@
+struct vmspace;
+
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -8,6 +10,14 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  uint64 quantum;              // nsec() when proc's time slice ends
+  uint64 tdeadline;            // Deadline the lapic timer is armed for, or 0
+  volatile int halted;         // Idle in hlt until an IPI?
+  volatile int resched;        // Should proc yield to a more urgent process?
+  struct vmspace *vm;          // Address space loaded in %cr3, or 0
+  volatile uint tlbreq;        // TLB flushes asked for by other CPUs
+  volatile uint tlbdone;       // Value of tlbreq at the last flush
+  uint nintr[NIOIRQ];          // Interrupts taken, by IRQ
 };
 
 extern struct cpu cpus[NCPU];
@@ -34,10 +44,26 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A range of user memory whose pages are read in from
+// a file when first touched (see pagefault() in vm.c), or
+// that holds a shared memory segment (see vmshmat()).
+struct vma {
+  uint start;                  // First address, page aligned
+  uint end;                    // Address after the last, page aligned
+  struct inode *ip;            // File to read from, or 0
+  struct shm *shm;             // Shared memory segment, or 0 (shm.h)
+  uint off;                    // File offset of start
+  uint filesz;                 // Bytes from the file; the rest is zeros
+  int flags;                   // VMA_WRITE, VMA_SHARED, VMA_TEXT
+};
+
+#define VMA_WRITE   0x1        // Pages are writable
+#define VMA_SHARED  0x2        // Writes go back to the file (mmap MAP_SHARED)
+#define VMA_TEXT    0x4        // A program loaded by exec; see textget()
+
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
-  pde_t* pgdir;                // Page table
+  struct vmspace *vm;          // Address space (vm.h)
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -46,9 +72,31 @@ struct proc {
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files, nofile slots (file.c)
+  int nofile;
+  uint fdmap[NOFILE/32];       // Bit set for each fd in use
+  uint fdfull;                 // Bit w set if fdmap[w] is all ones
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int cpu;                     // CPU whose run queue p goes on
+  uint affinity;               // Bit i set if p may run on CPU i
+  int class;                   // Scheduling class (sched.h)
+  int prio;                    // Real-time priority or nice value
+  int level;                   // Run-queue level p was last queued at
+  struct proc *rqnext;         // Next on run queue
+  struct proc *sqnext;         // Next on sleep chain
+  struct proc *kids;           // Children that have not exited
+  struct proc *zombies;        // Exited children not yet waited for
+  struct proc *sibnext;        // Next on parent's kids or zombies
+  struct proc **sibprev;       // Pointer that points at p on that list
+  void (*kfn)(void);           // Kernel thread's body, or 0
+  uint oplogs;                 // Logs the current FS call reserved space in
+  uint ustack;                 // Stack clone() was given, for join()
+  struct proc *pollnext;       // Next in poll()'s pollers list
+  int pollev;                  // pollwake() since last scan (poll.c)
+  uint scount[NSYSCALL];       // Calls of each system call
+  uint64 scycles[NSYSCALL];    // TSC cycles spent in each
+  struct file *ofile0[NOFILE0]; // ofile until it has to grow
 };
 
 // Process memory is laid out contiguously, low addresses first:
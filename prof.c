@@ -0,0 +1,125 @@
+// Sampling profiler.
+//
+// While profiling is on, each CPU's timer fires at least every
+// PROFNS (see timerarm()), and every timer interrupt records the
+// interrupted %eip, followed by its callers if it was in the
+// kernel, in the CPU's ring of samples.  Writing "1" to the
+// prof device (major PROF) clears the rings and starts
+// profiling, "0" stops it, and reading it drains the samples,
+// NPROFPC words each.  A full ring drops new samples.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPROFPC  4     // words per sample: %eip and three callers
+#define NPROFBUF 1024  // samples per CPU
+
+struct profbuf {
+  struct spinlock lock;
+  uint r;              // next sample to read
+  uint w;              // next sample to write
+  uint s[NPROFBUF][NPROFPC];
+};
+
+struct {
+  struct profbuf cpu[NCPU];
+} prof;
+
+volatile int profiling;
+
+// Record a sample of the interrupted code.
+// Called from trap() on timer interrupts.
+void
+profsample(struct trapframe *tf)
+{
+  struct profbuf *b;
+  uint pcs[10];
+  int i;
+
+  if(!profiling)
+    return;
+  memset(pcs, 0, sizeof(pcs));
+  if((tf->cs&3) == 0)
+    getcallerpcs((uint*)tf->ebp + 2, pcs);
+  b = &prof.cpu[cpuid()];
+  acquire(&b->lock);
+  if(b->w - b->r < NPROFBUF){
+    b->s[b->w % NPROFBUF][0] = tf->eip;
+    for(i = 1; i < NPROFPC; i++)
+      b->s[b->w % NPROFBUF][i] = pcs[i-1];
+    b->w++;
+  }
+  release(&b->lock);
+}
+
+static int
+profread(struct inode *ip, char *dst, int n)
+{
+  struct profbuf *b;
+  uint s[NPROFPC];
+  int c, tot, got;
+
+  iunlock(ip);
+  tot = 0;
+  for(c = 0; c < ncpu; c++){
+    b = &prof.cpu[c];
+    while(n - tot >= sizeof(s)){
+      acquire(&b->lock);
+      if((got = b->r != b->w) != 0)
+        memmove(s, b->s[b->r++ % NPROFBUF], sizeof(s));
+      release(&b->lock);
+      if(!got)
+        break;
+      if(umove(dst + tot, s, sizeof(s)) < 0){
+        ilock(ip);
+        return -1;
+      }
+      tot += sizeof(s);
+    }
+  }
+  ilock(ip);
+  return tot;
+}
+
+static int
+profwrite(struct inode *ip, char *buf, int n)
+{
+  int c;
+  char cmd;
+
+  if(n < 1)
+    return n;
+  if(umove(&cmd, buf, 1) < 0)
+    return -1;
+  if(cmd == '1'){
+    for(c = 0; c < ncpu; c++){
+      acquire(&prof.cpu[c].lock);
+      prof.cpu[c].r = prof.cpu[c].w = 0;
+      release(&prof.cpu[c].lock);
+    }
+    profiling = 1;
+    timerarm();
+  } else if(cmd == '0')
+    profiling = 0;
+  return n;
+}
+
+void
+profinit(void)
+{
+  int c;
+
+  for(c = 0; c < NCPU; c++)
+    initlock(&prof.cpu[c].lock, "prof");
+  devsw[PROF].read = profread;
+  devsw[PROF].write = profwrite;
+}
@@ -0,0 +1,108 @@
+// RAM disk: block device RAMDEV, kept in kalloc()ed pages and
+// formatted with an empty file system at boot, for scratch data
+// that need not survive a reboot.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define RAMSIZE   (2*BPB+1024)  // blocks: three bitmap groups
+#define RAMINODES 64
+#define BPP       (PGSIZE/BSIZE)
+
+static char *rampage[RAMSIZE/BPP];
+
+static uchar*
+ramblock(uint b)
+{
+  return (uchar*)rampage[b/BPP] + (b%BPP)*BSIZE;
+}
+
+// Lay out an empty file system the way mkfs does:
+// boot block, super block, log, inodes, bitmap, data,
+// with a root directory holding . and .. in the first data block.
+static void
+ramformat(void)
+{
+  struct superblock *sb;
+  struct dinode *dip;
+  struct dirent *de;
+  uchar *bitmap;
+  uint nmeta, b;
+
+  sb = (struct superblock*)ramblock(1);
+  sb->size = RAMSIZE;
+  sb->ninodes = RAMINODES;
+  sb->nlog = LOGSIZE;
+  sb->logstart = 2;
+  sb->inodestart = 2 + LOGSIZE;
+  sb->bmapstart = sb->inodestart + RAMINODES/IPB + 1;
+  nmeta = sb->bmapstart + RAMSIZE/BPB + 1;
+  sb->nblocks = RAMSIZE - nmeta;
+  sb->flags = SB_ORDERED;  // nothing here survives a crash anyway
+
+  dip = (struct dinode*)ramblock(IBLOCK(ROOTINO, (*sb))) + ROOTINO%IPB;
+  dip->type = T_DIR;
+  dip->nlink = 1;
+  dip->size = 2*sizeof(struct dirent);
+  dip->addrs[0] = nmeta;
+
+  de = (struct dirent*)ramblock(nmeta);
+  de[0].inum = de[1].inum = ROOTINO;
+  safestrcpy(de[0].name, ".", DIRSIZ);
+  safestrcpy(de[1].name, "..", DIRSIZ);
+
+  bitmap = ramblock(sb->bmapstart);
+  for(b = 0; b <= nmeta; b++)
+    bitmap[b/8] |= 1 << (b%8);
+}
+
+// Service the n bufs at once, as idesubmit() does for the disk.
+static void
+ramsubmit(struct buf **bs, int n)
+{
+  struct buf *b;
+
+  for(; n > 0; n--, bs++){
+    b = *bs;
+    if(!holdingsleep(&b->lock))
+      panic("ramsubmit: buf not locked");
+    if(b->blockno >= RAMSIZE)
+      panic("ramsubmit: block out of range");
+    if(b->flags & B_DIRTY){
+      b->flags &= ~B_DIRTY;
+      memmove(ramblock(b->blockno), b->data, BSIZE);
+    } else
+      memmove(b->data, ramblock(b->blockno), BSIZE);
+    b->flags |= B_VALID;
+    if(b->flags & B_ASYNC)
+      biodone(b);
+  }
+}
+
+static void
+ramwait(struct buf *b)
+{
+}
+
+// Allocate and format the RAM disk.  Must come after kinit2().
+void
+ramdiskinit(void)
+{
+  int i;
+
+  for(i = 0; i < NELEM(rampage); i++){
+    if((rampage[i] = kalloc()) == 0)
+      panic("ramdiskinit");
+    memset(rampage[i], 0, PGSIZE);
+  }
+  ramformat();
+  bdevsw[RAMDEV].submit = ramsubmit;
+  bdevsw[RAMDEV].wait = ramwait;
+}
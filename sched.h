@@ -0,0 +1,7 @@
+// Scheduling classes, for setprio().
+#define SCHED_NORMAL  0   // time-shared; boosted after sleeping
+#define SCHED_RT      1   // fixed priority, ahead of all other classes
+#define SCHED_BATCH   2   // runs only when nothing else is runnable
+
+#define NRTPRIO       3   // SCHED_RT priorities: 0 (highest) .. NRTPRIO-1
+#define NNICE         4   // SCHED_NORMAL nice values: 0 .. NNICE-1
@@ -1,6 +1,7 @@
 // Shell.
 
 #include "types.h"
+#include "stat.h"
 #include "user.h"
 #include "fcntl.h"
 
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 
 // Execute cmd.  Never returns.
 void
@@ -130,13 +132,109 @@ runcmd(struct cmd *cmd)
   exit();
 }
 
+// Can cmd be run with spawn() alone: a command
+// or pipeline of commands, perhaps redirected?
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    return 1;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// Start the spawnable cmd with fd[0..2] as its standard
+// input, output and error.  Returns the number of
+// processes started, for the caller to wait for.
+int
+spawncmd(struct cmd *cmd, int *fd)
+{
+  int p[2], nfd[3], n;
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  memmove(nfd, fd, sizeof(nfd));
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      return 0;
+    if(spawn(ecmd->argv[0], ecmd->argv, fd) < 0){
+      printf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if((nfd[rcmd->fd] = open(rcmd->file, rcmd->mode)) < 0){
+      printf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    n = spawncmd(rcmd->cmd, nfd);
+    close(nfd[rcmd->fd]);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0){
+      printf(2, "pipe failed\n");
+      return 0;
+    }
+    nfd[1] = p[1];
+    n = spawncmd(pcmd->left, nfd);
+    nfd[0] = p[0];
+    nfd[1] = fd[1];
+    n += spawncmd(pcmd->right, nfd);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  return 0;
+}
+
+// Read a line from fd 0.  readline() reads ahead, which is
+// fine for the console, where a read stops at the end of the
+// line anyway, but from a file or pipe it would take input
+// meant for the commands run; read those a byte at a time.
+int
+readcmd(char *buf, int nbuf)
+{
+  static int console = -1;
+  struct stat st;
+  int i;
+  char c;
+
+  if(console < 0)
+    console = fstat(0, &st) == 0 && st.type == T_DEV;
+  if(console)
+    return readline(0, buf, nbuf);
+  for(i = 0; i+1 < nbuf; ){
+    if(read(0, &c, 1) != 1)
+      break;
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = 0;
+  return i;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
   printf(2, "$ ");
   memset(buf, 0, nbuf);
-  gets(buf, nbuf);
-  if(buf[0] == 0) // EOF
+  if(readcmd(buf, nbuf) == 0) // EOF
     return -1;
   return 0;
 }
@@ -145,7 +243,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  int fd, std[3] = { 0, 1, 2 }, n;
+  struct cmd *cmd;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -164,9 +263,18 @@ main(void)
         printf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait();
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawnable(cmd)){
+      // The common case: no need for a copy of the shell.
+      for(n = spawncmd(cmd, std); n > 0; n--)
+        wait();
+    } else {
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait();
+    }
+    freecmd(cmd);
   }
   exit();
 }
@@ -319,6 +427,17 @@ peek(char **ps, char *es, char *toks)
   return *s && strchr(toks, *s);
 }
 
+// The first syntax error found by parsecmd(), or 0.
+// Parsing happens in the shell itself, which mustn't exit.
+char *syntaxerr;
+
+void
+syntax(char *msg)
+{
+  if(syntaxerr == 0)
+    syntaxerr = msg;
+}
+
 struct cmd *parseline(char**, char*);
 struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
@@ -331,11 +450,17 @@ parsecmd(char *s)
   struct cmd *cmd;
 
   es = s + strlen(s);
+  syntaxerr = 0;
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && syntaxerr == 0){
     printf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(syntaxerr){
+    printf(2, "%s\n", syntaxerr);
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -379,8 +504,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -405,8 +532,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -431,13 +560,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS - 1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -491,3 +624,41 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free cmd and everything it points to.
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
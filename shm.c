@@ -0,0 +1,112 @@
+// Shared memory segments.
+//
+// shmget(key, size) names a segment of zeroed pages, making it
+// the first time the key is used.  shmat() maps all of it into
+// the caller's address space, as a vma (see vmshmat() in vm.c);
+// fork() shares the mapping with the child rather than copying
+// it, and exit(), exec() and shmdt() remove it.  Each mapping
+// holds a reference on every page, and the segment holds one
+// more, so a page outlives whichever goes last.  The segment
+// is freed when its last attachment goes away.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "shm.h"
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shm");
+}
+
+// Find or make the segment named key, of at least size bytes.
+// Returns its id, or -1.
+int
+shmget(int key, uint size)
+{
+  struct shm *s, *free;
+  uint n;
+
+  n = PGROUNDUP(size) / PGSIZE;
+  if(key <= 0 || n == 0 || n > SHMPAGES)
+    return -1;
+  acquire(&shmtab.lock);
+  free = 0;
+  for(s = shmtab.shm; s < &shmtab.shm[NSHM]; s++){
+    if(s->key == key){
+      release(&shmtab.lock);
+      return s->npage >= n ? s - shmtab.shm : -1;
+    }
+    if(s->key == 0 && free == 0)
+      free = s;
+  }
+  if((s = free) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  for(s->npage = 0; s->npage < n; s->npage++){
+    if((s->page[s->npage] = kzalloc()) == 0){
+      while(s->npage > 0)
+        kfree(s->page[--s->npage]);
+      release(&shmtab.lock);
+      return -1;
+    }
+  }
+  s->key = key;
+  s->ref = 0;
+  release(&shmtab.lock);
+  return s - shmtab.shm;
+}
+
+// Map segment id into the current process.
+// Returns the address, or -1.
+int
+shmat(int id)
+{
+  struct shm *s;
+  int va;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  acquire(&shmtab.lock);
+  s = &shmtab.shm[id];
+  if(s->key == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  s->ref++;
+  release(&shmtab.lock);
+  if((va = vmshmat(myproc(), s)) < 0)
+    shmput(s);
+  return va;
+}
+
+// Take another reference to s, for a copied mapping.
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  s->ref++;
+  release(&shmtab.lock);
+}
+
+// Drop a reference to s, freeing it if it was the last.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  if(--s->ref == 0){
+    while(s->npage > 0)
+      kfree(s->page[--s->npage]);
+    s->key = 0;
+  }
+  release(&shmtab.lock);
+}
@@ -0,0 +1,8 @@
+// Shared memory segment, made by shmget() and
+// mapped into address spaces by shmat().
+struct shm {
+  int key;           // Name passed to shmget(); 0 if slot is free
+  int ref;           // Address spaces with it attached
+  uint npage;
+  char *page[SHMPAGES];
+};
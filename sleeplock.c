@@ -1,4 +1,14 @@
 // Sleeping locks
+//
+// A lock whose holder is running on another CPU will usually
+// be released soon: acquiresleep() spins for a while first, and
+// only sleeps if the holder is not running or takes too long.
+// releasesleep() calls wakeup() only if somebody is asleep.
+//
+// acquiresleepshared() takes the lock in shared mode: any number
+// of processes may hold it that way at once, but only while no
+// one holds it exclusively.  A process waiting for exclusive
+// mode holds off new shared holders, so it is not starved.
 
 #include "types.h"
 #include "defs.h"
@@ -10,6 +20,8 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 
+#define SPINTRIES 1000  // pause()s to wait for a running holder
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
@@ -17,27 +29,100 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->proc = 0;
+  lk->waiters = 0;
+  lk->readers = 0;
+  lk->wwait = 0;
+}
+
+// Is lk held by a process running on another CPU?
+// Only a hint; lk->lk is not held.
+static int
+holderrunning(struct sleeplock *lk)
+{
+  struct proc *p;
+
+  if(!*(volatile uint*)&lk->locked)
+    return 0;
+  p = *(struct proc *volatile*)&lk->proc;
+  return p != 0 && p != myproc() && p->state == RUNNING;
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  int i;
+
+  for(i = 0; i < SPINTRIES && holderrunning(lk); i++)
+    pause();
   acquire(&lk->lk);
-  while (lk->locked) {
+  while (lk->locked || lk->readers) {
+    lk->waiters++;
+    lk->wwait++;
     sleep(lk, &lk->lk);
+    lk->wwait--;
+    lk->waiters--;
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->proc = myproc();
+  release(&lk->lk);
+}
+
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  int i;
+
+  for(i = 0; i < SPINTRIES && holderrunning(lk); i++)
+    pause();
+  acquire(&lk->lk);
+  while (lk->locked || lk->wwait) {
+    lk->waiters++;
+    sleep(lk, &lk->lk);
+    lk->waiters--;
+  }
+  lk->readers++;
   release(&lk->lk);
 }
 
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  if(--lk->readers == 0 && lk->waiters)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk if it is free.  Returns 1 if it did, 0 if not.
+int
+tryacquiresleep(struct sleeplock *lk)
+{
+  int r;
+
+  acquire(&lk->lk);
+  r = !lk->locked && !lk->readers;
+  if(r){
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+    lk->proc = myproc();
+  }
+  release(&lk->lk);
+  return r;
+}
+
 void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  lk->proc = 0;
+  if(lk->waiters)
+    wakeup(lk);
   release(&lk->lk);
 }
 
@@ -2,6 +2,10 @@
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *proc; // Process holding lock, to spin while it runs
+  int waiters;       // Processes sleeping on the lock
+  int readers;       // Holders in shared mode
+  int wwait;         // Processes waiting for exclusive mode
   
   // For debugging:
   char *name;        // Name of lock.
@@ -8,13 +8,52 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "trace.h"
+
+#define NLOCKSTAT 32
+
+struct {
+  uint locked;
+  int n;
+  struct lockstat stat[NLOCKSTAT];
+} lockstats;
+
+// Find or make the counters for locks named name.
+// Returns 0 if the table is full.
+static struct lockstat*
+findstat(char *name)
+{
+  struct lockstat *ls;
+  int i;
+
+  pushcli();
+  while(xchg(&lockstats.locked, 1) != 0)
+    pause();
+  ls = 0;
+  for(i = 0; i < lockstats.n; i++){
+    if(strncmp(lockstats.stat[i].name, name, 16) == 0){
+      ls = &lockstats.stat[i];
+      break;
+    }
+  }
+  if(ls == 0 && lockstats.n < NLOCKSTAT){
+    ls = &lockstats.stat[lockstats.n++];
+    ls->name = name;
+  }
+  xchg(&lockstats.locked, 0);
+  popcli();
+  return ls;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->stat = findstat(name);
 }
 
 // Acquire the lock.
@@ -24,33 +63,69 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket, nspin;
+  uint64 t0;
+  struct cpu *c;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket; the fetch-and-add is atomic.
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  nspin = 0;
+  t0 = 0;
+  while(*(volatile uint*)&lk->owner != ticket){
+    if(nspin++ == 0 && tracing)
+      t0 = nsec();
+    pause();
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
   // references happen after the lock is acquired.
   __sync_synchronize();
+  lk->locked = 1;
 
   // Record info about lock acquisition for debugging.
-  lk->cpu = mycpu();
+  c = mycpu();
+  lk->cpu = c;
   getcallerpcs(&lk, lk->pcs);
+
+  // The counters are only touched by this CPU with
+  // interrupts off, so they need no lock of their own.
+  if(lk->stat){
+    lk->stat->cpu[c-cpus].nacquire++;
+    if(nspin){
+      lk->stat->cpu[c-cpus].ncontend++;
+      lk->stat->cpu[c-cpus].nspin += nspin;
+    }
+    lk->tacquire = rdtsc();
+  }
+  if(t0)
+    trace(TR_LOCK, (uint)lk, nsec() - t0, lk->name);
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  uint t;
+  struct cpu *c;
+
   if(!holding(lk))
     panic("release");
 
+  c = lk->cpu;
+  if(lk->stat){
+    t = rdtsc() - lk->tacquire;
+    if(t > lk->stat->cpu[c-cpus].maxhold)
+      lk->stat->cpu[c-cpus].maxhold = t;
+  }
+
   lk->pcs[0] = 0;
   lk->cpu = 0;
+  lk->locked = 0;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that all the stores in the critical
@@ -59,14 +134,40 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // Hand the lock to the next ticket, equivalent to lk->owner++.
+  // Only the holder writes owner, so a plain store is enough,
+  // but it must not be torn or reordered by the C compiler.
+  asm volatile("movl %1, %0" : "+m" (lk->owner) : "r" (lk->owner+1));
 
   popcli();
 }
 
+// Print the lock counters, summed over CPUs.
+// Runs when user types ^P on console.
+// No lock, to avoid wedging a stuck machine further.
+void
+lockstatdump(void)
+{
+  struct lockstat *ls;
+  uint nacq, ncont, nspin, maxhold;
+  int i;
+
+  for(ls = lockstats.stat; ls < &lockstats.stat[lockstats.n]; ls++){
+    nacq = ncont = nspin = maxhold = 0;
+    for(i = 0; i < ncpu; i++){
+      nacq += ls->cpu[i].nacquire;
+      ncont += ls->cpu[i].ncontend;
+      nspin += ls->cpu[i].nspin;
+      if(ls->cpu[i].maxhold > maxhold)
+        maxhold = ls->cpu[i].maxhold;
+    }
+    if(nacq == 0)
+      continue;
+    cprintf("%s: acquire %d contend %d spin %d maxhold %d\n",
+            ls->name, nacq, ncont, nspin, maxhold);
+  }
+}
+
 // Record the current call stack in pcs[] by following the %ebp chain.
 void
 getcallerpcs(void *v, uint pcs[])
@@ -1,11 +1,33 @@
 // Mutual exclusion lock.
+//
+// A ticket lock: acquire() takes the next ticket and waits for
+// owner to reach it, so CPUs get the lock in the order they asked.
+// Waiters only read owner while they spin, so the cache line stays
+// shared until release() bumps it.
 struct spinlock {
   uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket now holding the lock.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+
+  // For contention statistics:
+  struct lockstat *stat;  // Counters shared by locks of this name.
+  uint tacquire;          // rdtsc() when the lock was acquired.
 };
 
+// Per-name lock counters, kept per CPU so that
+// updating them never bounces a cache line.
+struct lockstat {
+  char *name;
+  struct {
+    uint nacquire;   // Acquisitions.
+    uint ncontend;   // Acquisitions that had to wait.
+    uint nspin;      // Spin iterations while waiting.
+    uint maxhold;    // Longest hold time, in TSC cycles.
+  } cpu[NCPU];
+};
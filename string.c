@@ -19,6 +19,10 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  // Skip equal words; the bytes decide at the first difference.
+  if(((uint)s1 | (uint)s2) % 4 == 0)
+    while(n >= 4 && *(uint*)s1 == *(uint*)s2)
+      s1 += 4, s2 += 4, n -= 4;
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -28,22 +32,31 @@ memcmp(const void *v1, const void *v2, uint n)
   return 0;
 }
 
+// Copy with the string instructions, a word at a time when
+// src and dst are equally aligned.  Copies downward when dst
+// overlaps the end of src.
 void*
 memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  uint m;
 
   s = src;
   d = dst;
   if(s < d && s + n > d){
-    s += n;
-    d += n;
-    while(n-- > 0)
-      *--d = *--s;
+    if(((uint)s | (uint)d | n) % 4 == 0)
+      rmovsl(d + n - 4, s + n - 4, n/4);
+    else
+      rmovsb(d + n - 1, s + n - 1, n);
+  } else if(((uint)s ^ (uint)d) % 4 == 0 && n >= 16){
+    m = -(uint)d % 4;  // bytes up to alignment
+    movsb(d, s, m);
+    movsl(d + m, s + m, (n - m)/4);
+    m += (n - m) & ~3;
+    movsb(d + m, s + m, n - m);
   } else
-    while(n-- > 0)
-      *d++ = *s++;
+    movsb(d, s, n);
 
   return dst;
 }
@@ -0,0 +1,257 @@
+// Paging user memory out to disk.
+//
+// When a user page cannot be allocated, or the pageout() system
+// call asks, swapout() writes other pages of user memory to the
+// swap area and frees them.  It
+// picks them with the clock algorithm: a hand sweeps over the
+// processes and their user pages, clearing PTE_A, and takes a
+// page whose PTE_A is still clear when the hand comes back.
+// Only pages with a single reference outside MAP_SHARED and
+// shared memory regions are taken, so each has one PTE.
+//
+// A paged-out page's PTE holds its swap slot in the address
+// bits and PTE_SWAP, with PTE_P clear and the other flags kept.
+// pagefault() reads it back with swapin() in vm.c.  fork() shares a
+// slot between parent and child until each has read it back,
+// so slots have reference counts.
+//
+// The swap area is SWAPBLOCKS blocks on disk SWAPDEV, starting
+// at SWAPSTART, past the kernel.  A page goes to disk with
+// vm->mlock held, which keeps swapin() from reading it early;
+// address spaces whose mlock is busy are passed over.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "vm.h"
+#include "swapstat.h"
+
+#define SPP    (PGSIZE/BSIZE)       // blocks per page
+#define NSLOT  (SWAPBLOCKS/SPP)
+
+struct {
+  struct spinlock lock;     // protects ref, next and the hand
+  int on;                   // is there a swap area?
+  uchar ref[NSLOT];         // PTEs holding each slot
+  int next;                 // where to look for a free slot
+  int hand;                 // clock hand: ptable slot
+  uint handva;              //   and user address
+  struct sleeplock iolock;  // serializes use of buf[]
+  struct buf buf[SPP];
+  int nout, nin;            // pages written, read back
+} swap;
+
+void
+swapinit(void)
+{
+  int i;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.iolock, "swapio");
+  for(i = 0; i < SPP; i++)
+    initsleeplock(&swap.buf[i].lock, "swapbuf");
+  swap.on = SWAPDEV < NBDEV && bdevsw[SWAPDEV].submit != 0;
+}
+
+// Allocate a slot with one reference, or return -1.
+static int
+slotalloc(void)
+{
+  int i, s;
+
+  acquire(&swap.lock);
+  for(i = 0; i < NSLOT; i++){
+    s = (swap.next + i) % NSLOT;
+    if(swap.ref[s] == 0){
+      swap.ref[s] = 1;
+      swap.next = s + 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Add a reference to the slot in swap PTE pte, for fork().
+// Returns -1 if it has too many.
+int
+swapdup(uint pte)
+{
+  uint s;
+  int r;
+
+  s = PTE_ADDR(pte) >> PTXSHIFT;
+  acquire(&swap.lock);
+  r = swap.ref[s] < 255 ? 0 : -1;
+  if(r == 0)
+    swap.ref[s]++;
+  release(&swap.lock);
+  return r;
+}
+
+// Drop the reference held by swap PTE pte.
+void
+swapfree(uint pte)
+{
+  uint s;
+
+  s = PTE_ADDR(pte) >> PTXSHIFT;
+  acquire(&swap.lock);
+  if(s >= NSLOT || swap.ref[s] == 0)
+    panic("swapfree");
+  swap.ref[s]--;
+  release(&swap.lock);
+}
+
+// Read or write page mem from slot s.
+// Caller must hold swap.iolock.
+static void
+slotio(int s, char *mem, int write)
+{
+  struct buf *bs[SPP];
+  int i;
+
+  for(i = 0; i < SPP; i++){
+    bs[i] = &swap.buf[i];
+    acquiresleep(&bs[i]->lock);
+    bs[i]->dev = SWAPDEV;
+    bs[i]->blockno = SWAPSTART + s*SPP + i;
+    bs[i]->flags = 0;
+    if(write){
+      memmove(bs[i]->data, mem + i*BSIZE, BSIZE);
+      bs[i]->flags = B_DIRTY;
+    }
+  }
+  bsubmit(bs, SPP);
+  for(i = 0; i < SPP; i++){
+    bwait(bs[i]);
+    if(!write)
+      memmove(mem + i*BSIZE, bs[i]->data, BSIZE);
+    releasesleep(&bs[i]->lock);
+  }
+}
+
+// Page out one page of vm that the hand reaches from *va.
+// Returns 1 if it did, with *va just past the page, 0 with *va
+// at KERNBASE once the hand has gone over all of vm, or -1 if
+// the swap area is full.  Caller holds vm->mlock and
+// swap.iolock.
+static int
+swapvm(struct vmspace *vm, uint *va)
+{
+  char *mem;
+  int s;
+
+  if((s = slotalloc()) < 0)
+    return -1;
+  if((mem = vmevict(vm, va, s)) == 0){
+    acquire(&swap.lock);
+    swap.ref[s] = 0;
+    release(&swap.lock);
+    return 0;
+  }
+  // No CPU may write to the page once it goes to disk.
+  tlbflush(vm);
+  slotio(s, mem, 1);
+  kfree(mem);
+  swap.nout++;
+  return 1;
+}
+
+// Page out up to n pages of user memory.  Returns the number
+// freed.  Must not be called with spinlocks held.
+int
+swapout(int n)
+{
+  struct vmspace *vm;
+  int i, h, done, sweeps, r;
+  uint va;
+
+  if(!swap.on)
+    return 0;
+  acquiresleep(&swap.iolock);
+  done = 0;
+  sweeps = 0;
+  // Two sweeps give every page its second chance.
+  while(done < n && sweeps <= 2){
+    acquire(&swap.lock);
+    i = h = swap.hand;
+    va = swap.handva;
+    release(&swap.lock);
+    if((vm = procvm(&i)) == 0){
+      i = 0;
+      va = 0;
+      sweeps++;
+    } else {
+      if(i != h)
+        va = 0;  // a new process
+      r = 0;
+      if(tryacquiresleep(&vm->mlock)){
+        while(done < n && (r = swapvm(vm, &va)) > 0)
+          done++;
+        releasesleep(&vm->mlock);
+      } else
+        va = KERNBASE;
+      vmput(vm);
+      if(r < 0)
+        break;  // swap area full
+      if(va >= KERNBASE){
+        i++;
+        va = 0;
+      }
+    }
+    acquire(&swap.lock);
+    swap.hand = i;
+    swap.handva = va;
+    release(&swap.lock);
+  }
+  releasesleep(&swap.iolock);
+  return done;
+}
+
+// Read the page held by swap PTE pte into mem.
+void
+swapread(uint pte, char *mem)
+{
+  acquiresleep(&swap.iolock);
+  slotio(PTE_ADDR(pte) >> PTXSHIFT, mem, 0);
+  swap.nin++;
+  releasesleep(&swap.iolock);
+}
+
+// Fill in *st with the swap area's usage.
+void
+swapstat(struct swapstat *st)
+{
+  int i;
+
+  acquire(&swap.lock);
+  st->used = 0;
+  for(i = 0; i < NSLOT; i++)
+    st->used += swap.ref[i] != 0;
+  st->nslot = swap.on ? NSLOT : 0;
+  st->nout = swap.nout;
+  st->nin = swap.nin;
+  release(&swap.lock);
+}
+
+// Print swap usage, for procdump().
+void
+swapdump(void)
+{
+  struct swapstat st;
+
+  if(!swap.on)
+    return;
+  swapstat(&st);
+  cprintf("swap: %d/%d pages used, %d out, %d in\n", st.used, st.nslot,
+          st.nout, st.nin);
+}
@@ -0,0 +1,8 @@
+// Swap area usage, for pageout().
+
+struct swapstat {
+  uint used;   // slots holding a page
+  uint nslot;  // slots in the swap area
+  uint nout;   // pages written since boot
+  uint nin;    // pages read back since boot
+};
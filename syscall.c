@@ -6,6 +6,7 @@
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
+#include "sysstat.h"
 
 // User code makes a system call with INT T_SYSCALL.
 // System call number in %eax.
@@ -13,16 +14,23 @@
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
 
+// Check that [addr, addr+size) is user memory of the current
+// process, either below its size or in an mmap region, and
+// fault its pages in, writable if the kernel is going to
+// write them.
+int
+userbuf(uint addr, int size, int write)
+{
+  if(size < 0 || addr >= KERNBASE || addr+size < addr || addr+size > KERNBASE)
+    return -1;
+  return uvmfaultin(myproc(), addr, size, write);
+}
+
 // Fetch the int at addr from the current process.
 int
 fetchint(uint addr, int *ip)
 {
-  struct proc *curproc = myproc();
-
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
-    return -1;
-  *ip = *(int*)(addr);
-  return 0;
+  return ucopyin(ip, addr, 4);
 }
 
 // Fetch the nul-terminated string at addr from the current process.
@@ -32,13 +40,14 @@ int
 fetchstr(uint addr, char **pp)
 {
   char *s, *ep;
-  struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if(addr >= KERNBASE)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
+  ep = (char*)KERNBASE;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && userbuf((uint)s, 1, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -54,21 +63,36 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
-int
-argptr(int n, char **pp, int size)
+// lies within the process address space, and fault its pages in,
+// since callers use it directly, perhaps holding locks that
+// paging in a file would need.
+static int
+argbuf(int n, char **pp, int size, int write)
 {
   int i;
-  struct proc *curproc = myproc();
- 
+
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(userbuf(i, size, write) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// A buffer the kernel only reads.
+int
+argptr(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 0);
+}
+
+// A buffer the kernel writes results into.
+int
+argptrw(int n, char **pp, int size)
+{
+  return argbuf(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 // (There is no shared writable memory, so the string can't change
@@ -103,6 +127,32 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_uptimens(void);
+extern int sys_setprio(void);
+extern int sys_setaffinity(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_fsync(void);
+extern int sys_mount(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_spawn(void);
+extern int sys_getstats(void);
+extern int sys_getdents(void);
+extern int sys_fstatat(void);
+extern int sys_poll(void);
+extern int sys_pipe2(void);
+extern int sys_irqaffinity(void);
+extern int sys_pageout(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -126,20 +176,102 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_uptimens] sys_uptimens,
+[SYS_setprio] sys_setprio,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_fsync]   sys_fsync,
+[SYS_mount]   sys_mount,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_spawn]   sys_spawn,
+[SYS_getstats] sys_getstats,
+[SYS_getdents] sys_getdents,
+[SYS_fstatat] sys_fstatat,
+[SYS_poll]    sys_poll,
+[SYS_pipe2]   sys_pipe2,
+[SYS_irqaffinity] sys_irqaffinity,
+[SYS_pageout] sys_pageout,
 };
 
+// Calls and cycles per system call, kept by each CPU
+// for itself and added up by getstats().
+static struct {
+  uint count[NSYSCALL];
+  uint64 cycles[NSYSCALL];
+} cpustat[NCPU];
+
 void
 syscall(void)
 {
-  int num;
+  int num, c;
+  uint64 t;
   struct proc *curproc = myproc();
 
   num = curproc->tf->eax;
-  if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+  if(num > 0 && num < NELEM(syscalls) && num < NSYSCALL && syscalls[num]) {
+    t = rdtsc();
     curproc->tf->eax = syscalls[num]();
+    t = rdtsc() - t;
+    curproc->scount[num]++;
+    curproc->scycles[num] += t;
+    pushcli();
+    c = cpuid();
+    cpustat[c].count[num]++;
+    cpustat[c].cycles[num] += t;
+    popcli();
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
     curproc->tf->eax = -1;
   }
 }
+
+// Called by sysentry in trapasm.S for a system call made with
+// sysenter.  The same as trap()'s T_SYSCALL case, without the
+// detour through the IDT and trap()'s dispatch.
+void
+fastsyscall(struct trapframe *tf)
+{
+  struct proc *curproc = myproc();
+
+  if(curproc->killed)
+    exit();
+  curproc->tf = tf;
+  syscall();
+  if(curproc->killed)
+    exit();
+}
+
+// Fill in kernel buffer st[0..n-1] with the calls and cycles of each system
+// call made by process pid, or by everyone if pid is 0.
+// Returns the number filled in, or -1 if there is no such process.
+int
+getstats(int pid, struct sysstat *st, int n)
+{
+  int i, c;
+
+  if(n > NSYSCALL)
+    n = NSYSCALL;
+  if(pid != 0)
+    return procstats(pid, st, n);
+  for(i = 0; i < n; i++){
+    st[i].count = 0;
+    st[i].cycles = 0;
+    for(c = 0; c < ncpu; c++){
+      st[i].count += cpustat[c].count[i];
+      st[i].cycles += cpustat[c].cycles[i];
+    }
+  }
+  return n;
+}
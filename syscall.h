@@ -20,3 +20,29 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_uptimens 22
+#define SYS_setprio 23
+#define SYS_setaffinity 24
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_readv  27
+#define SYS_writev 28
+#define SYS_pread  29
+#define SYS_pwrite 30
+#define SYS_fsync  31
+#define SYS_mount  32
+#define SYS_clone  33
+#define SYS_join   34
+#define SYS_futex_wait 35
+#define SYS_futex_wake 36
+#define SYS_shmget 37
+#define SYS_shmat  38
+#define SYS_shmdt  39
+#define SYS_spawn  40
+#define SYS_getstats 41
+#define SYS_getdents 42
+#define SYS_fstatat 43
+#define SYS_poll   44
+#define SYS_pipe2  45
+#define SYS_irqaffinity 46
+#define SYS_pageout 47
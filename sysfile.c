@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "uio.h"
+#include "poll.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -26,7 +28,7 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f = fdget(fd)) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -35,23 +37,6 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
-static int
-fdalloc(struct file *f)
-{
-  int fd;
-  struct proc *curproc = myproc();
-
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
-}
-
 int
 sys_dup(void)
 {
@@ -73,7 +58,7 @@ sys_read(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptrw(1, &p, n) < 0)
     return -1;
   return fileread(f, p, n);
 }
@@ -90,6 +75,121 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Fetch the nth system call argument as an array of cnt
+// iovecs, copy it into iov, and check each buffer, for
+// writing if the call will write into them.
+static int
+argiov(int n, struct iovec *iov, int cnt, int write)
+{
+  char *p;
+  int i;
+
+  if(cnt < 0 || cnt > IOV_MAX ||
+     argptr(n, &p, cnt*sizeof(struct iovec)) < 0)
+    return -1;
+  memmove(iov, p, cnt*sizeof(struct iovec));
+  for(i = 0; i < cnt; i++)
+    if(userbuf((uint)iov[i].base, iov[i].len, write) < 0)
+      return -1;
+  return 0;
+}
+
+int
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, iov, cnt, 1) < 0)
+    return -1;
+  return filereadv(f, iov, cnt, -1);
+}
+
+int
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, iov, cnt, 0) < 0)
+    return -1;
+  return filewritev(f, iov, cnt, -1);
+}
+
+int
+sys_pread(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int off;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &iov.len) < 0 ||
+     argptrw(1, (char**)&iov.base, iov.len) < 0 || argint(3, &off) < 0 || off < 0)
+    return -1;
+  return filereadv(f, &iov, 1, off);
+}
+
+int
+sys_pwrite(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int off;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &iov.len) < 0 ||
+     argptr(1, (char**)&iov.base, iov.len) < 0 || argint(3, &off) < 0 || off < 0)
+    return -1;
+  return filewritev(f, &iov, 1, off);
+}
+
+// Make f's data, and every finished FS call, durable.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_INODE)
+    iflushall(f->ip);
+  log_sync();
+  return 0;
+}
+
+// Mount block device dev's file system on directory path.
+int
+sys_mount(void)
+{
+  char *path;
+  int dev;
+  struct inode *ip;
+
+  if(argstr(0, &path) < 0 || argint(1, &dev) < 0 || dev < 0)
+    return -1;
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  if(ip->type != T_DIR){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+  iunlock(ip);
+  end_op();
+  if(mount(ip, dev) < 0){
+    begin_op();
+    iput(ip);
+    end_op();
+    return -1;
+  }
+  return 0;
+}
+
 int
 sys_close(void)
 {
@@ -98,7 +198,7 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  fdremove(fd);
   fileclose(f);
   return 0;
 }
@@ -109,11 +209,64 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argptrw(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
 
+// Read the in-use entries of directory fd into buf, as many as
+// fit in n bytes.  Returns the number of bytes filled, 0 at the
+// end of the directory.
+int
+sys_getdents(void)
+{
+  struct file *f;
+  struct dirent *de;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || n < 0 ||
+     argptrw(1, (void*)&de, n) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  ilock(f->ip);
+  if(f->ip->type != T_DIR){
+    iunlock(f->ip);
+    return -1;
+  }
+  n = dirread(f->ip, &f->off, de, n / sizeof(*de));
+  iunlock(f->ip);
+  return n < 0 ? -1 : n * sizeof(*de);
+}
+
+// Stat path, looked up relative to directory fd instead of
+// the current directory, without opening it.
+int
+sys_fstatat(void)
+{
+  struct file *f;
+  struct inode *ip;
+  struct stat *st;
+  char *path;
+
+  if(argfd(0, 0, &f) < 0 || argstr(1, &path) < 0 ||
+     argptrw(2, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  begin_op();
+  if((ip = nameiat(f->ip, path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilockshared(ip);
+  stati(ip, st);
+  iunlockshared(ip);
+  iput(ip);
+  end_op();
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -171,10 +324,10 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -218,6 +371,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheforget(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -265,6 +419,11 @@ create(char *path, short type, short major, short minor)
   ip->major = major;
   ip->minor = minor;
   ip->nlink = 1;
+  if(type == T_DIR && dp->major == DIRHASHED){
+    // Directories made in a hashed directory are hashed too.
+    ip->major = DIRHASHED;
+    ip->size = NDIRHASH*BSIZE;
+  }
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
@@ -308,7 +467,7 @@ sys_open(void)
       return -1;
     }
     ilock(ip);
-    if(ip->type == T_DIR && omode != O_RDONLY){
+    if(ip->type == T_DIR && (omode & (O_WRONLY|O_RDWR))){
       iunlockput(ip);
       end_op();
       return -1;
@@ -330,6 +489,7 @@ sys_open(void)
   f->off = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->nonblock = (omode & O_NONBLOCK) != 0;
   return fd;
 }
 
@@ -394,19 +554,20 @@ sys_chdir(void)
   return 0;
 }
 
-int
-sys_exec(void)
+// Fetch the path and argument vector that are system call
+// arguments 0 and 1 of exec and spawn.
+static int
+argexec(char **path, char **argv)
 {
-  char *path, *argv[MAXARG];
   int i;
   uint uargv, uarg;
 
-  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+  if(argstr(0, path) < 0 || argint(1, (int*)&uargv) < 0){
     return -1;
   }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv))
+    if(i >= MAXARG)
       return -1;
     if(fetchint(uargv+4*i, (int*)&uarg) < 0)
       return -1;
@@ -417,24 +578,60 @@ sys_exec(void)
     if(fetchstr(uarg, &argv[i]) < 0)
       return -1;
   }
+  return 0;
+}
+
+int
+sys_exec(void)
+{
+  char *path, *argv[MAXARG];
+
+  if(argexec(&path, argv) < 0)
+    return -1;
   return exec(path, argv);
 }
 
+// spawn(path, argv, fd): start path in a new child process.
+// If fd is not null, the child gets only fd[0], fd[1] and
+// fd[2] as its descriptors 0 to 2, where -1 leaves one closed;
+// otherwise it gets all of the caller's.
 int
-sys_pipe(void)
+sys_spawn(void)
+{
+  char *path, *argv[MAXARG];
+  struct file *ofile[3];
+  int *fd, ufd, i;
+
+  if(argexec(&path, argv) < 0 || argint(2, &ufd) < 0)
+    return -1;
+  if(ufd == 0)
+    return spawn(path, argv, 0);
+  if(argptr(2, (void*)&fd, 3*sizeof(fd[0])) < 0)
+    return -1;
+  for(i = 0; i < 3; i++){
+    if(fd[i] == -1)
+      ofile[i] = 0;
+    else if((ofile[i] = fdget(fd[i])) == 0)
+      return -1;
+  }
+  return spawn(path, argv, ofile);
+}
+
+// Make a pipe and put its read and write fds in fd[0] and
+// fd[1].  flags may hold O_NONBLOCK.
+static int
+pipefds(int *fd, int flags)
 {
-  int *fd;
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
-    return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
+  rf->nonblock = wf->nonblock = (flags & O_NONBLOCK) != 0;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
+      fdremove(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -443,3 +640,70 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+int
+sys_pipe(void)
+{
+  int *fd;
+
+  if(argptrw(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+    return -1;
+  return pipefds(fd, 0);
+}
+
+int
+sys_pipe2(void)
+{
+  int *fd, flags;
+
+  if(argptrw(0, (void*)&fd, 2*sizeof(fd[0])) < 0 || argint(1, &flags) < 0)
+    return -1;
+  return pipefds(fd, flags);
+}
+
+int
+sys_poll(void)
+{
+  struct pollfd *fds;
+  int n, ms;
+
+  if(argint(1, &n) < 0 || n < 0 || n > NOFILE ||
+     argptrw(0, (void*)&fds, n*sizeof(*fds)) < 0 || argint(2, &ms) < 0)
+    return -1;
+  return poll(fds, n, ms);
+}
+
+int
+sys_mmap(void)
+{
+  int n, prot, flags, off, vflags;
+  struct file *f;
+
+  if(argint(1, &n) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0 ||
+     argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable || n <= 0 || off < 0 || off % PGSIZE)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) != MAP_SHARED &&
+     (flags & (MAP_SHARED|MAP_PRIVATE)) != MAP_PRIVATE)
+    return -1;
+  vflags = 0;
+  if(prot & PROT_WRITE)
+    vflags |= VMA_WRITE;
+  if(flags & MAP_SHARED){
+    if((prot & PROT_WRITE) && !f->writable)
+      return -1;
+    vflags |= VMA_SHARED;
+  }
+  return vmamap(myproc(), f->ip, off, n, vflags);
+}
+
+int
+sys_munmap(void)
+{
+  int addr, n;
+
+  if(argint(0, &addr) < 0 || argint(1, &n) < 0 || n <= 0)
+    return -1;
+  return vmaunmap(myproc(), addr, n);
+}
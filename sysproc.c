@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "sysstat.h"
+#include "swapstat.h"
 
 int
 sys_fork(void)
@@ -50,8 +52,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if((addr = growproc(n)) < 0)
     return -1;
   return addr;
 }
@@ -60,32 +61,186 @@ int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
+  uint64 when;
 
   if(argint(0, &n) < 0)
     return -1;
+  if(n <= 0)
+    return 0;
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  when = nsec() + (uint64)n * TICKNS;
+  timeradd(when, myproc());
+  while(nsec() < when){
     if(myproc()->killed){
+      timerdel(myproc());
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleep(myproc(), &tickslock);
   }
   release(&tickslock);
   return 0;
 }
 
-// return how many clock tick interrupts have occurred
+int
+sys_clone(void)
+{
+  int fn, arg, stack;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg) < 0 || argint(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+int
+sys_join(void)
+{
+  uint *ustack, s;
+  int pid;
+
+  if(argptrw(0, (void*)&ustack, sizeof(*ustack)) < 0)
+    return -1;
+  if((pid = join(&s)) >= 0)
+    *ustack = s;
+  return pid;
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait(addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return futexwake(addr);
+}
+
+int
+sys_shmget(void)
+{
+  int key, size;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmget(key, size);
+}
+
+int
+sys_shmat(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmat(id);
+}
+
+int
+sys_shmdt(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return vmshmdt(myproc(), addr);
+}
+
+int
+sys_getstats(void)
+{
+  struct sysstat st[NSYSCALL], *ust;
+  int pid, n;
+
+  if(argint(0, &pid) < 0 || argint(2, &n) < 0 || n < 0)
+    return -1;
+  if(n > NSYSCALL)
+    n = NSYSCALL;
+  if(argptrw(1, (void*)&ust, n*sizeof(*ust)) < 0)
+    return -1;
+  if((n = getstats(pid, st, n)) > 0 &&
+     ucopyout((uint)ust, st, n*sizeof(*ust)) < 0)
+    return -1;
+  return n;
+}
+
+int
+sys_setprio(void)
+{
+  int pid, class, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &class) < 0 || argint(2, &prio) < 0)
+    return -1;
+  return setprio(pid, class, prio);
+}
+
+int
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+// Pin a device interrupt to a CPU, or with cpu -1 let
+// its driver move it.
+int
+sys_irqaffinity(void)
+{
+  int irq, cpu;
+
+  if(argint(0, &irq) < 0 || argint(1, &cpu) < 0)
+    return -1;
+  return irqaffinity(irq, cpu);
+}
+
+// Page out up to n pages of user memory now, rather than when
+// memory runs out, and report the swap area's usage in *st.
+// Returns the number of pages paged out.  Lets tests exercise
+// swapping without filling memory first.
+int
+sys_pageout(void)
+{
+  struct swapstat st, *ust;
+  int n;
+
+  if(argint(0, &n) < 0 || n < 0 ||
+     argptrw(1, (void*)&ust, sizeof(*ust)) < 0)
+    return -1;
+  n = swapout(n);
+  swapstat(&st);
+  if(ucopyout((uint)ust, &st, sizeof(st)) < 0)
+    return -1;
+  return n;
+}
+
+// return how many clock ticks have passed
 // since start.
 int
 sys_uptime(void)
 {
-  uint xticks;
+  return udiv64(nsec(), TICKNS);
+}
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+// return the time since start in nanoseconds.
+int
+sys_uptimens(void)
+{
+  uint64 *ns;
+
+  if(argptrw(0, (void*)&ns, sizeof(*ns)) < 0)
+    return -1;
+  *ns = nsec();
+  return 0;
 }
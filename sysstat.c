@@ -0,0 +1,103 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "syscall.h"
+#include "sysstat.h"
+
+// Print system call counts and TSC cycles spent:
+//   sysstat               totals since boot
+//   sysstat -p pid        one process's
+//   sysstat command...    everyone's while command runs
+
+char *names[NSYSCALL] = {
+[SYS_fork]    "fork",
+[SYS_exit]    "exit",
+[SYS_wait]    "wait",
+[SYS_pipe]    "pipe",
+[SYS_read]    "read",
+[SYS_kill]    "kill",
+[SYS_exec]    "exec",
+[SYS_fstat]   "fstat",
+[SYS_chdir]   "chdir",
+[SYS_dup]     "dup",
+[SYS_getpid]  "getpid",
+[SYS_sbrk]    "sbrk",
+[SYS_sleep]   "sleep",
+[SYS_uptime]  "uptime",
+[SYS_open]    "open",
+[SYS_write]   "write",
+[SYS_mknod]   "mknod",
+[SYS_unlink]  "unlink",
+[SYS_link]    "link",
+[SYS_mkdir]   "mkdir",
+[SYS_close]   "close",
+[SYS_uptimens] "uptimens",
+[SYS_setprio] "setprio",
+[SYS_setaffinity] "setaffinity",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
+[SYS_readv]   "readv",
+[SYS_writev]  "writev",
+[SYS_pread]   "pread",
+[SYS_pwrite]  "pwrite",
+[SYS_fsync]   "fsync",
+[SYS_mount]   "mount",
+[SYS_clone]   "clone",
+[SYS_join]    "join",
+[SYS_futex_wait] "futex_wait",
+[SYS_futex_wake] "futex_wake",
+[SYS_shmget]  "shmget",
+[SYS_shmat]   "shmat",
+[SYS_shmdt]   "shmdt",
+[SYS_spawn]   "spawn",
+[SYS_getstats] "getstats",
+[SYS_getdents] "getdents",
+[SYS_fstatat] "fstatat",
+[SYS_poll]    "poll",
+[SYS_pipe2]   "pipe2",
+[SYS_irqaffinity] "irqaffinity",
+[SYS_pageout] "pageout",
+};
+
+struct sysstat before[NSYSCALL], after[NSYSCALL];
+
+void
+print(struct sysstat *st, struct sysstat *base)
+{
+  uint64 cycles;
+  uint count;
+  int i;
+
+  printf(1, "syscall calls kcycles avg\n");
+  for(i = 1; i < NSYSCALL; i++){
+    count = st[i].count - base[i].count;
+    cycles = st[i].cycles - base[i].cycles;
+    if(count == 0)
+      continue;
+    printf(1, "%s %d %d %d\n", names[i] ? names[i] : "?", count,
+           (uint)(cycles >> 10), (uint)udiv64(cycles, count));
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc == 3 && strcmp(argv[1], "-p") == 0){
+    if(getstats(atoi(argv[2]), after, NSYSCALL) < 0){
+      printf(2, "sysstat: no process %s\n", argv[2]);
+      exit();
+    }
+  } else if(argc > 1){
+    getstats(0, before, NSYSCALL);
+    if(spawn(argv[1], argv + 1, 0) < 0){
+      printf(2, "sysstat: exec %s failed\n", argv[1]);
+      exit();
+    }
+    wait();
+    getstats(0, after, NSYSCALL);
+  } else
+    getstats(0, after, NSYSCALL);
+  print(after, before);
+  exit();
+}
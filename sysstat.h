@@ -0,0 +1,6 @@
+// System call accounting, for getstats().
+
+struct sysstat {
+  uint count;      // calls made
+  uint64 cycles;   // TSC cycles from entry to return
+};
@@ -0,0 +1,12 @@
+// The clock page, mapped read-only at TIMEPAGE in every address
+// space so that user code can tell the time without a system
+// call: nanoseconds since boot are
+//   ((rdtsc() - tscbase) * tscmult) >> 24.
+// The kernel makes seq odd while it changes the other fields;
+// a reader retries until it sees the same even seq before and
+// after reading them.  seq is 0 until the clock is calibrated.
+struct timepage {
+  volatile uint seq;
+  uint tscmult;         // nanoseconds per TSC cycle, times 2^24
+  uint64 tscbase;       // rdtsc() at time 0
+};
@@ -0,0 +1,162 @@
+// Timer deadlines.
+//
+// Each CPU's lapic timer runs in one-shot mode.  timerarm()
+// points it at the earlier of the end of the running process's
+// time slice and the first deadline in timers.heap, a min-heap
+// of wake-up times for processes in sys_sleep.  An idle CPU
+// with no deadline pending takes no timer interrupts at all.
+//
+// timers.lock is taken last: nothing else is acquired while
+// holding it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define NTIMER NPROC
+
+struct timer {
+  uint64 when;
+  void *chan;
+};
+
+struct {
+  struct spinlock lock;
+  int n;
+  struct timer heap[NTIMER];
+} timers;
+
+void
+timerinit(void)
+{
+  initlock(&timers.lock, "timers");
+}
+
+static void
+swap(int i, int j)
+{
+  struct timer t;
+
+  t = timers.heap[i];
+  timers.heap[i] = timers.heap[j];
+  timers.heap[j] = t;
+}
+
+// Restore the heap order around slot i.
+static void
+fix(int i)
+{
+  struct timer *h;
+  int c;
+
+  h = timers.heap;
+  while(i > 0 && h[i].when < h[(i-1)/2].when){
+    swap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+  for(;;){
+    c = 2*i + 1;
+    if(c >= timers.n)
+      break;
+    if(c+1 < timers.n && h[c+1].when < h[c].when)
+      c++;
+    if(h[i].when <= h[c].when)
+      break;
+    swap(i, c);
+    i = c;
+  }
+}
+
+// Remove slot i.  Caller must hold timers.lock.
+static void
+heapdel(int i)
+{
+  timers.n--;
+  if(i < timers.n){
+    timers.heap[i] = timers.heap[timers.n];
+    fix(i);
+  }
+}
+
+// Point this CPU's timer at its next deadline.
+void
+timerarm(void)
+{
+  struct cpu *c;
+  uint64 when;
+
+  pushcli();
+  c = mycpu();
+  when = c->proc ? c->quantum : 0;
+  if(profiling && (when == 0 || when > nsec() + PROFNS))
+    when = nsec() + PROFNS;
+  acquire(&timers.lock);
+  if(timers.n > 0 && (when == 0 || timers.heap[0].when < when))
+    when = timers.heap[0].when;
+  release(&timers.lock);
+  if(when != c->tdeadline){
+    c->tdeadline = when;
+    lapiconeshot(when);
+  }
+  popcli();
+}
+
+// Wake up chan, with tickslock held, once nsec() reaches when.
+void
+timeradd(uint64 when, void *chan)
+{
+  int i;
+
+  acquire(&timers.lock);
+  if(timers.n == NTIMER)
+    panic("timeradd");
+  i = timers.n++;
+  timers.heap[i].when = when;
+  timers.heap[i].chan = chan;
+  fix(i);
+  release(&timers.lock);
+  timerarm();
+}
+
+// Cancel any pending deadlines for chan.
+void
+timerdel(void *chan)
+{
+  int i;
+
+  acquire(&timers.lock);
+  for(i = timers.n - 1; i >= 0; i--)
+    if(timers.heap[i].chan == chan)
+      heapdel(i);
+  release(&timers.lock);
+}
+
+// Timer interrupt: wake up whoever has reached their
+// deadline, then re-arm for the next one.
+void
+timerintr(void)
+{
+  void *chan[8];
+  uint64 now;
+  int i, n;
+
+  mycpu()->tdeadline = 0;  // one-shot; it has fired
+  do {
+    n = 0;
+    acquire(&timers.lock);
+    now = nsec();
+    while(n < NELEM(chan) && timers.n > 0 && timers.heap[0].when <= now){
+      chan[n++] = timers.heap[0].chan;
+      heapdel(0);
+    }
+    release(&timers.lock);
+    acquire(&tickslock);
+    for(i = 0; i < n; i++)
+      wakeup(chan[i]);
+    release(&tickslock);
+  } while(n == NELEM(chan));
+  timerarm();
+}
@@ -0,0 +1,110 @@
+// Kernel event tracing.
+//
+// While tracing is on, trace() appends timestamped events from
+// the scheduler, sleep and wakeup, the disk driver, the log and
+// contended spinlocks to a per-CPU ring, overwriting the oldest
+// once it fills.  Each CPU writes only its own ring, with
+// interrupts off, so trace() takes no lock and may be called
+// from acquire().  Writing "1" to the trace device (major TRACE)
+// clears the rings and starts tracing, "0" stops it, and reading
+// returns the events recorded, as struct traceev, one CPU after
+// another.  Read only after stopping: the rings do not stand
+// still for the reader otherwise.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "trace.h"
+
+#define NTRACE 1024   // events per CPU
+
+struct tracebuf {
+  uint r;              // next event to read
+  uint w;              // next event to write
+  struct traceev ev[NTRACE];
+};
+
+struct tracebuf tracebuf[NCPU];
+volatile int tracing;
+
+void
+trace(int type, uint arg, uint arg2, char *name)
+{
+  struct tracebuf *b;
+  struct traceev *e;
+  struct cpu *c;
+  int i;
+
+  if(!tracing)
+    return;
+  pushcli();
+  c = mycpu();
+  b = &tracebuf[c - cpus];
+  e = &b->ev[b->w++ % NTRACE];
+  e->ts = nsec();
+  e->type = type;
+  e->cpu = c - cpus;
+  e->pid = c->proc ? c->proc->pid : 0;
+  e->arg = arg;
+  e->arg2 = arg2;
+  for(i = 0; i < sizeof(e->name); i++)
+    e->name[i] = (name && *name) ? *name++ : 0;
+  popcli();
+}
+
+static int
+traceread(struct inode *ip, char *dst, int n)
+{
+  struct tracebuf *b;
+  int c, tot;
+
+  iunlock(ip);
+  tot = 0;
+  for(c = 0; c < ncpu; c++){
+    b = &tracebuf[c];
+    if(b->w - b->r > NTRACE)
+      b->r = b->w - NTRACE;
+    for(; b->r != b->w && n - tot >= sizeof(struct traceev); b->r++){
+      if(umove(dst + tot, &b->ev[b->r % NTRACE], sizeof(struct traceev)) < 0){
+        ilock(ip);
+        return -1;
+      }
+      tot += sizeof(struct traceev);
+    }
+  }
+  ilock(ip);
+  return tot;
+}
+
+static int
+tracewrite(struct inode *ip, char *buf, int n)
+{
+  int c;
+  char cmd;
+
+  if(n < 1)
+    return n;
+  if(umove(&cmd, buf, 1) < 0)
+    return -1;
+  if(cmd == '1'){
+    tracing = 0;
+    for(c = 0; c < NCPU; c++)
+      tracebuf[c].r = tracebuf[c].w = 0;
+    tracing = 1;
+  } else if(cmd == '0')
+    tracing = 0;
+  return n;
+}
+
+void
+traceinit(void)
+{
+  devsw[TRACE].read = traceread;
+  devsw[TRACE].write = tracewrite;
+}
@@ -0,0 +1,21 @@
+// Kernel trace events, read from the trace device.
+
+#define TR_SWITCH   1   // scheduler runs pid; name is its name
+#define TR_YIELD    2   // pid gives up the CPU; arg is its new state
+#define TR_SLEEP    3   // pid sleeps on chan arg
+#define TR_WAKEUP   4   // wakeup of chan arg
+#define TR_DISKSTART 5  // disk request for arg2 blocks from block arg
+#define TR_DISKDONE 6   // that request has finished
+#define TR_COMMIT   7   // log commit on device arg starts
+#define TR_COMMITDONE 8 // and finishes
+#define TR_LOCK     9   // acquire of lock arg spun arg2 ns first
+
+struct traceev {
+  uint64 ts;       // nsec() when it happened
+  ushort type;     // TR_*
+  ushort cpu;
+  int pid;         // process running on cpu, or 0
+  uint arg;
+  uint arg2;
+  char name[8];    // process or lock name, maybe not terminated
+};
@@ -0,0 +1,124 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "trace.h"
+
+// Trace the kernel while a command runs, or print what
+// the trace device holds now, in the Chrome trace event
+// format (load the output in chrome://tracing):
+//   tracedump [command args...] > file
+// Each CPU is a thread of one process; disk requests and
+// log commits are asynchronous events.
+
+#define NEV (8*1024)  // NCPU rings of NTRACE
+
+struct traceev ev[NEV];
+int nev;
+int first = 1;
+
+// Print ns nanoseconds as microseconds, as Chrome wants.
+void
+printus(uint64 ns)
+{
+  char buf[24];
+  uint64 q;
+  int i;
+
+  i = sizeof(buf);
+  buf[--i] = 0;
+  do {
+    if(i == sizeof(buf) - 4)
+      buf[--i] = '.';
+    q = udiv64(ns, 10);
+    buf[--i] = '0' + (uint)(ns - q*10);
+    ns = q;
+  } while(ns != 0 || i > sizeof(buf) - 6);
+  printf(1, "%s", buf + i);
+}
+
+void
+begin(char *name, char *ph, struct traceev *e, uint64 t0)
+{
+  printf(1, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":0,\"tid\":%d,\"ts\":",
+         first ? "[\n" : ",\n", name, ph, e->cpu);
+  printus(e->ts - t0);
+  first = 0;
+}
+
+void
+print(struct traceev *e, uint64 t0)
+{
+  char name[sizeof(e->name)+1];
+
+  memmove(name, e->name, sizeof(e->name));
+  name[sizeof(e->name)] = 0;
+  switch(e->type){
+  case TR_SWITCH:
+    begin(name, "B", e, t0);
+    printf(1, ",\"args\":{\"pid\":%d}}", e->arg);
+    break;
+  case TR_YIELD:
+    begin("", "E", e, t0);
+    printf(1, ",\"args\":{\"state\":%d}}", e->arg);
+    break;
+  case TR_SLEEP:
+  case TR_WAKEUP:
+    begin(e->type == TR_SLEEP ? "sleep" : "wakeup", "i", e, t0);
+    printf(1, ",\"s\":\"t\",\"args\":{\"pid\":%d,\"chan\":\"0x%x\"}}",
+           e->pid, e->arg);
+    break;
+  case TR_DISKSTART:
+  case TR_DISKDONE:
+    begin("disk", e->type == TR_DISKSTART ? "b" : "e", e, t0);
+    printf(1, ",\"cat\":\"io\",\"id\":%d,\"args\":{\"blocks\":%d}}",
+           e->arg, e->arg2);
+    break;
+  case TR_COMMIT:
+  case TR_COMMITDONE:
+    begin("commit", e->type == TR_COMMIT ? "b" : "e", e, t0);
+    printf(1, ",\"cat\":\"log\",\"id\":%d}", e->arg);
+    break;
+  case TR_LOCK:
+    // A complete event covering the spin.
+    e->ts -= e->arg2;
+    begin(name, "X", e, t0);
+    printf(1, ",\"dur\":");
+    printus(e->arg2);
+    printf(1, ",\"cat\":\"lock\",\"args\":{\"pid\":%d,\"lock\":\"0x%x\"}}",
+           e->pid, e->arg);
+    break;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 t0;
+  int fd, n, i;
+
+  if((fd = open("trace", O_RDWR)) < 0){
+    printf(2, "tracedump: cannot open trace\n");
+    exit();
+  }
+  if(argc > 1){
+    write(fd, "1", 1);
+    if(spawn(argv[1], argv + 1, 0) < 0)
+      printf(2, "tracedump: exec %s failed\n", argv[1]);
+    else
+      wait();
+  }
+  write(fd, "0", 1);
+  while(nev < NEV && (n = read(fd, &ev[nev], (NEV - nev) * sizeof(ev[0]))) > 0)
+    nev += n / sizeof(ev[0]);
+  close(fd);
+
+  t0 = 0;
+  for(i = 0; i < nev; i++)
+    if(i == 0 || ev[i].ts < t0)
+      t0 = ev[i].ts;
+  for(i = 0; i < nev; i++)
+    print(&ev[i], t0);
+  printf(1, first ? "[]\n" : "\n]\n");
+  exit();
+}
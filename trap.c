@@ -11,18 +11,24 @@
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
 extern uint vectors[];  // in vectors.S: array of 256 entry pointers
-struct spinlock tickslock;
-uint ticks;
+extern void sysentry(void);  // in trapasm.S
+extern char ucopyend[], ucopyfault[];  // in uaccess.S
+int havesysenter;  // does the CPU have sysenter/sysexit?
+struct spinlock tickslock;  // for sys_sleep; see timer.c
 
 void
 tvinit(void)
 {
   int i;
+  uint edx;
 
   for(i = 0; i < 256; i++)
     SETGATE(idt[i], 0, SEG_KCODE<<3, vectors[i], 0);
   SETGATE(idt[T_SYSCALL], 1, SEG_KCODE<<3, vectors[T_SYSCALL], DPL_USER);
 
+  rdcpuid(1, 0, 0, 0, &edx);
+  havesysenter = (edx & (1<<11)) != 0;
+
   initlock(&tickslock, "time");
 }
 
@@ -30,12 +36,20 @@ void
 idtinit(void)
 {
   lidt(idt, sizeof(idt));
+  if(havesysenter){
+    // sysenter loads %cs from here, %ss from the next GDT
+    // entry, and the kernel %esp is set by switchuvm.
+    wrmsr(MSR_SYSENTER_CS, SEG_KCODE<<3);
+    wrmsr(MSR_SYSENTER_EIP, (uint)sysentry);
+  }
 }
 
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
 {
+  int insn;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -46,14 +60,21 @@ trap(struct trapframe *tf)
     return;
   }
 
+  if(tf->trapno >= T_IRQ0 && tf->trapno < T_IRQ0 + NIOIRQ)
+    mycpu()->nintr[tf->trapno - T_IRQ0]++;
+
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
-    }
+    profsample(tf);
+    timerintr();
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_WAKE:
+    // Only here to bring a halted CPU out of hlt.
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_TLB:
+    tlbintr();
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -78,8 +99,39 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_ILLOP:
+    // A CPU without sysenter runs it as an ordinary system call.
+    if(!havesysenter && myproc() != 0 && (tf->cs&3) == DPL_USER &&
+       fetchint(tf->eip, &insn) == 0 && (insn & 0xffff) == 0x340f){
+      tf->eip = tf->edx;
+      tf->esp = tf->ecx;
+      sti();
+      if(myproc()->killed)
+        exit();
+      myproc()->tf = tf;
+      syscall();
+      if(myproc()->killed)
+        exit();
+      return;
+    }
+    goto bad;
+
+  case T_PGFLT:
+    // Copy-on-write, demand paging and other recoverable faults on user
+    // addresses, from user mode or from the kernel touching
+    // user memory on the process's behalf.
+    if(myproc() != 0 && pagefault(myproc(), rcr2(), tf->err) == 0)
+      break;
+    // In ucopy(), a bad user address fails the copy, not the kernel.
+    if((tf->cs&3) == 0 && tf->eip >= (uint)ucopy && tf->eip < (uint)ucopyend){
+      tf->eip = (uint)ucopyfault;
+      break;
+    }
+    // fall through
+
   //PAGEBREAK: 13
   default:
+  bad:
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -100,10 +152,12 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU when its time slice is over,
+  // or when a more urgent process has been queued for this CPU.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     ((tf->trapno == T_IRQ0+IRQ_TIMER && nsec() >= mycpu()->quantum) ||
+      (tf->trapno == T_IRQ0+IRQ_WAKE && mycpu()->resched)))
     yield();
 
   // Check if the process has been killed since we yielded
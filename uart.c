@@ -1,4 +1,10 @@
 // Intel 8250 serial port (UART).
+//
+// Output goes into uarttx.buf, and the transmit-empty interrupt
+// moves it to the chip, a FIFO's worth (16 bytes on a 16550A)
+// at a time, so writers do not wait on the line.
+// uarttx.lock is taken after cons.lock; nothing is acquired
+// while holding it.
 
 #include "types.h"
 #include "defs.h"
@@ -13,16 +19,28 @@
 #include "x86.h"
 
 #define COM1    0x3f8
+#define TXBUF   1024
 
 static int uart;    // is there a uart?
+static int fifo;    // bytes the chip takes per transmit-empty
+
+static struct {
+  struct spinlock lock;
+  char buf[TXBUF];
+  uint r;     // next byte to hand to the chip
+  uint w;     // next free slot
+  int busy;   // a transmit-empty interrupt is on its way
+} uarttx;
 
 void
 uartinit(void)
 {
   char *p;
 
-  // Turn off the FIFO
-  outb(COM1+2, 0);
+  initlock(&uarttx.lock, "uart");
+
+  // Turn on and clear the FIFOs, receive trigger at 1 byte.
+  outb(COM1+2, 0x07);
 
   // 9600 baud, 8 data bits, 1 stop bit, parity off.
   outb(COM1+3, 0x80);    // Unlock divisor
@@ -30,29 +48,74 @@ uartinit(void)
   outb(COM1+1, 0);
   outb(COM1+3, 0x03);    // Lock divisor, 8 data bits.
   outb(COM1+4, 0);
-  outb(COM1+1, 0x01);    // Enable receive interrupts.
+  outb(COM1+1, 0x03);    // Enable receive and transmit-empty interrupts.
 
   // If status is 0xFF, no serial port.
   if(inb(COM1+5) == 0xFF)
     return;
   uart = 1;
+  fifo = (inb(COM1+2) & 0xC0) == 0xC0 ? 16 : 1;
 
   // Acknowledge pre-existing interrupt conditions;
   // enable interrupts.
   inb(COM1+2);
   inb(COM1+0);
-  ioapicenable(IRQ_COM1, 0);
+  ioapicenable(IRQ_COM1, -1);
 
   // Announce that we're here.
   for(p="xv6...\n"; *p; p++)
     uartputc(*p);
 }
 
+// Hand the chip as much of uarttx.buf as it can take.
+// Caller must hold uarttx.lock.
+static void
+uartstart(void)
+{
+  int n;
+
+  if(uarttx.r == uarttx.w){
+    uarttx.busy = 0;
+    return;
+  }
+  uarttx.busy = 1;
+  if(!(inb(COM1+5) & 0x20))
+    return;  // still sending; the interrupt will bring us back
+  for(n = 0; n < fifo && uarttx.r != uarttx.w; n++)
+    outb(COM1+0, uarttx.buf[uarttx.r++ % TXBUF]);
+}
+
+// Queue c for output.  Only if the buffer is full does this
+// wait for the chip, as uartputc() used to for every byte.
 void
 uartputc(int c)
 {
   int i;
 
+  if(!uart)
+    return;
+  acquire(&uarttx.lock);
+  for(i = 0; uarttx.w - uarttx.r == TXBUF; i++){
+    if(i == 128){   // line stuck; drop the oldest byte
+      uarttx.r++;
+      break;
+    }
+    microdelay(10);
+    uartstart();
+  }
+  uarttx.buf[uarttx.w++ % TXBUF] = c;
+  if(!uarttx.busy)
+    uartstart();
+  release(&uarttx.lock);
+}
+
+// Write c right away, for panic(), which cannot
+// count on locks or interrupts.
+void
+uartputcsync(int c)
+{
+  int i;
+
   if(!uart)
     return;
   for(i = 0; i < 128 && !(inb(COM1+5) & 0x20); i++)
@@ -73,5 +136,9 @@ uartgetc(void)
 void
 uartintr(void)
 {
+  inb(COM1+2);  // acknowledge a transmit-empty interrupt
+  acquire(&uarttx.lock);
+  uartstart();
+  release(&uarttx.lock);
   consoleintr(uartgetc);
 }
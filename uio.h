@@ -0,0 +1,7 @@
+// Scatter/gather I/O, for readv() and writev().
+#define IOV_MAX  16   // most iovecs in one call
+
+struct iovec {
+  void *base;
+  int len;
+};
@@ -3,6 +3,38 @@
 #include "fcntl.h"
 #include "user.h"
 #include "x86.h"
+#include "param.h"
+#include "memlayout.h"
+#include "timepage.h"
+
+// Set by printf.c once it holds buffered output.
+void (*exitflush)(void);
+
+int
+exit(void)
+{
+  if(exitflush)
+    exitflush();
+  _exit();
+}
+
+// A child would write the output buffered before fork() a second
+// time, and exec() would lose it, so write it out first.
+int
+fork(void)
+{
+  if(exitflush)
+    exitflush();
+  return _fork();
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(exitflush)
+    exitflush();
+  return _exec(path, argv);
+}
 
 char*
 strcpy(char *s, const char *t)
@@ -36,7 +68,11 @@ strlen(const char *s)
 void*
 memset(void *dst, int c, uint n)
 {
-  stosb(dst, c, n);
+  if ((int)dst%4 == 0 && n%4 == 0){
+    c &= 0xFF;
+    stosl(dst, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+  } else
+    stosb(dst, c, n);
   return dst;
 }
 
@@ -49,21 +85,149 @@ strchr(const char *s, char c)
   return 0;
 }
 
-char*
-gets(char *buf, int max)
+void*
+memchr(const void *v, int c, uint n)
+{
+  const uchar *s;
+
+  for(s = v; n > 0; n--, s++)
+    if(*s == (uchar)c)
+      return (void*)s;
+  return 0;
+}
+
+// Buffered input.  peekc, getc and readline read from fd in
+// IBUFSIZE chunks rather than a byte per system call.  Input
+// already buffered for fd is not given back, so once a program
+// reads an fd this way it should not also read() it directly.
+// The buffers of fds from NOFILE0 up come from sbrk() when first
+// needed, and are kept for the next file with that fd.  close()
+// drops an fd's buffered input.
+
+#define IBUFSIZE 512
+
+struct ibuf {
+  int off;
+  int n;
+  char buf[IBUFSIZE];
+};
+
+static struct ibuf ibuf[NOFILE0];
+static struct ibuf *ibufhi[NOFILE-NOFILE0];
+
+// Return fd's input buffer, allocating it if alloc is set,
+// or 0 if it has none.
+static struct ibuf*
+ibufof(int fd, int alloc)
+{
+  struct ibuf *b;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  if(fd < NOFILE0)
+    return &ibuf[fd];
+  if(ibufhi[fd-NOFILE0] == 0 && alloc){
+    if((b = (struct ibuf*)sbrk(sizeof(*b))) == (struct ibuf*)-1)
+      return 0;
+    b->off = b->n = 0;
+    ibufhi[fd-NOFILE0] = b;
+  }
+  return ibufhi[fd-NOFILE0];
+}
+
+// Set by printf.c, to flush an fd's output before it closes.
+void (*closeflush)(int);
+
+int
+close(int fd)
+{
+  struct ibuf *b;
+
+  if(closeflush)
+    closeflush(fd);
+  if((b = ibufof(fd, 0)) != 0)
+    b->off = b->n = 0;
+  return _close(fd);
+}
+
+// Return fd's input buffer, refilled if it is empty,
+// or 0 at end of file or error.
+static struct ibuf*
+ifill(int fd)
+{
+  struct ibuf *b;
+
+  if((b = ibufof(fd, 1)) == 0)
+    return 0;
+  if(b->off == b->n){
+    b->off = b->n = 0;
+    if((b->n = read(fd, b->buf, sizeof(b->buf))) <= 0){
+      b->n = 0;
+      return 0;
+    }
+  }
+  return b;
+}
+
+// Return the next byte of fd without consuming it, or -1 at EOF.
+int
+peekc(int fd)
+{
+  struct ibuf *b;
+
+  if((b = ifill(fd)) == 0)
+    return -1;
+  return b->buf[b->off] & 0xff;
+}
+
+// Return the next byte of fd, or -1 at EOF.
+int
+getc(int fd)
 {
-  int i, cc;
-  char c;
+  struct ibuf *b;
 
-  for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
+  if((b = ifill(fd)) == 0)
+    return -1;
+  return b->buf[b->off++] & 0xff;
+}
+
+// Read a line from fd into buf, including its newline,
+// but at most max-1 bytes.  Returns the number of bytes
+// read, 0 at end of file.
+int
+readline(int fd, char *buf, int max)
+{
+  struct ibuf *b;
+  int i, m;
+  char *p, *e;
+
+  for(i = 0; i+1 < max; ){
+    if((b = ifill(fd)) == 0)
       break;
-    buf[i++] = c;
-    if(c == '\n' || c == '\r')
+    p = b->buf + b->off;
+    e = b->buf + b->n;
+    if(e - p > max-1 - i)
+      e = p + (max-1 - i);
+    for(m = 0; p + m < e; m++){
+      if(p[m] == '\n' || p[m] == '\r'){
+        m++;
+        break;
+      }
+    }
+    memmove(buf + i, p, m);
+    b->off += m;
+    i += m;
+    if(buf[i-1] == '\n' || buf[i-1] == '\r')
       break;
   }
   buf[i] = '\0';
+  return i;
+}
+
+char*
+gets(char *buf, int max)
+{
+  readline(0, buf, max);
   return buf;
 }
 
@@ -97,10 +261,86 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  int m;
 
   dst = vdst;
   src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  if(n <= 0)
+    return vdst;
+  if(src < dst && src + n > dst){
+    if(((uint)src | (uint)dst | n) % 4 == 0)
+      rmovsl(dst + n - 4, src + n - 4, n/4);
+    else
+      rmovsb(dst + n - 1, src + n - 1, n);
+  } else if(((uint)src ^ (uint)dst) % 4 == 0 && n >= 16){
+    m = -(uint)dst % 4;
+    movsb(dst, src, m);
+    movsl(dst + m, src + m, (n - m)/4);
+    m += (n - m) & ~3;
+    movsb(dst + m, src + m, n - m);
+  } else
+    movsb(dst, src, n);
   return vdst;
 }
+
+int
+memcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  if(((uint)s1 | (uint)s2) % 4 == 0)
+    while(n >= 4 && *(uint*)s1 == *(uint*)s2)
+      s1 += 4, s2 += 4, n -= 4;
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
+  }
+  return 0;
+}
+
+// Like uptimens(), but read the clock page instead of making
+// a system call.
+int
+clockns(uint64 *ns)
+{
+  struct timepage *tp;
+  uint seq, mult;
+  uint64 base, d;
+
+  tp = (struct timepage*)TIMEPAGE;
+  do {
+    while((seq = tp->seq) & 1)
+      ;
+    __sync_synchronize();
+    mult = tp->tscmult;
+    base = tp->tscbase;
+    __sync_synchronize();
+  } while(tp->seq != seq);
+  if(seq == 0)
+    return uptimens(ns);
+  d = rdtsc() - base;
+  *ns = (((d >> 32) * mult) << 8) + (((d & 0xFFFFFFFF) * mult) >> 24);
+  return 0;
+}
+
+// n / d.  There is no libgcc to provide 64-bit division,
+// so do it a bit at a time.
+uint64
+udiv64(uint64 n, uint64 d)
+{
+  uint64 q, r;
+  int i;
+
+  q = r = 0;
+  for(i = 63; i >= 0; i--){
+    r = (r << 1) | ((n >> i) & 1);
+    if(r >= d){
+      r -= d;
+      q |= (uint64)1 << i;
+    }
+  }
+  return q;
+}
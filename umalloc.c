@@ -5,6 +5,12 @@
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+//
+// Small requests bypass the K&R free list: they are rounded up
+// to a power-of-two size class and served from a per-class free
+// list, or else carved off a bump-pointer arena that is grown
+// ARENA bytes at a time with sbrk.  Small blocks are never
+// coalesced; a freed one goes back on its class list.
 
 typedef long Align;
 
@@ -21,12 +27,54 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
+#define NSMALL 7                // classes of 16, 32, ..., 1024 bytes
+#define SMALLMAX (16 << (NSMALL-1))
+#define ARENA (64*1024)
+#define SMALL ((Header*)1)      // s.ptr of an allocated small block
+
+static Header *smallfree[NSMALL];
+static char *arenap, *arenaend;
+
+// Allocate a small block of at least nbytes.
+// Its header records the size class in s.size.
+static void*
+smallalloc(uint nbytes)
+{
+  Header *hp;
+  char *p;
+  uint c, sz;
+
+  for(c = 0, sz = 16; sz < nbytes + sizeof(Header); c++, sz <<= 1)
+    ;
+  if((hp = smallfree[c]) != 0)
+    smallfree[c] = hp->s.ptr;
+  else {
+    if(arenaend - arenap < sz){
+      if((p = sbrk(ARENA)) == (char*)-1)
+        return 0;
+      if(p != arenaend)
+        arenap = p;
+      arenaend = p + ARENA;
+    }
+    hp = (Header*)arenap;
+    arenap += sz;
+  }
+  hp->s.ptr = SMALL;
+  hp->s.size = c;
+  return (void*)(hp + 1);
+}
+
 void
 free(void *ap)
 {
   Header *bp, *p;
 
   bp = (Header*)ap - 1;
+  if(bp->s.ptr == SMALL){
+    bp->s.ptr = smallfree[bp->s.size];
+    smallfree[bp->s.size] = bp;
+    return;
+  }
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -55,6 +103,7 @@ morecore(uint nu)
   if(p == (char*)-1)
     return 0;
   hp = (Header*)p;
+  hp->s.ptr = 0;
   hp->s.size = nu;
   free((void*)(hp + 1));
   return freep;
@@ -66,6 +115,9 @@ malloc(uint nbytes)
   Header *p, *prevp;
   uint nunits;
 
+  if(nbytes + sizeof(Header) <= SMALLMAX)
+    return smallalloc(nbytes);
+
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
@@ -80,6 +132,7 @@ malloc(uint nbytes)
         p += p->s.size;
         p->s.size = nunits;
       }
+      p->s.ptr = 0;  // not SMALL
       freep = prevp;
       return (void*)(p + 1);
     }
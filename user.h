@@ -1,20 +1,31 @@
 struct stat;
+struct dirent;
+struct pollfd;
+struct swapstat;
+struct sysstat;
 struct rtcdate;
+struct iovec;
 
 // system calls
-int fork(void);
-int exit(void) __attribute__((noreturn));
+int _fork(void);
+int _exit(void) __attribute__((noreturn));
 int wait(void);
 int pipe(int*);
+int pipe2(int*, int);
+int poll(struct pollfd*, int, int);
 int write(int, const void*, int);
 int read(int, void*, int);
-int close(int);
+int _close(int);
 int kill(int);
-int exec(char*, char**);
+int _exec(char*, char**);
+int spawn(char*, char**, int*);
+int getstats(int, struct sysstat*, int);
 int open(const char*, int);
 int mknod(const char*, short, short);
 int unlink(const char*);
 int fstat(int fd, struct stat*);
+int getdents(int, struct dirent*, int);
+int fstatat(int, const char*, struct stat*);
 int link(const char*, const char*);
 int mkdir(const char*);
 int chdir(const char*);
@@ -23,17 +34,61 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int uptimens(uint64*);
+int setprio(int, int, int);
+int setaffinity(int, uint);
+int irqaffinity(int, int);
+int pageout(int, struct swapstat*);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int fsync(int);
+int mount(char*, int);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int futex_wait(volatile uint*, int);
+int futex_wake(volatile uint*);
+int shmget(int, int);
+void* shmat(int);
+int shmdt(void*);
 
 // ulib.c
+int exit(void) __attribute__((noreturn));
+extern void (*exitflush)(void);
+int close(int);
+extern void (*closeflush)(int);
+int fork(void);
+int exec(char*, char**);
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
 void *memmove(void*, const void*, int);
+int memcmp(const void*, const void*, uint);
 char* strchr(const char*, char c);
+void* memchr(const void*, int, uint);
 int strcmp(const char*, const char*);
 void printf(int, const char*, ...);
+void flush(int);
 char* gets(char*, int max);
+int peekc(int);
+int getc(int);
+int readline(int, char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+int clockns(uint64*);
+uint64 udiv64(uint64, uint64);
+
+// uthread.c
+struct lock {
+  volatile uint locked;
+};
+int thread_create(void(*)(void*), void*);
+int thread_join(void);
+void lock_init(struct lock*);
+void lock_acquire(struct lock*);
+void lock_release(struct lock*);
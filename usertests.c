@@ -4,9 +4,15 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "sched.h"
+#include "uio.h"
 #include "syscall.h"
 #include "traps.h"
+#include "sysstat.h"
+#include "swapstat.h"
+#include "trace.h"
 #include "memlayout.h"
+#include "poll.h"
 
 char buf[8192];
 char name[3];
@@ -184,6 +190,10 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+// Blocks in the big file: reaches into the double-indirect
+// range while staying well inside FSSIZE.
+#define BIGFILE (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writetest1(void)
 {
@@ -197,7 +207,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +227,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == BIGFILE - 1){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -1411,6 +1421,1420 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// does fork share pages copy-on-write without letting
+// writes in one process show up in the other?
+void
+cowtest(void)
+{
+  int i, pid, fds[2];
+  char *p;
+  enum { N = 64*4096 };
+
+  printf(stdout, "cow test\n");
+  p = sbrk(N);
+  if(p == (char*)-1){
+    printf(stdout, "cow test sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < N; i += 4096)
+    p[i] = 'p';
+  if(pipe(fds) != 0){
+    printf(stdout, "cow test pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += 4096)
+      p[i] = 'c';
+    // the kernel, not the child, writes this page.
+    if(read(fds[0], p + 4096, 1) != 1 || p[4096] != 'k'){
+      printf(stdout, "cow test child read failed\n");
+      exit();
+    }
+    exit();
+  }
+  if(write(fds[1], "k", 1) != 1){
+    printf(stdout, "cow test write failed\n");
+    exit();
+  }
+  wait();
+  for(i = 0; i < N; i += 4096){
+    if(p[i] != 'p'){
+      printf(stdout, "cow test failed: child write visible at %d\n", i);
+      exit();
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-N);
+  printf(stdout, "cow test ok\n");
+}
+
+// swapchild() checks and reports its heap pages; each page
+// holds its own number.
+int
+swapcheck(char *base, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(base[i*4096] != i || base[i*4096 + 4095] != i)
+      return 0;
+  return 1;
+}
+
+// the child half of swaptest(), which pages it out while it
+// waits on go.
+void
+swapchild(int n, int go, int rdy)
+{
+  char *base, c;
+  int i;
+
+  base = sbrk(n*4096);
+  for(i = 0; i < n; i++)
+    memset(base + i*4096, i, 4096);
+  write(rdy, "r", 1);
+  read(go, &c, 1);
+  // A child shares the paged-out slots and reads them first.
+  if(fork() == 0){
+    write(rdy, swapcheck(base, n) ? "g" : "x", 1);
+    exit();
+  }
+  wait();
+  read(go, &c, 1);
+  write(rdy, swapcheck(base, n) ? "c" : "x", 1);
+  read(go, &c, 1);
+  // Shrinking frees the slots of pages never read back.
+  sbrk(-n*4096);
+  write(rdy, "s", 1);
+  read(go, &c, 1);
+  exit();
+}
+
+// dirty heap pages get paged out and read back intact, a
+// fork()ed child shares their swap slots until both have read
+// them, and sbrk() shrinking frees the slots of paged-out pages.
+void
+swaptest(void)
+{
+  enum { N = 32, ALL = 1<<20 };
+  struct swapstat st0, st1, st2, st3;
+  int go[2], rdy[2], pid;
+  char c;
+
+  printf(stdout, "swap test\n");
+  pageout(ALL, &st0);  // out of the way: other processes' pages
+  if(st0.nslot == 0){
+    printf(stdout, "swap test: no swap area\n");
+    return;
+  }
+  if(pipe(go) < 0 || pipe(rdy) < 0){
+    printf(stdout, "swap test: pipe failed\n");
+    exit();
+  }
+  if((pid = fork()) == 0)
+    swapchild(N, go[0], rdy[1]);
+  if(pid < 0 || read(rdy[0], &c, 1) != 1 || c != 'r'){
+    printf(stdout, "swap test: child failed\n");
+    exit();
+  }
+  if(pageout(ALL, &st1) < N){
+    printf(stdout, "swap test: heap not paged out\n");
+    exit();
+  }
+  write(go[1], "g", 1);
+  if(read(rdy[0], &c, 1) != 1 || c != 'g'){
+    printf(stdout, "swap test: fork child read bad data\n");
+    exit();
+  }
+  pageout(0, &st2);
+  if(st2.nin < st1.nin + N || st2.used + N/2 < st1.used){
+    printf(stdout, "swap test: slots not shared (%d then %d used)\n",
+           st1.used, st2.used);
+    exit();
+  }
+  write(go[1], "g", 1);
+  if(read(rdy[0], &c, 1) != 1 || c != 'c'){
+    printf(stdout, "swap test: child read bad data\n");
+    exit();
+  }
+  pageout(0, &st2);
+  if(st2.used + N > st1.used){
+    printf(stdout, "swap test: slots not freed (%d then %d used)\n",
+           st1.used, st2.used);
+    exit();
+  }
+  if(pageout(ALL, &st3) < N){
+    printf(stdout, "swap test: heap not paged out again\n");
+    exit();
+  }
+  write(go[1], "g", 1);
+  if(read(rdy[0], &c, 1) != 1 || c != 's'){
+    printf(stdout, "swap test: child failed to shrink\n");
+    exit();
+  }
+  pageout(0, &st2);
+  if(st2.used + N > st3.used){
+    printf(stdout, "swap test: sbrk kept slots (%d then %d used)\n",
+           st3.used, st2.used);
+    exit();
+  }
+  write(go[1], "g", 1);
+  wait();
+  close(go[0]);
+  close(go[1]);
+  close(rdy[0]);
+  close(rdy[1]);
+  printf(stdout, "swap test ok\n");
+}
+
+// can a process sbrk more than physical memory, as long
+// as it touches only a few of the pages?
+void
+lazysbrktest(void)
+{
+  char *p;
+  enum { N = 1024*1024*1024 };
+
+  printf(stdout, "lazy sbrk test\n");
+  p = sbrk(N);
+  if(p == (char*)-1){
+    printf(stdout, "lazy sbrk test sbrk failed\n");
+    exit();
+  }
+  if(p[0] != 0 || p[N/2] != 0 || p[N-1] != 0){
+    printf(stdout, "lazy sbrk test: new memory not zero\n");
+    exit();
+  }
+  p[0] = 1;
+  p[N-1] = 2;
+  if(p[0] != 1 || p[N-1] != 2){
+    printf(stdout, "lazy sbrk test: write lost\n");
+    exit();
+  }
+  if(sbrk(-N) == (char*)-1){
+    printf(stdout, "lazy sbrk test dealloc failed\n");
+    exit();
+  }
+  printf(stdout, "lazy sbrk test ok\n");
+}
+
+// does the nanosecond clock agree with sleep and uptime?
+void
+clocktest(void)
+{
+  uint64 t0, t1;
+  int u0;
+
+  printf(stdout, "clock test\n");
+  u0 = uptime();
+  if(uptimens(&t0) < 0){
+    printf(stdout, "clock test: uptimens failed\n");
+    exit();
+  }
+  sleep(2);
+  uptimens(&t1);
+  if(t1 <= t0 || t1 - t0 < 20000000){
+    printf(stdout, "clock test: sleep(2) too short\n");
+    exit();
+  }
+  if(uptime() - u0 < 2){
+    printf(stdout, "clock test: uptime did not advance\n");
+    exit();
+  }
+  printf(stdout, "clock test ok\n");
+}
+
+// The clock page should agree with uptimens(), and user code
+// must not be able to write it.
+void
+timepagetest(void)
+{
+  uint64 t0, t1, t2;
+  int pid, ppid;
+
+  printf(stdout, "time page test\n");
+  uptimens(&t0);
+  clockns(&t1);
+  uptimens(&t2);
+  if(t1 < t0 || t1 > t2){
+    printf(stdout, "time page test: clockns out of order\n");
+    exit();
+  }
+  ppid = getpid();
+  if((pid = fork()) == 0){
+    *(volatile uint*)TIMEPAGE = 0;
+    printf(stdout, "time page test: wrote the clock page\n");
+    kill(ppid);
+    exit();
+  }
+  wait();
+  printf(stdout, "time page test ok\n");
+}
+
+// setprio() should check its arguments, and a real-time
+// child should still run and exit normally.
+void
+priotest(void)
+{
+  int pid;
+
+  printf(stdout, "prio test\n");
+  if(setprio(0, SCHED_RT, NRTPRIO) >= 0 || setprio(0, 99, 0) >= 0 ||
+     setprio(0, SCHED_BATCH, 1) >= 0 || setprio(-1, SCHED_NORMAL, 0) >= 0){
+    printf(stdout, "prio test: bad setprio succeeded\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "prio test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(setprio(0, SCHED_RT, 0) < 0)
+      printf(stdout, "prio test: setprio rt failed\n");
+    exit();
+  }
+  wait();
+  if(setprio(0, SCHED_BATCH, 0) < 0 || setprio(0, SCHED_NORMAL, 0) < 0){
+    printf(stdout, "prio test: setprio failed\n");
+    exit();
+  }
+  printf(stdout, "prio test ok\n");
+}
+
+// processes pinned to one CPU should still make progress.
+void
+affinitytest(void)
+{
+  int i, pid;
+
+  printf(stdout, "affinity test\n");
+  if(setaffinity(0, 0) >= 0){
+    printf(stdout, "affinity test: empty mask accepted\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "affinity test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      if(setaffinity(0, 1) < 0)
+        printf(stdout, "affinity test: setaffinity failed\n");
+      sleep(1);
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+  printf(stdout, "affinity test ok\n");
+}
+
+// mmap a file privately and shared; shared writes
+// should reach the file, private ones should not.
+void
+mmaptest(void)
+{
+  enum { N = 3*4096 + 100 };
+  int fd, i, pid;
+  char *p;
+
+  printf(stdout, "mmap test\n");
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  for(i = 0; i < N; i++)
+    buf[i % sizeof(buf)] = i % 251;
+  for(i = 0; i < N; i += sizeof(buf))
+    write(fd, buf, N - i < sizeof(buf) ? N - i : sizeof(buf));
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf(stdout, "mmap test: mmap private failed\n");
+    exit();
+  }
+  for(i = 0; i < N; i++){
+    if(p[i] != (char)(i % 251)){
+      printf(stdout, "mmap test: wrong data at %d\n", i);
+      exit();
+    }
+  }
+  p[0] = 'x';
+  if(munmap(p, N) < 0){
+    printf(stdout, "mmap test: munmap failed\n");
+    exit();
+  }
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf(stdout, "mmap test: mmap shared failed\n");
+    exit();
+  }
+  if(p[0] != 0){
+    printf(stdout, "mmap test: private write reached file\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    p[1] = 'c';
+    exit();
+  }
+  wait();
+  p[N-1] = 'y';
+  if(p[1] != 'c'){
+    printf(stdout, "mmap test: shared write not shared with child\n");
+    exit();
+  }
+  munmap(p, N);
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 2) != 2 || buf[1] != 'c'){
+    printf(stdout, "mmap test: child's shared write lost\n");
+    exit();
+  }
+  if(mmap(0, N, PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf(stdout, "mmap test: writable map of read-only fd\n");
+    exit();
+  }
+  p = mmap(0, N, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == (char*)-1 || p[N-1] != 'y'){
+    printf(stdout, "mmap test: shared write lost\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+  printf(stdout, "mmap test ok\n");
+}
+
+// Reading into a read-only mapping must fail, not crash
+// the kernel, whether from a file or from a pipe.
+void
+rocopytest(void)
+{
+  int fd, pfd[2];
+  char *p;
+
+  printf(stdout, "read-only copy test\n");
+  fd = open("rocopy", O_CREATE|O_RDWR);
+  write(fd, "0123456789", 10);
+  p = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || p[0] != '0'){
+    printf(stdout, "read-only copy test: mmap failed\n");
+    exit();
+  }
+  if(pread(fd, p, 10, 0) >= 0){
+    printf(stdout, "read-only copy test: read into it succeeded\n");
+    exit();
+  }
+  if(pipe(pfd) < 0 || write(pfd[1], "abc", 3) != 3){
+    printf(stdout, "read-only copy test: pipe failed\n");
+    exit();
+  }
+  if(read(pfd[0], p, 3) >= 0){
+    printf(stdout, "read-only copy test: pipe read into it succeeded\n");
+    exit();
+  }
+  close(pfd[0]);
+  close(pfd[1]);
+  munmap(p, 4096);
+  close(fd);
+  unlink("rocopy");
+  printf(stdout, "read-only copy test ok\n");
+}
+
+// writev, readv, pread and pwrite, including
+// reading into an mmap'd buffer.
+void
+iovtest(void)
+{
+  struct iovec iov[3];
+  char a[5], b[7], c[9];
+  char *p;
+  int fd;
+
+  printf(stdout, "iov test\n");
+  unlink("iovfile");
+  fd = open("iovfile", O_CREATE|O_RDWR);
+  iov[0].base = "hdr:";
+  iov[0].len = 4;
+  iov[1].base = "";
+  iov[1].len = 0;
+  iov[2].base = "payload";
+  iov[2].len = 7;
+  if(writev(fd, iov, 3) != 11){
+    printf(stdout, "iov test: writev failed\n");
+    exit();
+  }
+  if(pwrite(fd, "PAY", 3, 4) != 3 || write(fd, "!", 1) != 1){
+    printf(stdout, "iov test: pwrite failed\n");
+    exit();
+  }
+  memset(c, 0, sizeof(c));
+  if(pread(fd, c, 7, 4) != 7 || strcmp(c, "PAYload") != 0){
+    printf(stdout, "iov test: pread got %s\n", c);
+    exit();
+  }
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  memset(c, 0, sizeof(c));
+  iov[0].base = a;
+  iov[0].len = 4;
+  iov[1].base = b;
+  iov[1].len = 6;
+  iov[2].base = c;
+  iov[2].len = 8;
+  if(readv(fd, iov, 3) != 12 || strcmp(a, "hdr:") || strcmp(b, "PAYloa") ||
+     strcmp(c, "d!")){
+    printf(stdout, "iov test: readv failed\n");
+    exit();
+  }
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || pread(fd, p + 100, 4, 0) != 4 || strcmp(p + 100, "hdr:")){
+    printf(stdout, "iov test: read into mmap failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("iovfile");
+  printf(stdout, "iov test ok\n");
+}
+
+// hold more distinct inodes open at once than NINODE, in
+// children that each stay within the first NOFILE0 fds.
+void
+icachetest(void)
+{
+  char name[4], c;
+  int fds[2], ready[2], i, j, pid;
+
+  printf(stdout, "icache test\n");
+  pipe(fds);
+  pipe(ready);
+  name[0] = 'i';
+  name[3] = '\0';
+  for(i = 0; i < 6; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "icache test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      close(fds[1]);
+      name[1] = '0' + i;
+      for(j = 0; j < 9; j++){
+        name[2] = 'a' + j;
+        if(open(name, O_CREATE|O_RDWR) < 0){
+          printf(stdout, "icache test: open %s failed\n", name);
+          exit();
+        }
+      }
+      write(ready[1], "x", 1);
+      read(fds[0], &c, 1);  // wait for the parent to close fds[1]
+      exit();
+    }
+  }
+  for(i = 0; i < 6; i++)
+    read(ready[0], &c, 1);
+  close(ready[0]);
+  close(ready[1]);
+  close(fds[0]);
+  close(fds[1]);
+  for(i = 0; i < 6; i++)
+    wait();
+  for(i = 0; i < 6; i++){
+    name[1] = '0' + i;
+    for(j = 0; j < 9; j++){
+      name[2] = 'a' + j;
+      if(unlink(name) < 0){
+        printf(stdout, "icache test: unlink %s failed\n", name);
+        exit();
+      }
+    }
+  }
+  printf(stdout, "icache test ok\n");
+}
+
+// data written to a file reads back before and after fsync(),
+// and a file unlinked before the flusher runs goes away cleanly.
+void
+fsynctest(void)
+{
+  char buf[BSIZE];
+  int fd, i;
+
+  printf(stdout, "fsync test\n");
+  unlink("syncfile");
+  fd = open("syncfile", O_CREATE|O_RDWR);
+  for(i = 0; i < 20; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, i == 19 ? 100 : sizeof(buf)) < 0){
+      printf(stdout, "fsync test: write failed\n");
+      exit();
+    }
+  }
+  if(pread(fd, buf, 1, 5*BSIZE) != 1 || buf[0] != 'f'){
+    printf(stdout, "fsync test: delayed read failed\n");
+    exit();
+  }
+  if(fsync(fd) != 0){
+    printf(stdout, "fsync test: fsync failed\n");
+    exit();
+  }
+  if(pread(fd, buf, sizeof(buf), 19*BSIZE) != 100 || buf[99] != 'a' + 19 ||
+     pread(fd, buf, 1, 7*BSIZE) != 1 || buf[0] != 'h'){
+    printf(stdout, "fsync test: read after fsync failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("syncfile");
+
+  fd = open("tmpfile", O_CREATE|O_RDWR);
+  memset(buf, 'z', sizeof(buf));
+  for(i = 0; i < 8; i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+  if(unlink("tmpfile") != 0 || open("tmpfile", O_RDONLY) >= 0){
+    printf(stdout, "fsync test: unlink failed\n");
+    exit();
+  }
+  printf(stdout, "fsync test ok\n");
+}
+
+// files under /tmp live on the RAM disk, and .. out of
+// its root leads back to the root file system.
+void
+mounttest(void)
+{
+  struct stat st, root;
+  char buf[32];
+  int fd;
+
+  printf(stdout, "mount test\n");
+  fd = open("/tmp/mfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "hot data", 8) != 8){
+    printf(stdout, "mount test: create failed\n");
+    exit();
+  }
+  memset(buf, 0, sizeof(buf));
+  if(pread(fd, buf, sizeof(buf), 0) != 8 || strcmp(buf, "hot data") != 0){
+    printf(stdout, "mount test: read failed\n");
+    exit();
+  }
+  if(fstat(fd, &st) < 0 || st.dev != 2){
+    printf(stdout, "mount test: wrong device %d\n", st.dev);
+    exit();
+  }
+  close(fd);
+  if(unlink("/tmp/mfile") != 0){
+    printf(stdout, "mount test: unlink failed\n");
+    exit();
+  }
+  if(stat("/", &root) < 0 || stat("/tmp/..", &st) < 0 ||
+     st.dev != root.dev || st.ino != root.ino){
+    printf(stdout, "mount test: .. failed\n");
+    exit();
+  }
+  printf(stdout, "mount test ok\n");
+}
+
+// the RAM disk under /tmp spans several bitmap groups; fill
+// more than the first with one file, so that balloc() moves on
+// to the next group and iflush() logs the blocks it takes.
+void
+groupstest(void)
+{
+  int fd, i, n;
+
+  printf(stdout, "groups test\n");
+  n = (BSIZE*8 + 100) * BSIZE / sizeof(buf);
+  fd = open("/tmp/gfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "groups test: create failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(stdout, "groups test: write %d failed\n", i);
+      exit();
+    }
+  }
+  if(fsync(fd) < 0){
+    printf(stdout, "groups test: fsync failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i += n/4){
+    if(pread(fd, buf, sizeof(buf), i*sizeof(buf)) != sizeof(buf) ||
+       (buf[0] & 0xff) != (i & 0xff) || (buf[sizeof(buf)-1] & 0xff) != (i & 0xff)){
+      printf(stdout, "groups test: chunk %d wrong\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  if(unlink("/tmp/gfile") != 0){
+    printf(stdout, "groups test: unlink failed\n");
+    exit();
+  }
+  printf(stdout, "groups test ok\n");
+}
+
+// memmove() at every alignment, forward and overlapping
+// in both directions, checked byte by byte; and memcmp().
+void
+memmovetest(void)
+{
+  static char a[300], b[300];
+  int i, off, n;
+
+  printf(stdout, "memmove test\n");
+  for(off = 0; off < 8; off++){
+    for(n = 0; n < 200; n += 13){
+      for(i = 0; i < sizeof(a); i++)
+        a[i] = b[i] = i;
+      memmove(a + 40 + off, a + 40, n);   // dst above src
+      memmove(b + 40, b + 40 + off, n);   // dst below src
+      for(i = 0; i < sizeof(a); i++){
+        if(a[i] != (char)(i >= 40+off && i < 40+off+n ? i - off : i) ||
+           b[i] != (char)(i >= 40 && i < 40+n ? i + off : i)){
+          printf(stdout, "memmove test: off %d n %d byte %d wrong\n", off, n, i);
+          exit();
+        }
+      }
+    }
+  }
+  for(i = 0; i < sizeof(a); i++)
+    a[i] = b[i] = i;
+  b[123] = 0;
+  if(memcmp(a, b, 123) != 0 || memcmp(a, b, sizeof(a)) <= 0 ||
+     memcmp(a+1, b+1, 200) <= 0){
+    printf(stdout, "memmove test: memcmp failed\n");
+    exit();
+  }
+  printf(stdout, "memmove test ok\n");
+}
+
+#define NTHREAD 4
+
+struct lock clonelock;
+volatile int clonecount;
+char * volatile clonemem[NTHREAD];
+
+static void
+clonework(void *arg)
+{
+  int i, me;
+
+  me = (int)arg;
+  for(i = 0; i < 1000; i++){
+    lock_acquire(&clonelock);
+    clonecount++;
+    lock_release(&clonelock);
+  }
+  if((clonemem[me] = sbrk(4096)) != (char*)-1)
+    clonemem[me][0] = me;
+}
+
+// threads from thread_create() share memory: a counter
+// under a lock, and pages each thread adds with sbrk().
+void
+clonetest(void)
+{
+  int i;
+
+  printf(stdout, "clone test\n");
+  lock_init(&clonelock);
+  clonecount = 0;
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_create(clonework, (void*)i) < 0){
+      printf(stdout, "clone test: thread_create failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_join() < 0){
+      printf(stdout, "clone test: thread_join failed\n");
+      exit();
+    }
+  }
+  if(thread_join() >= 0 || wait() >= 0){
+    printf(stdout, "clone test: extra child\n");
+    exit();
+  }
+  if(clonecount != NTHREAD*1000){
+    printf(stdout, "clone test: count %d\n", clonecount);
+    exit();
+  }
+  for(i = 0; i < NTHREAD; i++){
+    if(clonemem[i] == (char*)-1 || clonemem[i][0] != i){
+      printf(stdout, "clone test: sbrk memory %d not shared\n", i);
+      exit();
+    }
+  }
+  printf(stdout, "clone test ok\n");
+}
+
+volatile uint futexflag;
+
+static void
+futexwaiter(void *arg)
+{
+  while(futexflag == 0)
+    futex_wait(&futexflag, 0);
+  futexflag = 2;
+}
+
+// a thread sleeping in futex_wait() until futex_wake();
+// futex_wait() on a changed value or a bad address returns.
+void
+futextest(void)
+{
+  printf(stdout, "futex test\n");
+  futexflag = 0;
+  if(futex_wait(&futexflag, 1) != 0 || futex_wait((uint*)0x80000000, 0) != -1){
+    printf(stdout, "futex test: futex_wait did not return\n");
+    exit();
+  }
+  if(thread_create(futexwaiter, 0) < 0){
+    printf(stdout, "futex test: thread_create failed\n");
+    exit();
+  }
+  sleep(2);
+  futexflag = 1;
+  futex_wake(&futexflag);
+  if(thread_join() < 0 || futexflag != 2){
+    printf(stdout, "futex test: waiter not woken\n");
+    exit();
+  }
+  printf(stdout, "futex test ok\n");
+}
+
+// a shared memory segment seen by a forked child both through
+// the inherited mapping and through its own shmat().
+void
+shmtest(void)
+{
+  int id, pid;
+  char *a, *b;
+
+  printf(stdout, "shm test\n");
+  if((id = shmget(1234, 8192)) < 0 || shmget(1234, 8192) != id ||
+     shmget(1234, 3*4096) >= 0){
+    printf(stdout, "shm test: shmget failed\n");
+    exit();
+  }
+  if((a = shmat(id)) == (char*)-1){
+    printf(stdout, "shm test: shmat failed\n");
+    exit();
+  }
+  if(a[0] != 0 || a[8191] != 0){
+    printf(stdout, "shm test: segment not zeroed\n");
+    exit();
+  }
+  a[0] = 'a';
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "shm test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if((b = shmat(id)) == (char*)-1 || b == a || b[0] != 'a')
+      exit();
+    a[4096] = 'b';
+    b[8191] = 'c';
+    shmdt(b);
+    exit();
+  }
+  wait();
+  if(a[4096] != 'b' || a[8191] != 'c'){
+    printf(stdout, "shm test: child's writes not seen\n");
+    exit();
+  }
+  if(shmdt(a) != 0 || shmdt(a) != -1){
+    printf(stdout, "shm test: shmdt failed\n");
+    exit();
+  }
+  printf(stdout, "shm test ok\n");
+}
+
+// spawn() a program with its output on a pipe.
+void
+spawntest(void)
+{
+  char *args[] = { "echo", "spawned", 0 };
+  char buf[32];
+  int p[2], fd[3], pid, n, tot;
+
+  printf(stdout, "spawn test\n");
+  if(spawn("nonexistent", args, 0) >= 0){
+    printf(stdout, "spawn test: spawned nonexistent\n");
+    exit();
+  }
+  if(pipe(p) < 0){
+    printf(stdout, "spawn test: pipe failed\n");
+    exit();
+  }
+  fd[0] = -1;
+  fd[1] = p[1];
+  fd[2] = -1;
+  if((pid = spawn("echo", args, fd)) < 0){
+    printf(stdout, "spawn test: spawn failed\n");
+    exit();
+  }
+  close(p[1]);
+  tot = 0;
+  while((n = read(p[0], buf + tot, sizeof(buf) - 1 - tot)) > 0)
+    tot += n;
+  close(p[0]);
+  buf[tot] = 0;
+  if(wait() != pid || strcmp(buf, "spawned\n") != 0){
+    printf(stdout, "spawn test: wrong output\n");
+    exit();
+  }
+  printf(stdout, "spawn test ok\n");
+}
+
+// the profiler collects samples, some in the kernel,
+// while a process makes system calls.
+void
+proftest(void)
+{
+  uint s[4*16];
+  int fd, i, n, kern;
+  uint start;
+
+  printf(stdout, "prof test\n");
+  if((fd = open("prof", O_RDWR)) < 0){
+    printf(stdout, "prof test: cannot open prof\n");
+    exit();
+  }
+  write(fd, "1", 1);
+  start = uptime();
+  while(uptime() - start < 20)
+    getpid();
+  write(fd, "0", 1);
+  kern = 0;
+  while((n = read(fd, s, sizeof(s))) > 0)
+    for(i = 0; i < n/4; i += 4)
+      if(s[i] >= 0x80000000)
+        kern++;
+  close(fd);
+  if(kern == 0){
+    printf(stdout, "prof test: no kernel samples\n");
+    exit();
+  }
+  printf(stdout, "prof test ok\n");
+}
+
+// getstats() counts this process's system calls,
+// and everyone's.
+void
+statstest(void)
+{
+  static struct sysstat a[NSYSCALL], b[NSYSCALL], all[NSYSCALL];
+  int i;
+
+  printf(stdout, "stats test\n");
+  if(getstats(getpid(), a, NSYSCALL) != NSYSCALL){
+    printf(stdout, "stats test: getstats failed\n");
+    exit();
+  }
+  for(i = 0; i < 10; i++)
+    getpid();
+  getstats(getpid(), b, NSYSCALL);
+  getstats(0, all, NSYSCALL);
+  if(b[SYS_getpid].count - a[SYS_getpid].count != 11 ||
+     b[SYS_getpid].cycles <= a[SYS_getpid].cycles ||
+     all[SYS_getpid].count < b[SYS_getpid].count ||
+     getstats(0x7fffffff, a, NSYSCALL) != -1){
+    printf(stdout, "stats test: wrong counts\n");
+    exit();
+  }
+  printf(stdout, "stats test ok\n");
+}
+
+// the trace device records this process sleeping
+// and being switched back in.
+void
+tracetest(void)
+{
+  static struct traceev ev[64];
+  int fd, i, n, sleeps, switches;
+
+  printf(stdout, "trace test\n");
+  if((fd = open("trace", O_RDWR)) < 0){
+    printf(stdout, "trace test: cannot open trace\n");
+    exit();
+  }
+  write(fd, "1", 1);
+  sleep(1);
+  write(fd, "0", 1);
+  sleeps = switches = 0;
+  while((n = read(fd, ev, sizeof(ev))) > 0){
+    for(i = 0; i < n/sizeof(ev[0]); i++){
+      if(ev[i].pid == getpid() && ev[i].type == TR_SLEEP)
+        sleeps++;
+      if(ev[i].type == TR_SWITCH && ev[i].arg == getpid())
+        switches++;
+    }
+  }
+  close(fd);
+  if(sleeps == 0 || switches == 0){
+    printf(stdout, "trace test: missing events\n");
+    exit();
+  }
+  printf(stdout, "trace test ok\n");
+}
+
+// a process can hold NOFILE fds, gets the lowest free one,
+// and passes them all to a child.
+void
+manyfdtest(void)
+{
+  int p[2], fd, i, pid;
+
+  printf(stdout, "many fd test\n");
+  if(pipe(p) < 0){
+    printf(stdout, "many fd test: pipe failed\n");
+    exit();
+  }
+  while((fd = dup(p[1])) >= 0)
+    ;
+  if(dup(p[1]) != -1 || close(NOFILE-1) < 0 || dup(p[1]) != NOFILE-1){
+    printf(stdout, "many fd test: wrong limit\n");
+    exit();
+  }
+  close(500);
+  close(40);
+  if(dup(p[1]) != 40 || dup(p[1]) != 500){
+    printf(stdout, "many fd test: not lowest fd\n");
+    exit();
+  }
+  if((pid = fork()) == 0){
+    if(write(NOFILE-1, "x", 1) != 1)
+      printf(stdout, "many fd test: child lacks fd\n");
+    exit();
+  }
+  wait();
+  for(i = 3; i < NOFILE; i++)
+    if(i != p[0])
+      close(i);
+  if(read(p[0], &i, 1) != 1 || (fd = dup(p[0])) != (p[0] == 3 ? 4 : 3)){
+    printf(stdout, "many fd test: wrong after close\n");
+    exit();
+  }
+  close(fd);
+  close(p[0]);
+  printf(stdout, "many fd test ok\n");
+}
+
+// output printf buffered before a fork() is written once,
+// not again by the child.
+void
+forkflushtest(void)
+{
+  char b[32];
+  int fd, n;
+
+  printf(stdout, "fork flush test\n");
+  if((fd = open("ffile", O_CREATE|O_RDWR)) < 0){
+    printf(stdout, "fork flush test: create failed\n");
+    exit();
+  }
+  printf(fd, "once");
+  if(fork() == 0)
+    exit();
+  wait();
+  close(fd);
+  if((fd = open("ffile", O_RDONLY)) < 0){
+    printf(stdout, "fork flush test: open failed\n");
+    exit();
+  }
+  n = read(fd, b, sizeof(b));
+  close(fd);
+  unlink("ffile");
+  if(n != 4 || memcmp(b, "once", 4) != 0){
+    printf(stdout, "fork flush test: read %d bytes\n", n);
+    exit();
+  }
+  printf(stdout, "fork flush test ok\n");
+}
+
+// a process whose fd table grew must not leave its old fds
+// behind for the next process in its slot.
+void
+fdreusetest(void)
+{
+  struct stat st;
+  int fd, i;
+
+  printf(stdout, "fd reuse test\n");
+  if(fork() == 0){
+    if((fd = open("README", O_RDONLY)) < 0)
+      exit();
+    while(dup(fd) >= 0 && fd < 2*NOFILE0)
+      fd++;
+    exit();
+  }
+  wait();
+  if(fork() == 0){
+    for(i = 3; i < NOFILE0; i++){
+      if(fstat(i, &st) == 0){
+        printf(stdout, "fd reuse test: fd %d still open\n", i);
+        exit();
+      }
+    }
+    exit();
+  }
+  wait();
+  printf(stdout, "fd reuse test ok\n");
+}
+
+// poll waits for whichever of several pipes is ready first,
+// and O_NONBLOCK pipes return -1 instead of waiting.
+void
+polltest(void)
+{
+  static char big[8192];
+  struct pollfd pfd[3];
+  int a[2], b[2], pid;
+  char c;
+
+  printf(stdout, "poll test\n");
+  if(pipe2(a, O_NONBLOCK) < 0 || pipe(b) < 0){
+    printf(stdout, "poll test: pipe failed\n");
+    exit();
+  }
+  if(read(a[0], &c, 1) != -1 || write(a[1], big, sizeof(big)) != 4096 ||
+     write(a[1], "x", 1) != -1){
+    printf(stdout, "poll test: non-blocking pipe waited\n");
+    exit();
+  }
+  pfd[0].fd = a[1];
+  pfd[0].events = POLLOUT;
+  pfd[1].fd = b[0];
+  pfd[1].events = POLLIN;
+  pfd[2].fd = 1000;
+  pfd[2].events = POLLIN;
+  if(poll(pfd, 2, 0) != 0 || poll(pfd, 2, 20) != 0 ||
+     poll(pfd, 3, -1) != 1 || pfd[2].revents != POLLNVAL){
+    printf(stdout, "poll test: nothing should be ready\n");
+    exit();
+  }
+  if((pid = fork()) == 0){
+    sleep(2);
+    write(b[1], "y", 1);
+    exit();
+  }
+  if(poll(pfd, 2, -1) != 1 || pfd[0].revents != 0 || pfd[1].revents != POLLIN ||
+     read(b[0], &c, 1) != 1 || c != 'y'){
+    printf(stdout, "poll test: missed the write\n");
+    exit();
+  }
+  wait();
+  close(b[1]);
+  while(read(a[0], big, sizeof(big)) > 0)
+    ;
+  if(poll(pfd, 2, -1) != 2 || pfd[0].revents != POLLOUT ||
+     pfd[1].revents != POLLHUP){
+    printf(stdout, "poll test: wrong events\n");
+    exit();
+  }
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  printf(stdout, "poll test ok\n");
+}
+
+// processes reading one file share its inode lock, while
+// another keeps rewriting the file under them.
+void
+sharedreadtest(void)
+{
+  static char buf[2048];
+  int fd, i, j, k, pid;
+
+  printf(stdout, "shared read test\n");
+  memset(buf, 'r', sizeof(buf));
+  fd = open("sharedrd", O_CREATE|O_RDWR);
+  for(i = 0; i < 4; i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+  for(k = 0; k < 4; k++){
+    if((pid = fork()) < 0){
+      printf(stdout, "shared read test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      for(i = 0; i < 20; i++){
+        fd = open("sharedrd", k == 0 ? O_RDWR : O_RDONLY);
+        for(j = 0; j < 4; j++){
+          if(k == 0){
+            write(fd, buf, sizeof(buf));
+            continue;
+          }
+          if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+            printf(stdout, "shared read test: short read\n");
+            exit();
+          }
+          if(buf[0] != 'r' || buf[sizeof(buf)-1] != 'r'){
+            printf(stdout, "shared read test: wrong data\n");
+            exit();
+          }
+        }
+        close(fd);
+      }
+      exit();
+    }
+  }
+  for(k = 0; k < 4; k++)
+    wait();
+  unlink("sharedrd");
+  printf(stdout, "shared read test ok\n");
+}
+
+// Copy file src over the start of dst.
+static void
+copyfile(char *src, char *dst)
+{
+  static char buf[512];
+  int fd0, fd1, n;
+
+  fd0 = open(src, O_RDONLY);
+  fd1 = open(dst, O_CREATE|O_WRONLY);
+  if(fd0 < 0 || fd1 < 0){
+    printf(stdout, "copy %s failed\n", src);
+    exit();
+  }
+  while((n = read(fd0, buf, sizeof(buf))) > 0)
+    write(fd1, buf, n);
+  close(fd0);
+  close(fd1);
+}
+
+// exec() shares program pages between processes; rewriting
+// the program must drop them.
+void
+sharedtexttest(void)
+{
+  char *args[] = { "stx", "stxdir", 0 };
+  int i, pid, fd;
+
+  printf(stdout, "shared text test\n");
+  copyfile("echo", "stx");
+  for(i = 0; i < 4; i++){
+    if((pid = fork()) < 0){
+      printf(stdout, "shared text test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      close(1);
+      open("stxout", O_CREATE|O_WRONLY);
+      exec("stx", args);
+      printf(stdout, "shared text test: exec failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+
+  // Now overwrite stx with mkdir, and run it again.
+  copyfile("mkdir", "stx");
+  if((pid = fork()) == 0){
+    exec("stx", args);
+    exit();
+  }
+  wait();
+  if((fd = open("stxdir", O_RDONLY)) < 0){
+    printf(stdout, "shared text test: ran the old program\n");
+    exit();
+  }
+  close(fd);
+  unlink("stxdir");
+  unlink("stxout");
+  unlink("stx");
+  printf(stdout, "shared text test ok\n");
+}
+
+// Pinning the disk interrupt to each CPU in turn must not
+// lose completions.  There is none with the memory disk.
+void
+irqtest(void)
+{
+  char buf[512];
+  int cpu, fd;
+
+  printf(stdout, "irq test\n");
+  if(irqaffinity(14, 99) >= 0 || irqaffinity(99, 0) >= 0 || irqaffinity(0, 0) >= 0){
+    printf(stdout, "irq test: bad irqaffinity succeeded\n");
+    exit();
+  }
+  memset(buf, 'i', sizeof(buf));
+  for(cpu = 0; irqaffinity(14, cpu) == 0; cpu++){
+    fd = open("irqf", O_CREATE|O_RDWR);
+    write(fd, buf, sizeof(buf));
+    fsync(fd);
+    close(fd);
+    unlink("irqf");
+  }
+  if(cpu > 0 && irqaffinity(14, -1) < 0){
+    printf(stdout, "irq test: irqaffinity failed\n");
+    exit();
+  }
+  printf(stdout, "irq test ok\n");
+}
+
+// Writes must show up in file pages that reads have cached,
+// including the partial page at the end of the file.
+void
+pagecachetest(void)
+{
+  int fd, i;
+
+  printf(stdout, "page cache test\n");
+  for(i = 0; i < 6000; i++)
+    buf[i] = i % 251;
+  fd = open("pcf", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, 6000) != 6000){
+    printf(stdout, "page cache test: write failed\n");
+    exit();
+  }
+  if(pread(fd, buf, 6000, 0) != 6000){
+    printf(stdout, "page cache test: read failed\n");
+    exit();
+  }
+  memset(buf, 'z', 200);
+  if(pwrite(fd, buf, 200, 4000) != 200 || pwrite(fd, buf, 200, 6000) != 200){
+    printf(stdout, "page cache test: pwrite failed\n");
+    exit();
+  }
+  if(pread(fd, buf, sizeof(buf), 0) != 6200){
+    printf(stdout, "page cache test: short read\n");
+    exit();
+  }
+  for(i = 0; i < 6200; i++){
+    if((buf[i] & 0xff) != ((i >= 4000 && i < 4200) || i >= 6000 ? 'z' : i % 251)){
+      printf(stdout, "page cache test: wrong byte at %d\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  unlink("pcf");
+  printf(stdout, "page cache test ok\n");
+}
+
+// getdents returns a directory's entries a batch at a time,
+// and fstatat finds them relative to the directory.
+void
+getdentstest(void)
+{
+  struct dirent de[2];
+  struct stat st, root;
+  char name[DIRSIZ+1];
+  int dfd, fd, i, n, total;
+
+  printf(stdout, "getdents test\n");
+  if(mkdir("gdd") < 0){
+    printf(stdout, "getdents test: mkdir failed\n");
+    exit();
+  }
+  for(i = 0; i < 5; i++){
+    strcpy(name, "gdd/f0");
+    name[5] += i;
+    fd = open(name, O_CREATE|O_RDWR);
+    write(fd, "xxxxx", i);
+    close(fd);
+  }
+  dfd = open("gdd", O_RDONLY);
+  total = 0;
+  while((n = getdents(dfd, de, sizeof(de))) > 0){
+    for(i = 0; i < n/sizeof(de[0]); i++){
+      memmove(name, de[i].name, DIRSIZ);
+      name[DIRSIZ] = 0;
+      if(fstatat(dfd, name, &st) < 0 || st.ino != de[i].inum ||
+         (name[0] == 'f' && st.size != name[1] - '0')){
+        printf(stdout, "getdents test: fstatat %s wrong\n", name);
+        exit();
+      }
+      total++;
+    }
+  }
+  stat("/", &root);
+  if(n < 0 || total != 7 || fstatat(dfd, "..", &st) < 0 || st.ino != root.ino ||
+     fstatat(dfd, "nothere", &st) != -1){
+    printf(stdout, "getdents test: wrong entries\n");
+    exit();
+  }
+  close(dfd);
+  fd = open("gdd/f1", O_RDONLY);
+  if(getdents(fd, de, sizeof(de)) != -1){
+    printf(stdout, "getdents test: read a file\n");
+    exit();
+  }
+  close(fd);
+  for(i = 0; i < 5; i++){
+    strcpy(name, "gdd/f0");
+    name[5] += i;
+    unlink(name);
+  }
+  unlink("gdd");
+  printf(stdout, "getdents test ok\n");
+}
+
+// one write() much larger than a log transaction, which
+// filewrite() must split, and rewriting whole blocks in place.
+void
+bigtxntest(void)
+{
+  struct stat st;
+  char *buf;
+  int fd, i, n;
+
+  printf(stdout, "big txn test\n");
+  n = 100*1024;
+  buf = sbrk(n);
+  for(i = 0; i < n; i++)
+    buf[i] = i % 251;
+  unlink("bigtxn");
+  fd = open("bigtxn", O_CREATE|O_RDWR);
+  if(write(fd, "x", 1) != 1 || write(fd, buf, n) != n){
+    printf(stdout, "big txn test: write failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++)
+    buf[i] = (i % 251) ^ 0x55;
+  if(pwrite(fd, buf + 511, 8*BSIZE, 512) != 8*BSIZE){
+    printf(stdout, "big txn test: pwrite failed\n");
+    exit();
+  }
+  close(fd);
+
+  memset(buf, 0, n);
+  fd = open("bigtxn", O_RDONLY);
+  if(read(fd, buf, n) != n || fstat(fd, &st) < 0 || st.size != n+1){
+    printf(stdout, "big txn test: read failed\n");
+    exit();
+  }
+  for(i = 1; i < n; i++){
+    if(buf[i] != (char)(((i-1) % 251) ^ (i >= 512 && i < 512+8*BSIZE ? 0x55 : 0))){
+      printf(stdout, "big txn test: wrong byte at %d\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  unlink("bigtxn");
+  sbrk(-n);
+  printf(stdout, "big txn test ok\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1793,6 +3217,38 @@ main(int argc, char *argv[])
   dirfile();
   iref();
   forktest();
+  cowtest();
+  lazysbrktest();
+  swaptest();
+  clocktest();
+  timepagetest();
+  priotest();
+  affinitytest();
+  mmaptest();
+  rocopytest();
+  iovtest();
+  bigtxntest();
+  icachetest();
+  fsynctest();
+  mounttest();
+  groupstest();
+  memmovetest();
+  clonetest();
+  futextest();
+  shmtest();
+  spawntest();
+  proftest();
+  statstest();
+  tracetest();
+  getdentstest();
+  manyfdtest();
+  fdreusetest();
+  forkflushtest();
+  polltest();
+  sharedreadtest();
+  sharedtexttest();
+  irqtest();
+  pagecachetest();
   bigdir(); // slow
 
   uio();
@@ -0,0 +1,71 @@
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+
+// Threads.  Each one runs on a TSTACK-byte stack from malloc(),
+// whose top two words hold the function and its argument.
+#define TSTACK 4096
+
+static void
+thread_start(void *top)
+{
+  void **v;
+
+  v = top;
+  ((void(*)(void*))v[0])(v[1]);
+  _exit();   // exitflush's buffers belong to the whole process
+}
+
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  void **top;
+  int pid;
+
+  if((stack = malloc(TSTACK)) == 0)
+    return -1;
+  top = (void**)(stack + TSTACK) - 2;
+  top[0] = fn;
+  top[1] = arg;
+  if((pid = clone(thread_start, top, top)) < 0)
+    free(stack);
+  return pid;
+}
+
+// Wait for a thread to finish and free its stack.
+int
+thread_join(void)
+{
+  void *top;
+  int pid;
+
+  if((pid = join(&top)) >= 0)
+    free((char*)((void**)top + 2) - TSTACK);
+  return pid;
+}
+
+void
+lock_init(struct lock *lk)
+{
+  lk->locked = 0;
+}
+
+// lk->locked is 0 when free, 1 when held, and 2 when held
+// with other threads perhaps sleeping in futex_wait on it.
+// Neither call enters the kernel unless the lock is contended.
+void
+lock_acquire(struct lock *lk)
+{
+  if(xchg(&lk->locked, 1) == 0)
+    return;
+  while(xchg(&lk->locked, 2) != 0)
+    futex_wait(&lk->locked, 2);
+}
+
+void
+lock_release(struct lock *lk)
+{
+  if(xchg(&lk->locked, 0) == 2)
+    futex_wake(&lk->locked);
+}
@@ -6,17 +6,31 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "stat.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "vm.h"
+#include "shm.h"
+#include "traps.h"
 
 extern char data[];  // defined by kernel.ld
+extern char timepage[];  // in lapic.c
 pde_t *kpgdir;  // for use in scheduler()
+static int kpteg;  // PTE_G if kernel mappings can be global
 
-// Set up CPU's kernel segment descriptors.
+// Set up CPU's kernel segment descriptors, and turn on
+// global pages so kernel TLB entries survive %cr3 reloads.
 // Run once on entry on each CPU.
 void
 seginit(void)
 {
   struct cpu *c;
 
+  if(kpteg)
+    lcr4(rcr4() | CR4_PGE);
+
   // Map "logical" addresses to virtual addresses using identity map.
   // Cannot share a CODE descriptor for both kernel and user
   // because it would have to have DPL_USR, but the CPU forbids
@@ -42,10 +56,9 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -79,6 +92,36 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
   return 0;
 }
 
+// Like mappages(), but use a 4-Mbyte page wherever va and pa
+// are both 4-Mbyte aligned and at least 4 Mbytes remain,
+// so the kernel's direct map needs almost no page-table pages.
+// size may reach the top of the address space.
+static int
+mapkernel(pde_t *pgdir, void *va, uint size, uint pa, int perm)
+{
+  char *a;
+  uint n;
+
+  a = (char*)va;
+  while(size > 0){
+    if((uint)a % (PGSIZE*NPTENTRIES) == 0 && pa % (PGSIZE*NPTENTRIES) == 0 &&
+       size >= PGSIZE*NPTENTRIES){
+      if(pgdir[PDX(a)] & PTE_P)
+        panic("remap");
+      pgdir[PDX(a)] = pa | perm | PTE_P | PTE_PS;
+      n = PGSIZE*NPTENTRIES;
+    } else {
+      if(mappages(pgdir, a, PGSIZE, pa, perm) < 0)
+        return -1;
+      n = PGSIZE;
+    }
+    a += n;
+    pa += n;
+    size = size > n ? size - n : 0;
+  }
+  return 0;
+}
+
 // There is one page table per process, plus one that's used when
 // a CPU is not running any process (kpgdir). The kernel uses the
 // current process's page table during system calls and interrupts;
@@ -94,6 +137,8 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //                for the kernel's instructions and r/o data
 //   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
 //                                  rw data + free physical memory
+//   KERNBASE+PHYSTOP: the clock page (TIMEPAGE), read-only for
+//                user code as well as the kernel
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
@@ -111,24 +156,51 @@ static struct kmap {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
  { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)TIMEPAGE, V2P(timepage), V2P(timepage)+PGSIZE, PTE_U}, // clock
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
-// Set up kernel part of a page table.
+// Page directories that freevm() has emptied, their kernel
+// entries still in place, for setupkvm() to hand out again.
+#define NPDCACHE 16
+
+struct {
+  struct spinlock lock;
+  int n;
+  pde_t *pgdir[NPDCACHE];
+} pdcache;
+
+// Set up kernel part of a page table.  The first call builds
+// kpgdir; every later page table just copies kpgdir's entries
+// above KERNBASE, sharing its page-table pages.  Those entries
+// never change after boot, and freevm() leaves them alone.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
   struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if(kpgdir){
+    pgdir = 0;
+    acquire(&pdcache.lock);
+    if(pdcache.n > 0)
+      pgdir = pdcache.pgdir[--pdcache.n];
+    release(&pdcache.lock);
+    if(pgdir)
+      return pgdir;
+  }
+  if((pgdir = (pde_t*)kzalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
+  if(kpgdir){
+    memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+            (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
+    return pgdir;
+  }
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
+    if(mapkernel(pgdir, k->virt, k->phys_end - k->phys_start,
+                 (uint)k->phys_start, k->perm | kpteg) < 0) {
       freevm(pgdir);
       return 0;
     }
@@ -140,6 +212,14 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  uint edx;
+
+  // The kernel's mappings are the same in every page table,
+  // so they can be marked global if the CPU has PGE.
+  rdcpuid(1, 0, 0, 0, &edx);
+  if(edx & (1<<13))
+    kpteg = PTE_G;
+  initlock(&pdcache.lock, "pdcache");
   kpgdir = setupkvm();
   switchkvm();
 }
@@ -160,8 +240,8 @@ switchuvm(struct proc *p)
     panic("switchuvm: no process");
   if(p->kstack == 0)
     panic("switchuvm: no kstack");
-  if(p->pgdir == 0)
-    panic("switchuvm: no pgdir");
+  if(p->vm == 0)
+    panic("switchuvm: no vm");
 
   pushcli();
   mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
@@ -169,11 +249,18 @@ switchuvm(struct proc *p)
   mycpu()->gdt[SEG_TSS].s = 0;
   mycpu()->ts.ss0 = SEG_KDATA << 3;
   mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
+  if(havesysenter)
+    wrmsr(MSR_SYSENTER_ESP, (uint)p->kstack + KSTACKSIZE);
   // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  // Switch to process's address space, unless it is already
+  // loaded: the scheduler stays on the last process's page
+  // table, and reloading %cr3 would flush the TLB for nothing.
+  mycpu()->vm = p->vm;
+  if(rcr3() != V2P(p->vm->pgdir))
+    lcr3(V2P(p->vm->pgdir));
   popcli();
 }
 
@@ -186,36 +273,11 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
-{
-  uint i, pa, n;
-  pte_t *pte;
-
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
-  }
-  return 0;
-}
-
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int
@@ -231,13 +293,13 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    if((mem = kzalloc()) == 0 && swapout(SWAPBATCH) > 0)
+      mem = kzalloc();
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -273,13 +335,20 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       char *v = P2V(pa);
       kfree(v);
       *pte = 0;
+    } else if(*pte & PTE_SWAP){
+      swapfree(*pte);
+      *pte = 0;
     }
   }
+  if(rcr3() == V2P(pgdir))
+    lcr3(V2P(pgdir));
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel part is shared with
+// kpgdir and is not freed, and the directory itself may
+// be kept in pdcache for setupkvm() to reuse.
 void
 freevm(pde_t *pgdir)
 {
@@ -288,13 +357,22 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
+      pgdir[i] = 0;
     }
   }
-  kfree((char*)pgdir);
+  // Keep it for the next setupkvm(), if there is room.
+  acquire(&pdcache.lock);
+  if(pdcache.n < NPDCACHE){
+    pdcache.pgdir[pdcache.n++] = pgdir;
+    pgdir = 0;
+  }
+  release(&pdcache.lock);
+  if(pgdir)
+    kfree((char*)pgdir);
 }
 
 // Clear PTE_U on a page. Used to create an inaccessible
@@ -310,37 +388,1000 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
-pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+// Share the present pages of pgdir in [start, end) with d.
+// Writable pages become copy-on-write in both unless share
+// is set, in which case both keep writing the same page.
+static int
+copyrange(pde_t *d, pde_t *pgdir, uint start, uint end, int share)
 {
-  pde_t *d;
-  pte_t *pte;
+  pte_t *pte, *dpte;
   uint pa, i, flags;
-  char *mem;
 
-  if((d = setupkvm()) == 0)
-    return 0;
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
+    // Pages not yet faulted in stay that way in the child.
     if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+      continue;
+    if(*pte & PTE_SWAP){
+      // The child shares the swap slot too.
+      if((dpte = walkpgdir(d, (void*)i, 1)) == 0 || swapdup(*pte) < 0)
+        return -1;
+      *dpte = *pte;
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+      return -1;
+    kincref(P2V(pa));
+  }
+  return 0;
+}
+
+// Given a parent process's page table, create a copy
+// of it for a child.  The child shares the parent's pages:
+// writable pages become read-only and copy-on-write in both
+// page tables, and are copied by pagefault() on the first write.
+// Mappings in vma above sz are copied too; MAP_SHARED ones
+// stay writable and shared.  The caller must flush the
+// parent's TLB entries, which may have lost PTE_W.
+pde_t*
+copyuvm(pde_t *pgdir, uint sz, struct vma *vma)
+{
+  pde_t *d;
+  struct vma *v;
+
+  if((d = setupkvm()) == 0)
+    return 0;
+  if(copyrange(d, pgdir, 0, sz, 0) < 0)
+    goto bad;
+  for(v = vma; v < &vma[NVMA]; v++)
+    if((v->ip || v->shm) && v->start >= sz &&
+       copyrange(d, pgdir, v->start, v->end, v->flags & VMA_SHARED) < 0)
       goto bad;
+  return d;
+
+bad:
+  freevm(d);
+  return 0;
+}
+
+//PAGEBREAK!
+// Address spaces.
+//
+// A struct vmspace is shared by the threads made by clone(),
+// which may run on several CPUs at once.  vm->lock guards the
+// page table, so that two threads faulting on one page do
+// not both fill it in.  vm->mlock keeps the vma table still
+// while pages are read in from a file.
+//
+// A CPU may go on using a TLB entry after another CPU has
+// changed or removed its PTE.  So before a page is freed that
+// another CPU running in vm may have mapped, tlbflush() has
+// every such CPU (c->vm == vm) flush its TLB, with an IPI, and
+// waits for them.  That wait must not hold spinlocks, since the
+// other CPU may be spinning for one with interrupts off; when a
+// fault happens with spinlocks held, cowcopy() leaves the old
+// page on vm->stale instead, for vmdrain() to free later.
+
+// A page released by cowcopy() that other CPUs may still map.
+struct stale {
+  struct stale *next;
+  char *page;
+};
+
+static struct vmspace*
+vmalloc(pde_t *pgdir)
+{
+  struct vmspace *vm;
+
+  if((vm = kmalloc(sizeof(*vm))) == 0)
+    return 0;
+  memset(vm, 0, sizeof(*vm));
+  initsleeplock(&vm->mlock, "vm");
+  initlock(&vm->lock, "vm");
+  vm->ref = 1;
+  vm->nlive = 1;
+  vm->pgdir = pgdir;
+  return vm;
+}
+
+// Allocate an address space holding only the kernel.
+struct vmspace*
+vmnew(void)
+{
+  struct vmspace *vm;
+  pde_t *pgdir;
+
+  if((pgdir = setupkvm()) == 0)
+    return 0;
+  if((vm = vmalloc(pgdir)) == 0)
+    freevm(pgdir);
+  return vm;
+}
+
+// Make a copy-on-write copy of vm, for fork().
+struct vmspace*
+vmcopy(struct vmspace *vm)
+{
+  struct vmspace *nvm;
+  pde_t *pgdir;
+
+  for(;;){
+    acquiresleep(&vm->mlock);
+    acquire(&vm->lock);
+    pgdir = copyuvm(vm->pgdir, vm->sz, vm->vma);
+    release(&vm->lock);
+    if(pgdir)
+      break;
+    releasesleep(&vm->mlock);
+    // Out of memory: page some out and try again.
+    if(swapout(SWAPBATCH) == 0)
+      return 0;
+  }
+  // vm's PTEs lost PTE_W; flush its stale TLB entries.
+  tlbflush(vm);
+  if((nvm = vmalloc(pgdir)) == 0){
+    releasesleep(&vm->mlock);
+    freevm(pgdir);
+    return 0;
+  }
+  nvm->sz = vm->sz;
+  vmadup(nvm->vma, vm->vma);
+  releasesleep(&vm->mlock);
+  return nvm;
+}
+
+// Add a process to vm, for clone().
+void
+vmshare(struct vmspace *vm)
+{
+  __sync_fetch_and_add(&vm->ref, 1);
+  __sync_fetch_and_add(&vm->nlive, 1);
+}
+
+// A process has stopped running in vm.  If it was the last,
+// write back and drop vm's file mappings.
+// Must not be called inside a transaction.
+void
+vmexit(struct vmspace *vm)
+{
+  if(__sync_sub_and_fetch(&vm->nlive, 1) > 0)
+    return;
+  vmaflush(vm);
+  begin_op();
+  vmafree(vm->vma);
+  end_op();
+}
+
+// Drop a process's reference to vm, and free vm with
+// the last one.
+void
+vmput(struct vmspace *vm)
+{
+  struct stale *s;
+
+  if(__sync_sub_and_fetch(&vm->ref, 1) > 0)
+    return;
+  while((s = vm->stale) != 0){
+    vm->stale = s->next;
+    kfree(s->page);
+    kmfree(s);
+  }
+  freevm(vm->pgdir);
+  kmfree(vm);
+}
+
+// Does some other CPU have vm's page table loaded?
+static int
+tlbothers(struct vmspace *vm)
+{
+  struct cpu *c, *me;
+
+  pushcli();
+  me = mycpu();
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c != me && c->vm == vm)
+      break;
+  popcli();
+  return c < cpus+ncpu;
+}
+
+// Flush this CPU's TLB if another CPU has asked it to.
+// Called from the IPI handler, and by CPUs waiting in
+// tlbflush(), which might otherwise wait for each other.
+void
+tlbintr(void)
+{
+  struct cpu *c;
+  uint req;
+
+  pushcli();
+  c = mycpu();
+  req = c->tlbreq;
+  if(c->tlbdone != req){
+    lcr3(rcr3());
+    c->tlbdone = req;
+  }
+  popcli();
+}
+
+// Flush the TLB of every CPU that has vm's page table loaded,
+// and wait for them.  Must not be called with spinlocks held.
+void
+tlbflush(struct vmspace *vm)
+{
+  struct cpu *c, *me;
+  uint n;
+
+  pushcli();
+  me = mycpu();
+  if(me->vm == vm)
+    lcr3(rcr3());
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c == me || c->vm != vm)
+      continue;
+    n = __sync_add_and_fetch(&c->tlbreq, 1);
+    lapicipi(c->apicid, T_IRQ0 + IRQ_TLB);
+    // A CPU that loads another page table flushes its TLB too.
+    while((int)(c->tlbdone - n) < 0 && c->vm == vm){
+      tlbintr();
+      pause();
+    }
+  }
+  popcli();
+}
+
+// Remember that page, replaced by cowcopy(), may still be
+// mapped by other CPUs' TLBs.  Caller holds vm->lock.
+static int
+vmstale(struct vmspace *vm, char *page)
+{
+  struct stale *s;
+
+  if((s = kmalloc(sizeof(*s))) == 0)
+    return -1;
+  s->page = page;
+  s->next = vm->stale;
+  vm->stale = s;
+  return 0;
+}
+
+// Flush other CPUs' TLBs of the pages on vm->stale, and
+// free them.  Must not be called with spinlocks held.
+void
+vmdrain(struct vmspace *vm)
+{
+  struct stale *s, *next;
+
+  if(vm->stale == 0)
+    return;
+  acquire(&vm->lock);
+  s = vm->stale;
+  vm->stale = 0;
+  release(&vm->lock);
+  if(s == 0)
+    return;
+  tlbflush(vm);
+  for(; s; s = next){
+    next = s->next;
+    kfree(s->page);
+    kmfree(s);
+  }
+}
+
+// Unmap and free vm's pages in [start, end), which need not be
+// page aligned, a batch at a time: each batch is only freed
+// once no CPU's TLB can still map it.  Caller holds vm->mlock
+// and no spinlocks.
+void
+vmclear(struct vmspace *vm, uint start, uint end)
+{
+  uint pa[64], a;
+  pte_t *pte;
+  int n;
+
+  a = PGROUNDUP(start);
+  while(a < end){
+    n = 0;
+    acquire(&vm->lock);
+    for(; a < end && n < NELEM(pa); a += PGSIZE){
+      pte = walkpgdir(vm->pgdir, (char*)a, 0);
+      if(!pte)
+        a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      else if(*pte & PTE_P){
+        pa[n++] = PTE_ADDR(*pte);
+        *pte = 0;
+      } else if(*pte & PTE_SWAP){
+        swapfree(*pte);
+        *pte = 0;
+      }
+    }
+    release(&vm->lock);
+    tlbflush(vm);
+    while(n > 0)
+      kfree(P2V(pa[--n]));
+  }
+}
+
+// Give pgdir a private, writable copy of the copy-on-write
+// page mapped by pte at va.  Returns 0 on success, -1 if
+// out of memory.  If vm is not 0, pgdir is its page table,
+// and caller must hold vm->lock: when other CPUs may still
+// have the old page in their TLBs, it is not released until
+// vmdrain() has flushed them.
+static int
+cowcopy(struct vmspace *vm, pde_t *pgdir, pte_t *pte, uint va)
+{
+  uint pa, flags;
+  char *mem;
+  int stale;
+
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcount(P2V(pa)) == 1){
+    // Last sharer: take the page over.
+    *pte = pa | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
     memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
+    stale = vm && tlbothers(vm);
+    if(stale && vmstale(vm, P2V(pa)) < 0){
       kfree(mem);
-      goto bad;
+      return -1;
     }
+    *pte = V2P(mem) | flags;
+    if(!stale)
+      kfree(P2V(pa));
   }
-  return d;
+  if(rcr3() == V2P(pgdir))
+    invlpg((void*)va);
+  return 0;
+}
 
-bad:
-  freevm(d);
+// Fill in page va of vm from vma v: read the part of
+// the page that lies within the file, and zero the rest.
+// The page is writable only if v is.  A program's pages
+// that are not being written come from textget(), shared
+// and copy-on-write.
+// Reading may sleep, so this must not be called with
+// spinlocks held.  The caller holds vm->mlock, which keeps
+// v in place.
+static int
+vmafill(struct vmspace *vm, struct vma *v, uint va, int write)
+{
+  char *mem;
+  uint n, foff, perm;
+  pte_t *pte;
+  int r;
+
+  perm = PTE_U | (v->flags & VMA_WRITE ? PTE_W : 0);
+  foff = va - v->start;
+  n = foff < v->filesz ? v->filesz - foff : 0;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if(n > 0 && (v->flags & VMA_TEXT) && !write){
+    ilockshared(v->ip);
+    mem = textget(v->ip, v->off + foff, n);
+    iunlockshared(v->ip);
+    if(mem == 0)
+      return -1;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else {
+    if((mem = kzalloc()) == 0 && swapout(SWAPBATCH) > 0)
+      mem = kzalloc();
+    if(mem == 0)
+      return -1;
+    if(n > 0){
+      ilockshared(v->ip);
+      if(readi(v->ip, mem, v->off + foff, n) != n){
+        iunlockshared(v->ip);
+        kfree(mem);
+        return -1;
+      }
+      iunlockshared(v->ip);
+    }
+  }
+
+  // Another thread may have filled the page while we slept,
+  // and it may even have been paged out since.
+  r = 0;
+  acquire(&vm->lock);
+  if((pte = walkpgdir(vm->pgdir, (void*)va, 0)) != 0 && (*pte & (PTE_P|PTE_SWAP)))
+    kfree(mem);
+  else if(mappages(vm->pgdir, (void*)va, PGSIZE, V2P(mem), perm) < 0){
+    kfree(mem);
+    r = -1;
+  }
+  release(&vm->lock);
+  return r;
+}
+
+// Map a fresh zeroed page at va in pgdir.
+static int
+zerofill(pde_t *pgdir, uint va)
+{
+  char *mem;
+
+  if((mem = kzalloc()) == 0)
+    return -1;
+  if(mappages(pgdir, (void*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Are spinlocks held?  Then a fault must not sleep.
+static int
+nosleep(void)
+{
+  int n;
+
+  pushcli();
+  n = mycpu()->ncli;
+  popcli();
+  return n > 1;
+}
+
+//PAGEBREAK!
+// Paging out (see swap.c).
+
+// Is va in a region whose pages others may see?
+// Caller must hold vm->lock.
+static int
+vmashared(struct vmspace *vm, uint va)
+{
+  struct vma *v;
+
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if((v->shm || (v->ip && (v->flags & VMA_SHARED))) &&
+       va >= v->start && va < v->end)
+      return 1;
+  return 0;
+}
+
+// Move the clock hand over vm's user pages from *va, clearing
+// PTE_A, to the first private page not used since the hand last
+// went by.  Make its PTE point at swap slot s instead, and
+// return the page, for the caller to write out and free once
+// no TLB maps it; set *va just past it.  Returns 0, with *va
+// at KERNBASE, if there is no such page.  Caller holds
+// vm->mlock, so that swapin() waits for the write.
+//
+// An address space some CPU is running a process in is left
+// alone, since it is plainly in use.  That check reads
+// c->proc and p->vm without ptable.lock, and so may be stale
+// by the time a page goes, which is harmless: the proc
+// structures are never freed and p->vm is only compared, and
+// a process that starts running just afterwards takes the page
+// back with a fault.  The kernel does not rely on the pages
+// staying put either; it touches user memory holding spinlocks
+// only through ucopyin() and ucopyout(), or uva2ka() under
+// vm->lock, and if a page has gone it lets go of its locks
+// and calls uvmfaultin() again.
+char*
+vmevict(struct vmspace *vm, uint *va, uint s)
+{
+  pte_t *pte, e;
+  struct proc *p;
+  struct cpu *c;
+  char *mem;
+  uint a;
+
+  mem = 0;
+  for(c = cpus; c < cpus+ncpu; c++)
+    if((p = c->proc) != 0 && p->vm == vm)
+      *va = KERNBASE;
+  acquire(&vm->lock);
+  for(a = *va; a < KERNBASE; a += PGSIZE){
+    if((vm->pgdir[PDX(a)] & PTE_P) == 0){
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    pte = walkpgdir(vm->pgdir, (void*)a, 0);
+    e = *pte;
+    if((e & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      continue;
+    if(krefcount(P2V(PTE_ADDR(e))) != 1 || vmashared(vm, a))
+      continue;
+    if(e & PTE_A){
+      *pte &= ~PTE_A;  // second chance
+      continue;
+    }
+    mem = P2V(PTE_ADDR(e));
+    *pte = (s << PTXSHIFT) | (PTE_FLAGS(e) & ~PTE_P) | PTE_SWAP;
+    break;
+  }
+  release(&vm->lock);
+  *va = mem ? a + PGSIZE : KERNBASE;
+  return mem;
+}
+
+// Read the page at va of vm back in, if it is still paged out.
+// Returns 0, or -1 if out of memory.  Caller must not hold
+// spinlocks or vm->mlock.
+static int
+swapin(struct vmspace *vm, uint va)
+{
+  pte_t *pte, e;
+  char *mem;
+
+  acquiresleep(&vm->mlock);
+  acquire(&vm->lock);
+  pte = walkpgdir(vm->pgdir, (void*)va, 0);
+  e = pte ? *pte : 0;
+  release(&vm->lock);
+  if((e & PTE_SWAP) == 0){
+    releasesleep(&vm->mlock);
+    return 0;  // another thread read it in
+  }
+  if((mem = kalloc()) == 0 && swapout(SWAPBATCH) > 0)
+    mem = kalloc();
+  if(mem == 0){
+    releasesleep(&vm->mlock);
+    return -1;
+  }
+  swapread(e, mem);
+  acquire(&vm->lock);
+  *pte = V2P(mem) | (PTE_FLAGS(e) & ~PTE_SWAP) | PTE_P;
+  release(&vm->lock);
+  swapfree(e);
+  releasesleep(&vm->mlock);
+  return 0;
+}
+
+// A fault could not be resolved, for lack of memory if oom is
+// set.  Page something out and have the fault retried, if
+// that is possible.
+static int
+swapretry(int oom)
+{
+  if(oom && !nosleep() && swapout(SWAPBATCH) > 0)
+    return 0;
+  return -1;
+}
+
+// Handle a page fault at virtual address va in process p with
+// hardware error code err.  Returns 0 if the fault was
+// resolved and the faulting instruction can be restarted,
+// or -1 if the access was illegal.
+int
+pagefault(struct proc *p, uint va, uint err)
+{
+  struct vmspace *vm;
+  pte_t *pte;
+  struct vma *v;
+  int r, oom;
+
+  if(va >= KERNBASE)
+    return -1;
+  vm = p->vm;
+  va = PGROUNDDOWN(va);
+  oom = 0;
+  acquire(&vm->lock);
+  if((pte = walkpgdir(vm->pgdir, (void*)va, 0)) != 0 && (*pte & PTE_P)){
+    r = -1;
+    if((err & FEC_WR) && (*pte & PTE_COW)){
+      r = cowcopy(vm, vm->pgdir, pte, va);
+      oom = r < 0;
+    } else if((err & FEC_WR) && (*pte & (PTE_W|PTE_U)) == (PTE_W|PTE_U)){
+      // Another thread already made the page writable;
+      // this CPU's TLB entry was stale.
+      invlpg((void*)va);
+      r = 0;
+    }
+    release(&vm->lock);
+    if(r == 0 && !nosleep())
+      vmdrain(vm);
+    return r == 0 ? 0 : swapretry(oom);
+  }
+
+  // Not present: read it back from swap, or page in from the
+  // file mapped there, if any, or else allocate a zeroed page
+  // of the lazily grown heap.
+  if(pte && (*pte & PTE_SWAP)){
+    release(&vm->lock);
+    return nosleep() ? -1 : swapin(vm, va);
+  }
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->ip && va >= v->start && va < v->end)
+      break;
+  if(v == &vm->vma[NVMA]){
+    r = -1;
+    if(va < vm->sz){
+      r = zerofill(vm->pgdir, va);
+      oom = r < 0;
+    }
+    release(&vm->lock);
+    return r == 0 ? 0 : swapretry(oom);
+  }
+  release(&vm->lock);
+  if(nosleep())
+    return -1;
+
+  // Look again with the table held still.
+  r = -1;
+  acquiresleep(&vm->mlock);
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->ip && va >= v->start && va < v->end){
+      r = vmafill(vm, v, va, err & FEC_WR);
+      break;
+    }
+  }
+  releasesleep(&vm->mlock);
+  return r;
+}
+
+// Make sure the pages of p holding user addresses [va, va+n)
+// are present, and writable if write is set, so that the kernel
+// can then use them without taking page faults that might need
+// to sleep.  A write breaks copy-on-write sharing up front and
+// fails on pages the user may not write.
+int
+uvmfaultin(struct proc *p, uint va, uint n, int write)
+{
+  uint a, need;
+  pte_t *pte;
+
+  need = write ? PTE_P|PTE_U|PTE_W : PTE_P|PTE_U;
+  for(a = PGROUNDDOWN(va); a < va + n; ){
+    pte = walkpgdir(p->vm->pgdir, (void*)a, 0);
+    if(pte && (*pte & need) == need){
+      a += PGSIZE;
+      continue;
+    }
+    // Swapping a page back in can leave it copy-on-write,
+    // so look at the page again afterwards.
+    if(pagefault(p, a, write ? FEC_WR : 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Copy the vma table src into dst, taking new
+// references to the files.
+void
+vmadup(struct vma *dst, struct vma *src)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    dst[i] = src[i];
+    if(dst[i].ip)
+      idup(dst[i].ip);
+    if(dst[i].shm)
+      shmdup(dst[i].shm);
+  }
+}
+
+// Drop the files referenced by the vma table v.
+// Must be called inside a transaction since it calls iput().
+void
+vmafree(struct vma *v)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    if(v[i].ip){
+      iput(v[i].ip);
+      v[i].ip = 0;
+    }
+    if(v[i].shm){
+      shmput(v[i].shm);
+      v[i].shm = 0;
+    }
+  }
+}
+
+// Does any vma in v overlap [start, end)?
+int
+vmaoverlap(struct vma *v, uint start, uint end)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++)
+    if((v[i].ip || v[i].shm) && v[i].start < end && v[i].end > start)
+      return 1;
+  return 0;
+}
+
+// Find a free slot in vm's vma table and the highest free
+// range of n bytes below KERNBASE; set *va to its start.
+// Returns the slot, or 0.  Caller must hold vm->mlock.
+static struct vma*
+vmaplace(struct vmspace *vm, uint n, uint *va)
+{
+  struct vma *v, *w;
+  uint top;
+
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->ip == 0 && v->shm == 0)
+      break;
+  if(v == &vm->vma[NVMA])
+    return 0;
+
+  top = KERNBASE;
+again:
+  if(top < n || top - n < PGROUNDUP(vm->sz))
+    return 0;
+  for(w = vm->vma; w < &vm->vma[NVMA]; w++){
+    if((w->ip || w->shm) && w->start < top && w->end > top - n){
+      top = w->start;
+      goto again;
+    }
+  }
+  *va = top - n;
+  return v;
+}
+
+// Map n bytes of file ip starting at offset off into p's
+// address space, at the highest free range below KERNBASE.
+// Returns the address, or -1.
+int
+vmamap(struct proc *p, struct inode *ip, uint off, uint n, int flags)
+{
+  struct vmspace *vm;
+  struct vma *v;
+  uint va, size;
+
+  vm = p->vm;
+  n = PGROUNDUP(n);
+  if(n == 0)
+    return -1;
+  ilock(ip);
+  if(ip->type != T_FILE){
+    iunlock(ip);
+    return -1;
+  }
+  size = ip->size;
+  iunlock(ip);
+
+  acquiresleep(&vm->mlock);
+  if((v = vmaplace(vm, n, &va)) == 0){
+    releasesleep(&vm->mlock);
+    return -1;
+  }
+  acquire(&vm->lock);
+  v->start = va;
+  v->end = va + n;
+  v->ip = idup(ip);
+  v->off = off;
+  v->filesz = size > off ? size - off : 0;
+  if(v->filesz > n)
+    v->filesz = n;
+  v->flags = flags;
+  release(&vm->lock);
+  releasesleep(&vm->mlock);
+  return va;
+}
+
+// Write the dirty pages of v in [start, end) of vm back to
+// its file, if v is a writable MAP_SHARED mapping.  Writes go
+// through the log a few blocks at a time, like filewrite().
+// Each page's PTE_D is cleared and every TLB that may cache it
+// flushed before the page is written, so that a store made
+// meanwhile sets PTE_D again rather than being lost; and the
+// page is held with kincref() in case another thread unmaps it
+// during the write.
+static void
+vmasync(struct vmspace *vm, struct vma *v, uint start, uint end)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+  uint a, foff, n, i, n1;
+  pte_t *pte;
+  char *mem;
+
+  if((v->flags & (VMA_WRITE|VMA_SHARED)) != (VMA_WRITE|VMA_SHARED))
+    return;
+  for(a = start; a < end; a += PGSIZE){
+    foff = a - v->start;
+    if(foff >= v->filesz)
+      break;
+    acquire(&vm->lock);
+    pte = walkpgdir(vm->pgdir, (void*)a, 0);
+    if(pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D)){
+      release(&vm->lock);
+      continue;
+    }
+    *pte &= ~PTE_D;
+    mem = P2V(PTE_ADDR(*pte));
+    kincref(mem);
+    release(&vm->lock);
+    tlbflush(vm);
+    n = v->filesz - foff;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    for(i = 0; i < n; i += n1){
+      n1 = n - i;
+      if(n1 > max)
+        n1 = max;
+      begin_op();
+      ilock(v->ip);
+      writei(v->ip, mem + i, v->off + foff + i, n1);
+      iunlock(v->ip);
+      end_op();
+    }
+    kfree(mem);
+  }
+}
+
+// Write back every MAP_SHARED mapping in vm.
+// Must not be called inside a transaction.
+void
+vmaflush(struct vmspace *vm)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++)
+    if(vm->vma[i].ip)
+      vmasync(vm, &vm->vma[i], vm->vma[i].start, vm->vma[i].end);
+}
+
+// Remove p's mappings in [a, a+n), writing back shared pages
+// first.  Only mmap regions, which lie above p's size, can be
+// removed.  Returns 0, or -1 on bad arguments.
+int
+vmaunmap(struct proc *p, uint a, uint n)
+{
+  struct vmspace *vm;
+  struct vma sync[NVMA], *v, *nv;
+  struct inode *drop[NVMA];
+  uint s, e, end, adv;
+  int i, ns, nd, r;
+
+  vm = p->vm;
+  n = PGROUNDUP(n);
+  end = a + n;
+  if(a % PGSIZE || n == 0 || end < a || end > KERNBASE)
+    return -1;
+
+  // Write the shared pages back from a copy of the table:
+  // vmasync() starts transactions, and a thread faulting
+  // inside one may be waiting for vm->mlock.
+  ns = 0;
+  acquire(&vm->lock);
+  if(a < vm->sz){
+    release(&vm->lock);
+    return -1;
+  }
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->ip && v->end > a && v->start < end){
+      sync[ns] = *v;
+      idup(v->ip);
+      ns++;
+    }
+  }
+  release(&vm->lock);
+  for(i = 0; i < ns; i++){
+    s = sync[i].start > a ? sync[i].start : a;
+    e = sync[i].end < end ? sync[i].end : end;
+    vmasync(vm, &sync[i], s, e);
+  }
+
+  r = 0;
+  nd = 0;
+  acquiresleep(&vm->mlock);
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++){
+    if(v->ip == 0 || v->end <= a || v->start >= end)
+      continue;
+    s = v->start > a ? v->start : a;
+    e = v->end < end ? v->end : end;
+    nv = 0;
+    if(s > v->start && e < v->end){
+      // Splitting v in two needs another slot.
+      for(nv = vm->vma; nv < &vm->vma[NVMA]; nv++)
+        if(nv->ip == 0 && nv->shm == 0)
+          break;
+      if(nv == &vm->vma[NVMA]){
+        r = -1;
+        break;
+      }
+    }
+    acquire(&vm->lock);
+    if(nv){
+      *nv = *v;
+      adv = e - v->start;
+      nv->start = e;
+      nv->off += adv;
+      nv->filesz = nv->filesz > adv ? nv->filesz - adv : 0;
+      idup(nv->ip);
+    }
+    if(s == v->start && e == v->end){
+      drop[nd++] = v->ip;
+      v->ip = 0;
+    } else if(s == v->start){
+      adv = e - v->start;
+      v->start = e;
+      v->off += adv;
+      v->filesz = v->filesz > adv ? v->filesz - adv : 0;
+    } else {
+      v->end = s;
+      if(v->filesz > s - v->start)
+        v->filesz = s - v->start;
+    }
+    release(&vm->lock);
+    vmclear(vm, s, e);
+  }
+  releasesleep(&vm->mlock);
+
+  begin_op();
+  for(i = 0; i < nd; i++)
+    iput(drop[i]);
+  for(i = 0; i < ns; i++)
+    iput(sync[i].ip);
+  end_op();
+  return r;
+}
+
+// Map all of shared memory segment s into p's address space,
+// writable, at the highest free range below KERNBASE.
+// The caller's reference to s passes to the mapping.
+// Returns the address, or -1.
+int
+vmshmat(struct proc *p, struct shm *s)
+{
+  struct vmspace *vm;
+  struct vma *v;
+  uint va, i;
+
+  vm = p->vm;
+  acquiresleep(&vm->mlock);
+  if((v = vmaplace(vm, s->npage*PGSIZE, &va)) == 0){
+    releasesleep(&vm->mlock);
+    return -1;
+  }
+  acquire(&vm->lock);
+  for(i = 0; i < s->npage; i++){
+    if(mappages(vm->pgdir, (char*)va + i*PGSIZE, PGSIZE,
+                V2P(s->page[i]), PTE_W|PTE_U) < 0){
+      release(&vm->lock);
+      vmclear(vm, va, va + i*PGSIZE);
+      releasesleep(&vm->mlock);
+      return -1;
+    }
+    kincref(s->page[i]);
+  }
+  memset(v, 0, sizeof(*v));
+  v->start = va;
+  v->end = va + s->npage*PGSIZE;
+  v->shm = s;
+  v->flags = VMA_WRITE|VMA_SHARED;
+  release(&vm->lock);
+  releasesleep(&vm->mlock);
+  return va;
+}
+
+// Remove the shared memory segment p attached at va.
+// Returns 0, or -1 if there is none.
+int
+vmshmdt(struct proc *p, uint va)
+{
+  struct vmspace *vm;
+  struct vma *v;
+  struct shm *s;
+
+  vm = p->vm;
+  acquiresleep(&vm->mlock);
+  for(v = vm->vma; v < &vm->vma[NVMA]; v++)
+    if(v->shm && v->start == va)
+      break;
+  if(v == &vm->vma[NVMA]){
+    releasesleep(&vm->mlock);
+    return -1;
+  }
+  acquire(&vm->lock);
+  s = v->shm;
+  v->shm = 0;
+  release(&vm->lock);
+  vmclear(vm, v->start, v->end);
+  releasesleep(&vm->mlock);
+  shmput(s);
   return 0;
 }
 
@@ -352,28 +1393,34 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
-// Copy len bytes from p to user address va in page table pgdir.
-// Most useful when pgdir is not the current page table.
-// uva2ka ensures this only works for PTE_U pages.
+// Copy len bytes from p to user address va in page table pgdir,
+// walking it once per page.  For a page table that is not the
+// current one; see ucopyout() for that.  Only PTE_U pages are
+// written.  The copy goes through the kernel's mapping of the
+// page, so copy-on-write pages must be made private first.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
-    pa0 = uva2ka(pgdir, (char*)va0);
-    if(pa0 == 0)
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if(pte == 0 || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      return -1;
+    if((*pte & PTE_COW) && cowcopy(0, pgdir, pte, va0) < 0)
       return -1;
+    pa0 = P2V(PTE_ADDR(*pte));
     n = PGSIZE - (va - va0);
     if(n > len)
       n = len;
@@ -385,6 +1432,46 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
   return 0;
 }
 
+// Copy n bytes from user address va of the current process to
+// dst.  Rather than walking the page table, let the MMU check
+// the pages: one that is missing is faulted in as if the
+// process had touched it, and one that cannot be makes the
+// copy fail.  With a spinlock held, pages that would have to
+// be read in fail too; the caller can fault them in with
+// uvmfaultin() after letting go.
+int
+ucopyin(void *dst, uint va, uint n)
+{
+  if(va >= KERNBASE || va + n < va || va + n > KERNBASE)
+    return -1;
+  return ucopy(dst, (void*)va, n);
+}
+
+// Copy n bytes from src to user address va of the current
+// process, as ucopyin() does.
+int
+ucopyout(uint va, void *src, uint n)
+{
+  if(va >= KERNBASE || va + n < va || va + n > KERNBASE)
+    return -1;
+  return ucopy((void*)va, src, n);
+}
+
+// Copy n bytes from src to dst, either of which may be a user
+// address of the current process, for code such as readi()
+// that serves both the kernel and system calls.  Returns -1
+// if a user page cannot be used.
+int
+umove(void *dst, const void *src, uint n)
+{
+  if((uint)dst < KERNBASE)
+    return ucopyout((uint)dst, (void*)src, n);
+  if((uint)src < KERNBASE)
+    return ucopyin(dst, (uint)src, n);
+  memmove(dst, src, n);
+  return 0;
+}
+
 //PAGEBREAK!
 // Blank page.
 //PAGEBREAK!
@@ -0,0 +1,12 @@
+// A user address space: page table, size and file mappings.
+// The threads of a process, made by clone(), share one.
+struct vmspace {
+  struct sleeplock mlock;      // Serializes changes to sz and vma, and page-ins
+  struct spinlock lock;        // Protects the page table, sz and vma
+  int ref;                     // Processes using it, zombies included
+  int nlive;                   // Processes using it that have not exited
+  pde_t *pgdir;                // Page table
+  uint sz;                     // Size of process memory (bytes)
+  struct vma vma[NVMA];        // Demand-loaded file regions
+  struct stale *stale;         // Replaced pages other CPUs may still map
+};